@@ -10,8 +10,8 @@
 class Shor{
     public:
         Shor(int composite_number, int w, int gcfreq,  bool v = false ):
-            n(composite_number), coprime_a(2), _nworkers(w), verbose(v), s(w, gcfreq), 
-            required_bits(std::ceil(std::log2(composite_number))), n_qubits(2 * required_bits + 3),  approximate(false) {
+            n(composite_number), coprime_a(2), required_bits(std::ceil(std::log2(composite_number))),
+            n_qubits(2 * required_bits + 3), verbose(v), approximate(false), _nworkers(w), s(w, gcfreq) {
                 if(n%2 == 0){
                     std::cout<<"only support factorizing odd numbers"<<std::endl;
                     exit(1);
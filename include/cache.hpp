@@ -6,10 +6,11 @@
 #include <algorithm>
 #include <type_traits>
 #include "dd.h"
+#include "table.hpp"
 #include <cassert>
 #include <random>
-#include <mutex>
-#include <shared_mutex>
+#include <atomic>
+#include <cstring>
 
 
 #ifdef __cpp_lib_hardware_interference_size
@@ -23,15 +24,46 @@
 
 struct Scheduler;
 
+/*
+ * Entries are not dropped when the unique tables are collected. Instead each
+ * entry records gcEpoch when it is written, and a node it refers to is still
+ * the node it was then only if it has not been freed (v == -2) and has not
+ * been handed out again by a later epoch. With isMT a concurrent collection
+ * also has its say, see admit().
+ */
+template <typename N> inline bool isCurrent(const N *n, std::uint16_t epoch) {
+#ifdef isMT
+    // first, as a concurrent sweep only frees what admit() turns down
+    if (!admit(const_cast<N *>(n))) {
+        return false;
+    }
+#endif
+    return n->v != -2 && n->gen <= epoch;
+}
+
 
 class AddCache{
     friend struct Scheduler;
     public:
-        AddCache(QubitCount q):_tables{2}, rng(std::random_device()()), dist(0,1){
+        // `buckets` is the length of each per-level table, or with FLAT_CACHE
+        // the length (a power of two) of the array shared by all levels.
+        AddCache(QubitCount q, std::size_t buckets = CACHE_BUCKETS,
+                 [[maybe_unused]] std::size_t chunk = CACHE_CHUNK_SIZE,
+                 [[maybe_unused]] std::size_t growth = GROWTH_FACTOR)
+            :
+#ifndef FLAT_CACHE
+             c(chunk, growth),
+#endif
+             _tables{2}, rng(std::random_device()()), dist(0,1), _stats(q), _buckets(buckets){
 
             assert(_tables.size() == 2);
-            for(auto i = 0; i < _tables.size(); i++){
+            for(std::size_t i = 0; i < _tables.size(); i++){
+#ifdef FLAT_CACHE
+                assert((buckets & (buckets - 1)) == 0);
+                _tables[i].resize(buckets);
+#else
                 _tables[i].resize(q);
+#endif
             }
 
         }
@@ -56,12 +88,14 @@ class AddCache{
                 }
 
                 Qubit lv = lhs.getVar();
-                Table& t = _tables[idx][lv];
-                
+                Bucket* b = bucket(idx, lv, this->hash(lhs, rhs));
+                LevelStats& s = _stats[lv];
+                s.lookups++;
+                s.chain[b->e.valid ? 1 : 0]++;
 
-                std::size_t key = this->hash(lhs, rhs) % NBUCKETS; 
-
-                return find_in_bucket<T>(t, key ,lhs, rhs);
+                T result = find_in_bucket<T>(b, lhs, rhs);
+                if(result.n != nullptr) s.hits++;
+                return result;
 
             }
         template<typename T>
@@ -82,19 +116,23 @@ class AddCache{
                 }
 
                 Qubit lv = lhs.getVar();
-                Table& t = _tables[idx][lv];
-                
-
-                std::size_t key = this->hash(lhs, rhs) % NBUCKETS; 
+                Bucket* b = bucket(idx, lv, this->hash(lhs, rhs));
 
-                return set_in_bucket<T>(t, key ,lhs, rhs, result);
+                countInsert(lv, set_in_bucket<T>(b, lhs, rhs, result));
                 
             }
 
     void clearAll() {
+#ifdef FLAT_CACHE
+        for(std::vector<Bucket>& vb: _tables){
+            for(Bucket& b : vb){
+                b.e.valid = false;
+            }
+        }
+#else
         for(std::vector<Table>& vt: _tables){
             for(Table& t: vt){
-                std::memset(t._table, 0, sizeof(void*)*NBUCKETS);
+                std::fill(t._table.begin(), t._table.end(), nullptr);
             }
         }
 
@@ -105,38 +143,71 @@ class AddCache{
 
         c.chunkIt = c.chunks[0].begin();
         c.chunkEndIt = c.chunks[0].end();
-        c.allocationSize = INITIAL_ALLOCATION_SIZE * GROWTH_FACTOR;
-        c.allocations = INITIAL_ALLOCATION_SIZE;
+        c.allocations = c.chunks[0].size();
+        c.allocationSize = c.allocations * c.growth;
         for(Bucket& b : c.chunks[0]){
             b.e.valid = false;
         }
+#endif
+        for(LevelStats& s : _stats){
+            s = LevelStats{};
+        }
         hits = 0;
         lookups = 0;
     }
 
+        static constexpr std::size_t bucketBytes() { return sizeof(Bucket); }
+
         double hitRatio() const noexcept {
             std::cout<<"hits "<< hits<<", lookups: "<< lookups<<std::endl; 
             return static_cast<double>(hits)/static_cast<double>(lookups); 
         }
 
-    private:
+        TableStats stats() const {
+            TableStats ts{_stats, 0};
+#ifdef FLAT_CACHE
+            for(const std::vector<Bucket>& vb : _tables){
+                ts.bytes += vb.size() * sizeof(Bucket);
+            }
+#else
+            for(const std::vector<Table>& vt : _tables){
+                for(std::size_t lv = 0; lv < vt.size(); lv++){
+                    std::size_t bytes = vt[lv]._table.size() * sizeof(Bucket*);
+                    ts.levels[lv].bytes += bytes;
+                    ts.bytes += bytes;
+                }
+            }
+            for(const std::vector<Bucket>& chunk : c.chunks){
+                ts.bytes += chunk.size() * sizeof(Bucket);
+            }
+#endif
+            return ts;
+        }
 
+        void resetStats() {
+            for(LevelStats& s : _stats){
+                s.lookups = s.hits = s.inserts = s.evictions = 0;
+                s.chain = {};
+            }
+            hits = 0;
+            lookups = 0;
+        }
 
-        union Edge{
-            mEdge m;
-            vEdge v;
-            Edge(){}
-        };
+    private:
 
+
+        // edges are kept as weight and NodeHandle, which fits an entry into
+        // a single cache line
         struct Entry{
-            Entry():valid(false){}
-            Edge lhs;
-            Edge rhs;
-            Edge result;
+            Entry(): ln(0), rn(0), n(0), epoch(0), valid(false){}
+            std_complex lw;
+            std_complex rw;
+            std_complex w;
+            NodeHandle ln;
+            NodeHandle rn;
+            NodeHandle n;
+            std::uint16_t epoch;
             bool valid;
-            #ifdef CACHE_GLOBAL
-            mutable std::shared_mutex _mtx;
-            #endif
         };
 
         struct alignas(hardware_constructive_interference_size) // the same cacheline
@@ -147,9 +218,12 @@ class AddCache{
 
 
         static_assert(std::is_default_constructible_v<Bucket>);
+        static_assert(sizeof(Bucket) == hardware_constructive_interference_size);
+#ifndef FLAT_CACHE
         struct Cache {
-            Cache(){
-                chunks.emplace_back(std::vector<Bucket>(INITIAL_ALLOCATION_SIZE*4096));
+            Cache(std::size_t chunk, std::size_t growth)
+                : allocationSize{chunk * growth}, allocations{chunk}, growth{growth}{
+                chunks.emplace_back(std::vector<Bucket>(chunk));
                 chunkIt = chunks[0].begin();
                 chunkEndIt = chunks[0].end();
             }
@@ -157,38 +231,52 @@ class AddCache{
             std::size_t                          chunkID{0};
             typename std::vector<Bucket>::iterator chunkIt;
             typename std::vector<Bucket>::iterator chunkEndIt;
-            std::size_t                          allocationSize{INITIAL_ALLOCATION_SIZE*4096 * GROWTH_FACTOR};
-            std::size_t                       allocations = INITIAL_ALLOCATION_SIZE*4096;
-            #ifdef CACHE_GLOBAL
-            mutable std::mutex _mtx;
-            #endif
+            std::size_t                          allocationSize;
+            std::size_t                       allocations;
+            std::size_t                          growth;
         };
 
         Cache c;
 
+        // allocated on the first lookup at its level, so that levels a
+        // circuit never reaches cost nothing
         struct Table{
-            Bucket* _table[NBUCKETS] = {nullptr};
-
+            std::vector<Bucket*> _table;
         };
 
 
         std::vector<std::vector<Table>> _tables; //mm,  vv
+#else
+        // one direct-mapped array of _buckets buckets per operation,
+        // shared by all qubit levels
+        std::vector<std::vector<Bucket>> _tables; //mm,  vv
+#endif
                                                  //
         std::mt19937_64 rng;
         std::uniform_int_distribution<int> dist;
         
         std::size_t lookups{0};
         std::size_t hits{0};
+        std::vector<LevelStats> _stats;
+        std::size_t _buckets;
+
+        void countInsert(Qubit lv, bool evicted) {
+            LevelStats& s = _stats[lv];
+            s.inserts++;
+            if(evicted){
+                s.evictions++;
+            }else{
+                s.live++;
+            }
+        }
 
 
+#ifndef FLAT_CACHE
         Bucket* getBucket() {
-            #ifdef CACHE_GLOBAL
-            std::unique_lock(c._mtx);
-            #endif
             if (c.chunkIt == c.chunkEndIt) {
                 c.chunks.emplace_back(std::vector<Bucket>(c.allocationSize));
                 c.allocations += c.allocationSize;
-                c.allocationSize *= GROWTH_FACTOR;
+                c.allocationSize *= c.growth;
                 c.chunkID++;
                 c.chunkIt    = c.chunks[c.chunkID].begin();
                 c.chunkEndIt = c.chunks[c.chunkID].end();
@@ -198,6 +286,25 @@ class AddCache{
             ++c.chunkIt;
             return p;
         }
+#endif
+
+        Bucket* bucket(int idx, Qubit lv, std::size_t h) {
+#ifdef FLAT_CACHE
+            std::vector<Bucket>& vb = _tables[idx];
+            return &vb[hash_combine(h, lv) & (vb.size() - 1)];
+#else
+            std::vector<Bucket*>& t = _tables[idx][lv]._table;
+            if (t.empty()) {
+                t.assign(_buckets, nullptr);
+            }
+            Bucket*& b = t[h % _buckets];
+            if (b == nullptr) {
+                b = getBucket();
+                _stats[lv].bytes += sizeof(Bucket);
+            }
+            return b;
+#endif
+        }
 
         template<typename T>
             std::size_t hash(const T& lhs, const T& rhs){
@@ -208,76 +315,42 @@ class AddCache{
             }
 
         template<typename T>
-            T find_in_bucket(Table& t, std::size_t key, const T& l, const T& r){
-                if(t._table[key] == nullptr) {t._table[key] = getBucket(); return T{};}
-                Bucket* b = t._table[key];
+            T find_in_bucket(Bucket* b, const T& l, const T& r){
+                using N = std::remove_pointer_t<decltype(T::n)>;
 
                 Entry& e = b->e;
-                #ifdef CACHE_GLOBAL
-                std::shared_lock<std::shared_mutex> lock(e._mtx);
-                #endif
-                if constexpr(std::is_same_v<T, mEdge>){
-                    if(e.valid && e.lhs.m == l && e.rhs.m ==r){
-                        if(e.result.m.getVar() != -2){
-                            hits++;
-                            return e.result.m;
-                        }else{
-                            return T{};    
-                        }
-                        /*
-                        if(e.result.m.getVar() == -2){
-                            assert(false);
-                        }
-                       return e.result.m; 
-                        */
-                    }else{
-                        return T{};
-                    }
-                }else{
-                    if(e.valid && e.lhs.v == l && e.rhs.v ==r){
-                        if(e.result.v.getVar() != -2){
-                            hits++;
-                            return e.result.v;
-                        }else{
-                            return T{};    
-                        }
-                        /*
-                        if(e.result.v.getVar() == -2){
-                            assert(false);
-                        }
-                       return e.result.v; 
-                        */
-                    }else{
-                        return T{}; 
-                    }
-                
+                if(!e.valid || e.ln != NodeArena<N>::handle(l.n) || e.rn != NodeArena<N>::handle(r.n)
+                   || !e.lw.isApproximatelyEqual(l.w) || !e.rw.isApproximatelyEqual(r.w)){
+                    return T{};
                 }
+                N* n = NodeArena<N>::node(e.n);
+                if(isCurrent(l.n, e.epoch) && isCurrent(r.n, e.epoch) && isCurrent(n, e.epoch)){
+                    hits++;
+                    return T{e.w, n};
+                }
+                return T{};
             }
 
         template<typename T>
             void set(Entry& e, const T& l , const T& r, const T& res){
-                #ifdef CACHE_GLOBAL
-                    std::unique_lock<std::shared_mutex> lock(e._mtx);
-                #endif
-                    if constexpr(std::is_same_v<T, mEdge>){
-                        e.lhs.m = l;
-                        e.rhs.m = r;
-                        e.result.m = res;
-                    }else{
-                        e.lhs.v = l;
-                        e.rhs.v = r;
-                        e.result.v = res;
-                    }
+                using N = std::remove_pointer_t<decltype(T::n)>;
+                    e.lw = l.w;
+                    e.rw = r.w;
+                    e.w = res.w;
+                    e.ln = NodeArena<N>::handle(l.n);
+                    e.rn = NodeArena<N>::handle(r.n);
+                    e.n = NodeArena<N>::handle(res.n);
+                    e.epoch = gcEpoch;
                     e.valid = true;
             }
 
         template<typename T>
-            void set_in_bucket(Table& t, std::size_t key, const T& l, const T& r, const T& result){
-                if(t._table[key] == nullptr) t._table[key] = getBucket();
-                Bucket* b = t._table[key];
+            bool set_in_bucket(Bucket* b, const T& l, const T& r, const T& result){
 
                 Entry& e = b->e;
-                return set(e, l, r, result);
+                bool evicted = e.valid;
+                set(e, l, r, result);
+                return evicted;
             }
 
 
@@ -287,11 +360,25 @@ class MulCache{
     friend struct Scheduler;
 
     public:
-        MulCache(QubitCount q):_tables{3}, rng(std::random_device()()), dist(0,1){
+        // `buckets` is the length of each per-level table, or with FLAT_CACHE
+        // the length (a power of two) of the array shared by all levels.
+        MulCache(QubitCount q, std::size_t buckets = CACHE_BUCKETS,
+                 [[maybe_unused]] std::size_t chunk = CACHE_CHUNK_SIZE,
+                 [[maybe_unused]] std::size_t growth = GROWTH_FACTOR)
+            :
+#ifndef FLAT_CACHE
+             c(chunk, growth),
+#endif
+             _tables{3}, rng(std::random_device()()), dist(0,1), _stats(q), _buckets(buckets){
 
             assert(_tables.size() == 3);
-            for(auto i = 0; i < _tables.size(); i++){
+            for(std::size_t i = 0; i < _tables.size(); i++){
+#ifdef FLAT_CACHE
+                assert((buckets & (buckets - 1)) == 0);
+                _tables[i].resize(buckets);
+#else
                 _tables[i].resize(q);
+#endif
             }
 
         }
@@ -313,15 +400,18 @@ class MulCache{
                     assert(false);
                 }
 
-                Qubit lv = lhs->v;
-                Table& t = _tables[idx][lv];
-                
-                uintptr_t l = reinterpret_cast<uintptr_t>(lhs);
-                uintptr_t r = reinterpret_cast<uintptr_t>(rhs);
+                NodeHandle l = NodeArena<LT>::handle(lhs);
+                NodeHandle r = NodeArena<RT>::handle(rhs);
 
-                std::size_t key = murmur_hash(l) % NBUCKETS; 
+                Bucket* b = bucket(idx, lhs->v, key(l, r));
+                LevelStats& s = _stats[lhs->v];
+                s.lookups++;
 
-                return find_in_bucket<RetT>(t, key ,l, r);
+                std::size_t compared = 0;
+                RetT result = find_in_bucket<RetT>(b, l, r, lhs, rhs, compared);
+                s.chain[compared]++;
+                if(result.n != nullptr) s.hits++;
+                return result;
 
             }
 
@@ -339,22 +429,28 @@ class MulCache{
                     assert(false);
                 }
 
-                Qubit lv = lhs->v;
-                Table& t = _tables[idx][lv];
-                
-                uintptr_t l = reinterpret_cast<uintptr_t>(lhs);
-                uintptr_t r = reinterpret_cast<uintptr_t>(rhs);
+                NodeHandle l = NodeArena<LT>::handle(lhs);
+                NodeHandle r = NodeArena<RT>::handle(rhs);
 
-                std::size_t key = murmur_hash(l) % NBUCKETS; 
+                Bucket* b = bucket(idx, lhs->v, key(l, r));
 
-                return set_in_bucket<ResT>(t, key ,l, r, result);
+                countInsert(lhs->v, set_in_bucket<ResT>(b, l, r, result));
                 
             }
 
     void clearAll() {
+#ifdef FLAT_CACHE
+        for(std::vector<Bucket>& vb: _tables){
+            for(Bucket& b : vb){
+                for(Entry& e : b.es){
+                    e.valid = false;
+                }
+            }
+        }
+#else
         for(std::vector<Table>& vt: _tables){
             for(Table& t: vt){
-                std::memset(t._table, 0, sizeof(void*)*NBUCKETS);
+                std::fill(t._table.begin(), t._table.end(), nullptr);
             }
         }
 
@@ -365,43 +461,73 @@ class MulCache{
 
         c.chunkIt = c.chunks[0].begin();
         c.chunkEndIt = c.chunks[0].end();
-        c.allocationSize = INITIAL_ALLOCATION_SIZE * GROWTH_FACTOR;
-        c.allocations = INITIAL_ALLOCATION_SIZE;
+        c.allocations = c.chunks[0].size();
+        c.allocationSize = c.allocations * c.growth;
         for(Bucket& b : c.chunks[0]){
             for(Entry& e : b.es){
                 e.valid = false;
             }
         }
+#endif
+        for(LevelStats& s : _stats){
+            s = LevelStats{};
+        }
         hits = 0;
         lookups = 0;
     }
 
 
+        static constexpr std::size_t bucketBytes() { return sizeof(Bucket); }
+
         double hitRatio() const noexcept {
             std::cout<<"hits "<< hits<<", lookups: "<< lookups<<std::endl; 
             return static_cast<double>(hits)/static_cast<double>(lookups); 
         }
 
-    private:
+        TableStats stats() const {
+            TableStats ts{_stats, 0};
+#ifdef FLAT_CACHE
+            for(const std::vector<Bucket>& vb : _tables){
+                ts.bytes += vb.size() * sizeof(Bucket);
+            }
+#else
+            for(const std::vector<Table>& vt : _tables){
+                for(std::size_t lv = 0; lv < vt.size(); lv++){
+                    std::size_t bytes = vt[lv]._table.size() * sizeof(Bucket*);
+                    ts.levels[lv].bytes += bytes;
+                    ts.bytes += bytes;
+                }
+            }
+            for(const std::vector<Bucket>& chunk : c.chunks){
+                ts.bytes += chunk.size() * sizeof(Bucket);
+            }
+#endif
+            return ts;
+        }
+
+        void resetStats() {
+            for(LevelStats& s : _stats){
+                s.lookups = s.hits = s.inserts = s.evictions = 0;
+                s.chain = {};
+            }
+            hits = 0;
+            lookups = 0;
+        }
 
+    private:
 
-        union Edge{
-            mEdge m;
-            vEdge v;
-            Edge(){}
-        };
 
+        // operands and result are NodeHandles, so that a bucket of four
+        // entries takes two cache lines
         struct Entry{
-            Entry(): lhs(0), rhs(0), valid(false), picked{0}{};
-            uintptr_t lhs;
-            uintptr_t rhs;
-            Edge result;
-            
+            Entry(): lhs(0), rhs(0), n(0), epoch(0), valid(false), picked(0){}
+            std_complex w;
+            NodeHandle lhs;
+            NodeHandle rhs;
+            NodeHandle n;
+            std::uint16_t epoch;
             bool valid;
-            int picked;
-        #ifdef CACHE_GLOBAL
-            mutable std::shared_mutex _mtx;
-        #endif
+            std::uint8_t picked;
         };
 
         static_assert(std::is_default_constructible_v<Entry>);
@@ -413,9 +539,12 @@ class MulCache{
 
 
         static_assert(std::is_default_constructible_v<Bucket>);
+        static_assert(sizeof(Bucket) == 2 * hardware_constructive_interference_size);
+#ifndef FLAT_CACHE
         struct Cache {
-            Cache(){
-                chunks.emplace_back(std::vector<Bucket>(INITIAL_ALLOCATION_SIZE*4096));
+            Cache(std::size_t chunk, std::size_t growth)
+                : allocationSize{chunk * growth}, allocations{chunk}, growth{growth}{
+                chunks.emplace_back(std::vector<Bucket>(chunk));
                 chunkIt = chunks[0].begin();
                 chunkEndIt = chunks[0].end();
             }
@@ -423,38 +552,52 @@ class MulCache{
             std::size_t                          chunkID{0};
             typename std::vector<Bucket>::iterator chunkIt;
             typename std::vector<Bucket>::iterator chunkEndIt;
-            std::size_t                          allocationSize{INITIAL_ALLOCATION_SIZE*4096 * GROWTH_FACTOR};
-            std::size_t                       allocations = INITIAL_ALLOCATION_SIZE*4096;
-            #ifdef CACHE_GLOBAL
-            mutable std::mutex _mtx;
-            #endif
+            std::size_t                          allocationSize;
+            std::size_t                       allocations;
+            std::size_t                          growth;
         };
 
         Cache c;
 
+        // allocated on the first lookup at its level, so that levels a
+        // circuit never reaches cost nothing
         struct Table{
-            Bucket* _table[NBUCKETS] = {nullptr};
-
+            std::vector<Bucket*> _table;
         };
 
 
         std::vector<std::vector<Table>> _tables; //mm, mv, vv
+#else
+        // one direct-mapped array of _buckets buckets per operation,
+        // shared by all qubit levels
+        std::vector<std::vector<Bucket>> _tables; //mm, mv, vv
+#endif
                                                  //
         std::mt19937_64 rng;
         std::uniform_int_distribution<int> dist;
 
         std::size_t lookups{0};
         std::size_t hits{0};
+        std::vector<LevelStats> _stats;
+        std::size_t _buckets;
+
+        void countInsert(Qubit lv, bool evicted) {
+            LevelStats& s = _stats[lv];
+            s.inserts++;
+            if(evicted){
+                s.evictions++;
+            }else{
+                s.live++;
+            }
+        }
 
 
+#ifndef FLAT_CACHE
         Bucket* getBucket() {
-            #ifdef CACHE_GLOBAL
-            std::unique_lock(c._mtx);
-            #endif
             if (c.chunkIt == c.chunkEndIt) {
                 c.chunks.emplace_back(c.allocationSize);
                 c.allocations += c.allocationSize;
-                c.allocationSize *= GROWTH_FACTOR;
+                c.allocationSize *= c.growth;
                 c.chunkID++;
                 c.chunkIt    = c.chunks[c.chunkID].begin();
                 c.chunkEndIt = c.chunks[c.chunkID].end();
@@ -464,147 +607,449 @@ class MulCache{
             ++c.chunkIt;
             return p;
         }
+#endif
 
-        template<typename RET>
-            RET find_in_bucket(Table& t, std::size_t key, uintptr_t l, uintptr_t r){
-                if(t._table[key] == nullptr) {t._table[key] = getBucket(); return RET{};}
-                Bucket* b = t._table[key];
-
+        Bucket* bucket(int idx, Qubit lv, std::size_t h) {
+#ifdef FLAT_CACHE
+            std::vector<Bucket>& vb = _tables[idx];
+            return &vb[hash_combine(h, lv) & (vb.size() - 1)];
+#else
+            std::vector<Bucket*>& t = _tables[idx][lv]._table;
+            if (t.empty()) {
+                t.assign(_buckets, nullptr);
+            }
+            Bucket*& b = t[h % _buckets];
+            if (b == nullptr) {
+                b = getBucket();
+                _stats[lv].bytes += sizeof(Bucket);
+            }
+            return b;
+#endif
+        }
 
+        // both handles side by side are unique, and murmur_hash is a bijection
+        static std::size_t key(NodeHandle l, NodeHandle r){
+            return murmur_hash(std::size_t{l} << 32 | r);
+        }
 
-                if constexpr(std::is_same_v<RET, mEdge>){
-                    mNode* lp = reinterpret_cast<mNode*>(l); 
-                    mNode* rp = reinterpret_cast<mNode*>(r); 
-                    
-                    for(Entry& e: b->es){            
-                        #ifdef CACHE_GLOBAL
-                        std::shared_lock<std::shared_mutex> lock(e._mtx);
-                        #endif
-                        if(e.valid && e.lhs == l && e.rhs == r){
-                            if(e.result.m.getVar() != -2){
-                                hits++;
-                                e.picked++;
-                                return e.result.m;
-                            }else{
-                                e.picked = 0;
-                                return RET{};
-                            }
-                            /*
-                            if(e.result.m.getVar() == -2){
-                                assert(false);
-                            }
-                            return e.result.m;
-                            */
-                        }   
-                    }
+        template<typename RET, typename LT, typename RT>
+            RET find_in_bucket(Bucket* b, NodeHandle l, NodeHandle r, const LT* lp, const RT* rp, std::size_t& compared){
+                using N = std::remove_pointer_t<decltype(RET::n)>;
 
-                    return RET{};
-                }else{
-                    mNode* lp = reinterpret_cast<mNode*>(l); 
-                    vNode* rp = reinterpret_cast<vNode*>(r); 
-
-                    for(Entry& e: b->es){
-                    #ifdef CACHE_GLOBAL
-                        std::shared_lock<std::shared_mutex> lock(e._mtx);
-                    #endif
-                        if(e.valid && e.lhs == l && e.rhs == r){
-                            if(e.result.v.getVar() != -2){
-                                hits++;
+                for(Entry& e: b->es){
+                    compared += e.valid;
+                    if(e.valid && e.lhs == l && e.rhs == r){
+                        N* n = NodeArena<N>::node(e.n);
+                        if(isCurrent(lp, e.epoch) && isCurrent(rp, e.epoch) && isCurrent(n, e.epoch)){
+                            hits++;
+                            if(e.picked != UINT8_MAX){
                                 e.picked++;
-                                return e.result.v;
-                            }else{
-                                e.picked = 0;
-                                return RET{};
-                            }
-                            /*
-                            if(e.result.v.getVar() == -2){
-                                assert(false);
                             }
-                            return e.result.v;
-                            */
-                        }   
+                            return RET{e.w, n};
+                        }else{
+                            e.picked = 0;
+                            return RET{};
+                        }
                     }
-
-                    return RET{};
-                
                 }
+
+                return RET{};
             }
 
         template<typename T>
-            void set(Entry& e, uintptr_t& l , uintptr_t& r, const T& res){
-                #ifdef CACHE_GLOBAL
-                    std::unique_lock<std::shared_mutex> lock(e._mtx);
-                #endif
-                    if constexpr(std::is_same_v<T, mEdge>){
-                        mNode* lp = reinterpret_cast<mNode*>(l); 
-                        mNode* rp = reinterpret_cast<mNode*>(r); 
-                        e.lhs = l;
-                        e.rhs = r;
-                        e.result.m = res;
-                        e.picked = 1;
-                    }else{
-                        mNode* lp = reinterpret_cast<mNode*>(l); 
-                        vNode* rp = reinterpret_cast<vNode*>(r); 
-                        e.lhs = l;
-                        e.rhs = r;
-                        e.result.v = res;
-                        e.picked = 1;
-                    }
+            void set(Entry& e, NodeHandle l, NodeHandle r, const T& res){
+                using N = std::remove_pointer_t<decltype(T::n)>;
+                    e.lhs = l;
+                    e.rhs = r;
+                    e.w = res.w;
+                    e.n = NodeArena<N>::handle(res.n);
+                    e.picked = 1;
+                    e.epoch = gcEpoch;
                     e.valid = true;
             }
 
         template<typename ResT>
-            void set_in_bucket(Table& t, std::size_t key, uintptr_t l, uintptr_t r, const ResT& result){
-                if(t._table[key] == nullptr) t._table[key] = getBucket();
-                Bucket* b = t._table[key];
-
+            bool set_in_bucket(Bucket* b, NodeHandle l, NodeHandle r, const ResT& result){
 
-                if constexpr(std::is_same_v<ResT, mEdge>){
-                    
-                    for(Entry& e : b->es){
-                        if(e.result.m.n == nullptr){
-                            set(e, l, r, result);
-                            return;
-                        }
+                for(Entry& e : b->es){
+                    if(!e.valid){
+                        set(e, l, r, result);
+                        return false;
                     }
+                }
 
-                    int idx = 0;
-                    int min_picked = b->es[0].picked;
-                    for(int i = 1; i < 4; i++){
-                        if(b->es[i].picked < min_picked){
-                            idx = i;
-                            min_picked = b->es[i].picked;
-                        }
-                    
+                int idx = 0;
+                int min_picked = b->es[0].picked;
+                for(int i = 1; i < 4; i++){
+                    if(b->es[i].picked < min_picked){
+                        idx = i;
+                        min_picked = b->es[i].picked;
                     }
-                    return set(b->es[idx], l, r, result);            
+                }
+                set(b->es[idx], l, r, result);
+                return true;
+            }
 
 
-                }else{
-                    for(Entry& e : b->es){
-                        if(e.result.v.n == nullptr){
-                            set(e, l, r, result);
-                            return;
-                        }
-                    }
-                    int idx = 0;
-                    int min_picked = b->es[0].picked;
-                    for(int i = 1; i < 4; i++){
-                        if(b->es[i].picked < min_picked){
-                            idx = i;
-                            min_picked = b->es[i].picked;
-                        }
-                    
-                    }
-                    return set(b->es[idx], l, r, result);            
+};
 
-                
+#ifdef isMT
+/*
+ * The compute cache all threads share: one direct-mapped array of entries
+ * per operation. An entry is WORDS 64-bit atomics, and its last word guards
+ * the others as a seqlock. That word holds the result NodeHandle, the
+ * gcEpoch of the write and a 16-bit sequence number. The number is odd
+ * while a write is under way and 0 before the first one. A reader copies the
+ * other words between two loads of the last one and trusts the copy only
+ * if both loads agree. A writer that finds a write under way drops its own.
+ * Neither ever waits, and an entry keeps within a cache line, which a
+ * std::shared_mutex per entry alone would not.
+ */
+template <std::size_t WORDS> class SharedTier {
+  public:
+    using Words = std::array<std::uint64_t, WORDS - 1>;
+
+    // `buckets` per operation, a power of two
+    SharedTier(std::size_t ops, std::size_t buckets)
+        : _mask(buckets - 1), _entries(ops * buckets) {
+        assert((buckets & (buckets - 1)) == 0);
+    }
+
+    // copies the last completed write to the entry of `op` for `h`
+    bool read(std::size_t op, std::size_t h, Words &words, NodeHandle &n,
+              std::uint16_t &epoch) const {
+        const Entry &e = entry(op, h);
+        const std::uint64_t tag = e.w[WORDS - 1].load(std::memory_order_acquire);
+        if ((tag & SEQ_MASK) == 0 || (tag & 1) != 0) {
+            return false;
+        }
+        for (std::size_t i = 0; i < WORDS - 1; i++) {
+            words[i] = e.w[i].load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (e.w[WORDS - 1].load(std::memory_order_relaxed) != tag) {
+            return false;
+        }
+        n = static_cast<NodeHandle>(tag >> 32);
+        epoch = static_cast<std::uint16_t>(tag >> 16);
+        return true;
+    }
+
+    // returns false if the write was dropped
+    bool write(std::size_t op, std::size_t h, const Words &words, NodeHandle n) {
+        Entry &e = entry(op, h);
+        std::uint64_t tag = e.w[WORDS - 1].load(std::memory_order_relaxed);
+        if ((tag & 1) != 0 ||
+            !e.w[WORDS - 1].compare_exchange_strong(tag, tag + 1, std::memory_order_relaxed)) {
+            return false;
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        for (std::size_t i = 0; i < WORDS - 1; i++) {
+            e.w[i].store(words[i], std::memory_order_relaxed);
+        }
+        std::uint64_t seq = (tag + 2) & SEQ_MASK;
+        if (seq == 0) {
+            seq = 2;
+        }
+        e.w[WORDS - 1].store(std::uint64_t{n} << 32 | std::uint64_t{gcEpoch} << 16 | seq,
+                             std::memory_order_release);
+        return true;
+    }
+
+    // no other thread may use the tier meanwhile
+    void clear() {
+        for (Entry &e : _entries) {
+            for (std::atomic<std::uint64_t> &w : e.w) {
+                w.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    static constexpr std::size_t entryBytes() { return sizeof(Entry); }
+    std::size_t bytes() const { return _entries.size() * sizeof(Entry); }
+
+  private:
+    static constexpr std::uint64_t SEQ_MASK = 0xFFFF;
+
+    struct alignas(WORDS * 8 < hardware_constructive_interference_size
+                       ? WORDS * 8
+                       : hardware_constructive_interference_size) Entry {
+        std::atomic<std::uint64_t> w[WORDS];
+    };
+    static_assert(sizeof(Entry) <= hardware_constructive_interference_size);
+
+    const Entry &entry(std::size_t op, std::size_t h) const {
+        return _entries[op * (_mask + 1) + (h & _mask)];
+    }
+    Entry &entry(std::size_t op, std::size_t h) {
+        return _entries[op * (_mask + 1) + (h & _mask)];
+    }
+
+    std::size_t _mask;
+    std::vector<Entry> _entries;
+};
+
+inline std::uint64_t wordOf(double x) {
+    std::uint64_t w;
+    std::memcpy(&w, &x, sizeof w);
+    return w;
+}
+
+inline double doubleOf(std::uint64_t w) {
+    double x;
+    std::memcpy(&x, &w, sizeof x);
+    return x;
+}
+
+/*
+ * A compute cache with isMT: a cache L of its own for every thread in front
+ * of a SharedTier, as EngineConfig::cacheTiers selects. A result found in
+ * the shared tier is copied into the thread's own cache. The stats are
+ * those of the first tier asked, plus the hits of the shared one.
+ */
+template <typename L, std::size_t WORDS> class TieredCache {
+  public:
+    TieredCache(QubitCount q, std::size_t ops, std::size_t buckets, std::size_t chunk,
+                std::size_t growth, std::size_t shared, CacheTiers tiers)
+        : _local([=] { return Local{L(q, buckets, chunk, growth), std::vector<LevelStats>(q)}; }),
+          _shared(ops, shared), _tiers(tiers), _q(q) {}
+
+    void clearAll() {
+        _local.forEach([](Local &own) {
+            own.cache.clearAll();
+            std::fill(own.shared.begin(), own.shared.end(), LevelStats{});
+        });
+        _shared.clear();
+    }
+
+    TableStats stats() const {
+        TableStats ts{std::vector<LevelStats>(_q), _shared.bytes()};
+        _local.forEach([&ts, this](const Local &own) {
+            TableStats first = own.cache.stats();
+            for (std::size_t q = 0; q < _q; q++) {
+                ts.levels[q] += first.levels[q];
+                if (_tiers == CacheTiers::Shared) {
+                    ts.levels[q] += own.shared[q];
+                } else {
+                    ts.levels[q].hits += own.shared[q].hits;
                 }
             }
+            ts.bytes += first.bytes;
+        });
+        return ts;
+    }
+
+    void resetStats() {
+        _local.forEach([](Local &own) {
+            own.cache.resetStats();
+            for (LevelStats &s : own.shared) {
+                s.lookups = s.hits = s.inserts = s.evictions = 0;
+                s.chain = {};
+            }
+        });
+    }
+
+    double hitRatio() const {
+        std::size_t hits = 0, lookups = 0;
+        for (const LevelStats &s : stats().levels) {
+            hits += s.hits;
+            lookups += s.lookups;
+        }
+        std::cout << "hits " << hits << ", lookups: " << lookups << std::endl;
+        return static_cast<double>(hits) / static_cast<double>(lookups);
+    }
+
+    static constexpr std::size_t sharedEntryBytes() { return SharedTier<WORDS>::entryBytes(); }
+
+  protected:
+    using Words = typename SharedTier<WORDS>::Words;
+
+    struct Local {
+        L cache;
+        std::vector<LevelStats> shared; // of this thread's shared tier lookups
+    };
+
+    PerThread<Local> _local;
+    SharedTier<WORDS> _shared;
+    CacheTiers _tiers;
+    QubitCount _q;
+};
+
+// The add cache with isMT. Shared entries are the three weights and both
+// operand handles.
+class TieredAddCache : public TieredCache<AddCache, 8> {
+  public:
+    TieredAddCache(QubitCount q, std::size_t buckets = CACHE_BUCKETS,
+                   std::size_t chunk = CACHE_CHUNK_SIZE, std::size_t growth = GROWTH_FACTOR,
+                   std::size_t shared = SHARED_CACHE_BUCKETS,
+                   CacheTiers tiers = CacheTiers::Both)
+        : TieredCache(q, 2, buckets, chunk, growth, shared, tiers) {}
+
+    template <typename T> T find(T lhs, T rhs) {
+        Local &own = _local.local();
+        if (_tiers != CacheTiers::Shared) {
+            T result = own.cache.find(lhs, rhs);
+            if (result.n != nullptr || _tiers == CacheTiers::Local) {
+                return result;
+            }
+        }
+        using N = std::remove_pointer_t<decltype(T::n)>;
+        if (lhs.getVar() > rhs.getVar()) {
+            std::swap(lhs, rhs);
+        }
+        LevelStats &s = own.shared[lhs.getVar()];
+        s.lookups++;
+
+        Words words;
+        NodeHandle n;
+        std::uint16_t epoch;
+        bool valid = _shared.read(op<T>(), key(lhs, rhs), words, n, epoch);
+        s.chain[valid ? 1 : 0]++;
+        if (!valid || words[6] != handles(lhs, rhs) ||
+            !weight(words, 0).isApproximatelyEqual(lhs.w) ||
+            !weight(words, 2).isApproximatelyEqual(rhs.w)) {
+            return T{};
+        }
+        N *node = NodeArena<N>::node(n);
+        if (!isCurrent(lhs.n, epoch) || !isCurrent(rhs.n, epoch) || !isCurrent(node, epoch)) {
+            return T{};
+        }
+        s.hits++;
+        T result{weight(words, 4), node};
+        if (_tiers == CacheTiers::Both) {
+            own.cache.set(lhs, rhs, result);
+        }
+        return result;
+    }
+
+    template <typename T> void set(T lhs, T rhs, const T &result) {
+        Local &own = _local.local();
+        if (_tiers != CacheTiers::Shared) {
+            own.cache.set(lhs, rhs, result);
+            if (_tiers == CacheTiers::Local) {
+                return;
+            }
+        }
+        using N = std::remove_pointer_t<decltype(T::n)>;
+        if (lhs.getVar() > rhs.getVar()) {
+            std::swap(lhs, rhs);
+        }
+        const Words words{wordOf(lhs.w.r), wordOf(lhs.w.i), wordOf(rhs.w.r), wordOf(rhs.w.i),
+                          wordOf(result.w.r), wordOf(result.w.i), handles(lhs, rhs)};
+        if (_shared.write(op<T>(), key(lhs, rhs), words, NodeArena<N>::handle(result.n))) {
+            own.shared[lhs.getVar()].inserts++;
+        }
+    }
+
+  private:
+    template <typename T> static constexpr std::size_t op() {
+        return std::is_same_v<T, mEdge> ? 0 : 1; // mm, vv
+    }
 
+    template <typename T> static std::uint64_t handles(const T &lhs, const T &rhs) {
+        using N = std::remove_pointer_t<decltype(T::n)>;
+        return std::uint64_t{NodeArena<N>::handle(lhs.n)} << 32 | NodeArena<N>::handle(rhs.n);
+    }
+
+    template <typename T> static std::size_t key(const T &lhs, const T &rhs) {
+        return hash_combine(hash_combine(std::hash<T>()(lhs), std::hash<T>()(rhs)),
+                            lhs.getVar());
+    }
 
+    static Complex weight(const Words &words, std::size_t i) {
+        return {doubleOf(words[i]), doubleOf(words[i + 1])};
+    }
 };
 
+// The multiply cache with isMT. Shared entries are the result weight and
+// both operand handles, and there are four of them per bucket, as many as
+// a MulCache bucket holds.
+class TieredMulCache : public TieredCache<MulCache, 4> {
+  public:
+    TieredMulCache(QubitCount q, std::size_t buckets = CACHE_BUCKETS,
+                   std::size_t chunk = CACHE_CHUNK_SIZE, std::size_t growth = GROWTH_FACTOR,
+                   std::size_t shared = SHARED_CACHE_BUCKETS,
+                   CacheTiers tiers = CacheTiers::Both)
+        : TieredCache(q, 3, buckets, chunk, growth, 4 * shared, tiers) {}
+
+    template <typename LT, typename RT,
+              typename RetT = std::conditional_t<std::is_same_v<RT, vNode>, vEdge, mEdge>>
+    RetT find(const LT *lhs, const RT *rhs) {
+        Local &own = _local.local();
+        if (_tiers != CacheTiers::Shared) {
+            RetT result = own.cache.find(lhs, rhs);
+            if (result.n != nullptr || _tiers == CacheTiers::Local) {
+                return result;
+            }
+        }
+        using N = std::remove_pointer_t<decltype(RetT::n)>;
+        LevelStats &s = own.shared[lhs->v];
+        s.lookups++;
+
+        const std::uint64_t operands = handles(lhs, rhs);
+        Words words;
+        NodeHandle n;
+        std::uint16_t epoch;
+        bool valid = _shared.read(op<LT, RT>(), key(operands, lhs->v), words, n, epoch);
+        s.chain[valid ? 1 : 0]++;
+        if (!valid || words[2] != operands) {
+            return RetT{};
+        }
+        N *node = NodeArena<N>::node(n);
+        if (!isCurrent(lhs, epoch) || !isCurrent(rhs, epoch) || !isCurrent(node, epoch)) {
+            return RetT{};
+        }
+        s.hits++;
+        RetT result{{doubleOf(words[0]), doubleOf(words[1])}, node};
+        if (_tiers == CacheTiers::Both) {
+            own.cache.set(lhs, rhs, result);
+        }
+        return result;
+    }
 
+    template <typename LT, typename RT,
+              typename ResT = std::conditional_t<std::is_same_v<RT, vNode>, vEdge, mEdge>>
+    void set(const LT *lhs, const RT *rhs, const ResT &result) {
+        Local &own = _local.local();
+        if (_tiers != CacheTiers::Shared) {
+            own.cache.set(lhs, rhs, result);
+            if (_tiers == CacheTiers::Local) {
+                return;
+            }
+        }
+        using N = std::remove_pointer_t<decltype(ResT::n)>;
+        const std::uint64_t operands = handles(lhs, rhs);
+        const Words words{wordOf(result.w.r), wordOf(result.w.i), operands};
+        if (_shared.write(op<LT, RT>(), key(operands, lhs->v), words,
+                          NodeArena<N>::handle(result.n))) {
+            own.shared[lhs->v].inserts++;
+        }
+    }
+
+  private:
+    template <typename LT, typename RT> static constexpr std::size_t op() {
+        if constexpr (std::is_same_v<RT, mNode>) {
+            return 0; // mm
+        } else if constexpr (std::is_same_v<LT, mNode>) {
+            return 1; // mv
+        } else {
+            return 2; // vv
+        }
+    }
+
+    template <typename LT, typename RT>
+    static std::uint64_t handles(const LT *lhs, const RT *rhs) {
+        return std::uint64_t{NodeArena<LT>::handle(lhs)} << 32 | NodeArena<RT>::handle(rhs);
+    }
+
+    static std::size_t key(std::uint64_t operands, Qubit v) {
+        return hash_combine(murmur_hash(operands), v);
+    }
+};
+
+extern TieredAddCache _aCache;
+extern TieredMulCache _mCache;
+#else
 extern AddCache _aCache;
 extern MulCache _mCache;
+#endif
@@ -28,12 +28,55 @@ const std::size_t NQUBITS = 100;
 // const std::size_t NBUCKETS = 32768;
 const std::size_t NBUCKETS = 524288;
 //const std::size_t NBUCKETS = 1024288;
+// buckets per operation in each compute table when built with FLAT_CACHE
+const std::size_t FLAT_CACHE_SIZE = 1 << 18;
 const std::size_t INITIAL_ALLOCATION_SIZE = 2048;
 const std::size_t GROWTH_FACTOR = 2;
+// first bucket chunk of each compute table; later chunks grow by GROWTH_FACTOR
+const std::size_t CACHE_CHUNK_SIZE = INITIAL_ALLOCATION_SIZE * 64;
+#ifdef isMT
+// every thread has compute caches of its own, backed by a shared one of
+// SHARED_CACHE_BUCKETS buckets per operation, so they are kept smaller
+const std::size_t CACHE_SCALE = 64;
+const std::size_t SHARED_CACHE_BUCKETS = FLAT_CACHE_SIZE;
+#else
+const std::size_t CACHE_SCALE = 1;
+#endif
+#ifdef FLAT_CACHE
+const std::size_t CACHE_BUCKETS = FLAT_CACHE_SIZE / CACHE_SCALE;
+#else
+const std::size_t CACHE_BUCKETS = NBUCKETS / CACHE_SCALE;
+#endif
+// live nodes at which gc() starts collecting
+const std::size_t GC_NODES = 131072 * 16;
+// distinct weight parts cUnique keeps before collections may prune it
+const std::size_t WEIGHTS_MIN = 1 << 16;
+// node memory is taken from the OS in slabs of one (x86-64) huge page
+const std::size_t SLAB_BYTES = std::size_t{2} << 20;
 
 using Qubit = int32_t;
+#ifdef isMT
+// fork level above every qubit, see EngineConfig::forkLevel
+const Qubit NO_FORK = INT32_MAX;
+// a fiber forked at some level runs the recursion below it on its own
+// stack, which gets this much per level (a frame of mm_multiply2 and of
+// the additions it makes, with room for builds without optimization) on
+// top of the base; only the pages touched are backed by memory
+const std::size_t FIBER_STACK_BASE = 64 << 10;
+const std::size_t FIBER_STACK_PER_LEVEL = 8 << 10;
+// stack of a fiber recursing through the levels at and below level
+inline std::size_t fiberStackSize(Qubit level) {
+    return FIBER_STACK_BASE + std::size_t(level + 1) * FIBER_STACK_PER_LEVEL;
+}
+#endif
 using QubitCount = uint32_t;
+// widest gate and most nodes of a gate fuseGates() makes, see
+// EngineConfig::fusionSpan
+const QubitCount FUSION_SPAN = 4;
+const std::size_t FUSION_NODES = 1024;
 using Index = std::size_t;
+// 32-bit name of a node in its NodeArena, see table.hpp
+using NodeHandle = uint32_t;
 
 inline Index operator""_idx(unsigned long long int idx){
     return static_cast<Index>(idx);
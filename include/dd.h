@@ -4,7 +4,12 @@
 #include "common.h"
 #include <atomic>
 #include <complex>
+#ifdef isMT
+#include <future>
+#endif
+#include <map>
 #include <random>
+#include <string>
 #include <vector>
 using Eigen::MatrixXcf;
 using Eigen::VectorXcf;
@@ -208,6 +213,8 @@ struct vNode {
     constexpr static vNode *terminal{&terminalNode};
 
     Qubit v;
+    bool marked{false}; // set during the mark phase of collectGarbage()
+    std::uint16_t gen{0}; // gcEpoch at the time this node was handed out
     std::array<vEdge, 2> children;
     vNode *next{nullptr};
 
@@ -316,6 +323,8 @@ struct mNode {
     constexpr static mNode *terminal{&terminalNode};
 
     Qubit v;
+    bool marked{false}; // set during the mark phase of collectGarbage()
+    std::uint16_t gen{0}; // gcEpoch at the time this node was handed out
     std::array<mEdge, 4> children;
     mNode *next{nullptr};
 
@@ -421,6 +430,27 @@ vEdge vv_add(const vEdge &lhs, const vEdge &rhs);
 vEdge vv_kronecker(const vEdge &lhs, const vEdge &rhs);
 
 vEdge mv_multiply(mEdge lhs, vEdge rhs);
+
+/*
+ * mv_multiply(makeGate(n, g, target, c), state) without making the gate:
+ * rewrites the nodes at and above the target, and below it only those
+ * above the lowest control, mixing the two halves of the state under each
+ * target node with vv_add. Diagonal gates (phases) rescale each half on its
+ * own, skipping those whose phase is 1, and antidiagonal ones (X) swap the
+ * halves, neither with any addition.
+ */
+vEdge applyGate(const vEdge &state, const GateMatrix &g, Qubit target, const Controls &c = {});
+
+/*
+ * Multiplies runs of consecutive gates into single gates (the later gate on
+ * the left), so that applying the result traverses the state once per run
+ * instead of once per gate. mv_multiply visits about the gate's nodes times
+ * the state's on each level, so a gate costs its node count whatever the
+ * state: two gates are fused when the product has no more nodes than both
+ * together and stays within the bounds of EngineConfig::fusionSpan and
+ * fusionNodes. Returns the gates unchanged when fusion is off.
+ */
+std::vector<mEdge> fuseGates(const std::vector<mEdge> &gates);
 #ifdef isMPI
 vEdge mv_multiply_MPI(mEdge lhs, vEdge rhs, bmpi::communicator &world);
 #endif
@@ -433,11 +463,111 @@ vEdge makeZeroStateMPI(QubitCount q, bmpi::communicator &world);
 vEdge makeOneStateMPI(QubitCount q, bmpi::communicator &world);
 #endif
 
+/*
+ * Squared norm of the vector of e. The norms below every node are kept
+ * until a collection frees it, so that measuring the same state again
+ * only costs the path walked; they are not safe to compute from several
+ * threads at once.
+ */
+double squaredNorm(const vEdge &e);
+
 std::string measureAll(vEdge &rootEdge, const bool collapse,
                        std::mt19937_64 &mt, double epsilon = 0.001);
 char measureOneCollapsing(vEdge &rootEdge, const Qubit index,
                           std::mt19937_64 &mt, double epsilon = 0.001);
 
+/*
+ * The state after measuring qubits[i] as outcome[i] ('0' or '1') for every
+ * i, scaled to norm 1. The nodes on the measured levels keep only the child
+ * of their outcome; those above are rewritten once each and everything
+ * below the lowest measured qubit is shared with rootEdge. Throws if the
+ * outcome has probability 0.
+ */
+vEdge collapse(const vEdge &rootEdge, const std::vector<Qubit> &qubits,
+               const std::string &outcome);
+
+/*
+ * Measures the qubits together and collapses rootEdge to the outcome, which
+ * is returned with one character per qubit, in their order. The outcome is
+ * read off one measureAll() draw, so this costs a path through the state
+ * and one collapse() whatever the number of qubits.
+ */
+std::string measureCollapsing(vEdge &rootEdge, const std::vector<Qubit> &qubits,
+                              std::mt19937_64 &mt, double epsilon = 0.001);
+
+/*
+ * The distribution of the outcomes of measuring the given qubits, whose
+ * entry i is the probability that qubits[k] is bit k of i for every k. Each
+ * node above the lowest of them is visited once, holding the distribution
+ * of the qubits at and below it, so that costs those nodes times up to
+ * 2^qubits.size(); below, the cached squared norms are used.
+ */
+std::vector<double> marginalProbabilities(const vEdge &rootEdge, const std::vector<Qubit> &qubits);
+
+// <lhs|rhs>, visiting each pair of nodes of the two states once
+std::complex<double> innerProduct(const vEdge &lhs, const vEdge &rhs);
+
+// <state|observable|state> / <state|state> for a Hermitian observable
+double expectation(const vEdge &state, const mEdge &observable);
+/*
+ * The same for a Pauli string of one of I, X, Y and Z per qubit, the
+ * highest qubit first like the outcomes of measureAll(). The string is not
+ * made into a gate: <state|P|state> is taken over pairs of nodes of the
+ * state, swapping or negating branches on the levels of P, down to its
+ * lowest non-I qubit, below which the cached squared norms are used.
+ */
+double expectation(const vEdge &state, const std::string &pauli);
+
+/*
+ * Outcomes of measuring every qubit of the state shots times, as
+ * measureAll(rootEdge, false, ...) returns them, with how often each comes
+ * up. The branch probabilities of all nodes are computed once into a flat
+ * array, and the shots are split between the branches of each node
+ * binomially, which costs the distinct outcomes instead of the shots.
+ */
+std::map<std::string, std::size_t> sampleShots(const vEdge &rootEdge, std::size_t shots,
+                                               std::uint64_t seed);
+
+// One instruction of a circuit for simulateBranching().
+struct CircuitOp {
+    enum class Kind { Gate, Matrix, Measure, Reset };
+
+    Kind kind;
+    // the target of Gate, the qubit of Measure and Reset
+    Qubit target{0};
+    GateMatrix g{};
+    Controls controls{};
+    // a gate on the whole register, such as makeSwap()
+    mEdge matrix{};
+    // the classical bit a Measure writes
+    std::size_t cbit{0};
+    // Gate and Matrix only act when all of these classical bits are 1
+    std::vector<std::size_t> condition{};
+
+    static CircuitOp gate(const GateMatrix &g, Qubit target, const Controls &c = {}) {
+        return {Kind::Gate, target, g, c};
+    }
+    static CircuitOp gate(const mEdge &m) { return {Kind::Matrix, 0, {}, {}, m}; }
+    static CircuitOp measure(Qubit q, std::size_t cbit) {
+        return {Kind::Measure, q, {}, {}, {}, cbit};
+    }
+    static CircuitOp reset(Qubit q) { return {Kind::Reset, q}; }
+};
+
+/*
+ * Runs a circuit with mid-circuit measurements shots times on the n qubit
+ * zero state, returning how often each value of the cbits classical bits
+ * comes up (the highest bit first). Instead of simulating every shot from
+ * the start, the state is simulated once up to each measurement, where the
+ * shots still on it are split binomially between the two outcomes and the
+ * rest of the circuit is run once per outcome that got any, on the
+ * collapsed state. The cost grows with the distinct branches taken rather
+ * than with the shots.
+ */
+std::map<std::string, std::size_t> simulateBranching(QubitCount n, std::size_t cbits,
+                                                     const std::vector<CircuitOp> &ops,
+                                                     std::size_t shots, std::uint64_t seed);
+
 mEdge RX(QubitCount qnum, int target, double angle);
 
 mEdge RY(QubitCount qnum, int target, double angle);
@@ -467,4 +597,150 @@ void dump(boost::mpi::communicator &world, vEdge e, int cycle);
 #endif
 
 int get_nNodes(vEdge e);
+int get_nNodes(mEdge e);
+
+// Counters of one qubit level of a unique table or a compute table.
+struct LevelStats {
+    std::size_t lookups{0};
+    std::size_t hits{0};
+    std::size_t inserts{0};
+    // nodes freed by a collection, or cache entries overwritten by another
+    std::size_t evictions{0};
+    std::size_t live{0};
+    std::size_t bytes{0};
+    // chain[i] counts the lookups that compared i nodes or entries, the last
+    // slot also counts all longer ones
+    std::array<std::size_t, 8> chain{};
+
+    LevelStats &operator+=(const LevelStats &rhs) {
+        lookups += rhs.lookups;
+        hits += rhs.hits;
+        inserts += rhs.inserts;
+        evictions += rhs.evictions;
+        live += rhs.live;
+        bytes += rhs.bytes;
+        for (std::size_t i = 0; i < chain.size(); i++) {
+            chain[i] += rhs.chain[i];
+        }
+        return *this;
+    }
+};
+
+struct TableStats {
+    std::vector<LevelStats> levels;
+    // whole footprint, including memory that no single level owns
+    std::size_t bytes{0};
+};
+
+struct EngineStats {
+    TableStats vUnique;
+    TableStats mUnique;
+    TableStats addCache;
+    TableStats mulCache;
+    // interned weight parts, as a single level
+    TableStats cUnique;
+};
+
+EngineStats getStats();
+// zeroes the counters, but not live and bytes
+void resetStats();
+
+#ifdef isMT
+/*
+ * Where a thread looks for compute results: only in its own caches, only in
+ * the cache all threads share, or in its own first and the shared one next.
+ */
+enum class CacheTiers { Local, Shared, Both };
+#endif
+
+/*
+ * Sizes of the unique tables and compute caches. The defaults are the
+ * constants in common.h; forCircuit() derives them from the number of qubits
+ * of a circuit and the memory the engine may use for it instead.
+ */
+struct EngineConfig {
+    QubitCount qubits{NQUBITS};
+    // compute cache buckets per operation and level, or per operation with
+    // FLAT_CACHE, where it must be a power of two; with isMT per thread
+    std::size_t cacheBuckets{CACHE_BUCKETS};
+    // first chunk of the cache bucket pools, later ones grow by growthFactor
+    std::size_t cacheChunk{CACHE_CHUNK_SIZE};
+    std::size_t growthFactor{GROWTH_FACTOR};
+    // live nodes at which gc() starts collecting
+    std::size_t gcNodes{GC_NODES};
+    // hard cap on the node slabs of both unique tables in bytes, 0 for none;
+    // gc() collects regardless of gcNodes once 7/8 of it are mapped
+    std::size_t nodeMemory{0};
+    // map node slabs on huge pages (MAP_HUGETLB, else transparent ones)
+    bool hugePages{false};
+    // snap edge weights to values seen before (cUnique); costs a table
+    // lookup per weight, which does not pay off when weights never repeat
+    bool internWeights{true};
+    // fuseGates() only makes gates that act on at most fusionSpan adjacent
+    // qubits and have at most fusionNodes nodes; 0 turns fusion off
+    QubitCount fusionSpan{FUSION_SPAN};
+    std::size_t fusionNodes{FUSION_NODES};
+#ifdef isMT
+    CacheTiers cacheTiers{CacheTiers::Both};
+    // buckets per operation of the shared compute cache, a power of two
+    std::size_t sharedCacheBuckets{SHARED_CACHE_BUCKETS};
+    // mv_multiply and mm_multiply run the sub-products of every level at or
+    // above this one on fibers, which idle Scheduler workers steal; NO_FORK
+    // never does
+    Qubit forkLevel{NO_FORK};
+#endif
+
+    static EngineConfig forCircuit(QubitCount qubits, std::size_t memoryBudget);
+};
+
+/*
+ * Replaces the unique tables and compute caches by empty ones sized by
+ * config. Every edge made before is invalid afterwards.
+ */
+void configure(const EngineConfig &config);
+const EngineConfig &getConfig();
+
+/*
+ * Incremented by every collection. Compute cache entries remember the epoch
+ * they were written in and are only valid while none of their nodes has
+ * been freed or handed out again since (see AddCache/MulCache).
+ */
+extern std::uint16_t gcEpoch;
+
+/*
+ * In-place mark-and-sweep collection of the unique tables. Every node that
+ * is not reachable from the given roots is put back on the free list, so
+ * edges kept anywhere else are invalid afterwards. identityTable is always a root of mUnique.
+ */
+void collectGarbage(const std::vector<vEdge> &vroots,
+                    const std::vector<mEdge> &mroots);
+
+#ifdef isMT
+/*
+ * collectGarbage() without stopping the world: marks and sweeps on a thread
+ * of its own while the caller and other threads go on using the engine.
+ * It must be called where no thread holds a DD that is not reachable from
+ * the roots; DDs made or found in a table or cache afterwards are kept.
+ * Freed nodes go through nodeEpoch (epoch.h), weights are not collected and
+ * slabs stay mapped. The result is the number of nodes freed. Any other
+ * collection, or configure(), waits for it first.
+ */
+std::shared_future<std::size_t> collectGarbageConcurrently(const std::vector<vEdge> &vroots,
+                                                           const std::vector<mEdge> &mroots);
+#endif
+
+// Collects vUnique only, and only once it holds gcNodes live nodes.
 vEdge gc(vEdge state);
+// Same, but also collects mUnique, keeping the given gates alive.
+vEdge gc(vEdge state, const std::vector<mEdge> &gates);
+#ifdef isMT
+// gc(state, gates) by collectGarbageConcurrently(): starts a collection and
+// returns without waiting for it. While one runs, it only waits for it once
+// the node memory runs low. states are kept alive next to state.
+vEdge gcConcurrently(vEdge state, const std::vector<mEdge> &gates,
+                     const std::vector<vEdge> &states = {});
+// Waits for the collection gcConcurrently() started, if one did, and then
+// collects the weights, which the concurrent collection leaves alone. Call it
+// where no other thread uses the engine.
+void finishGcConcurrently();
+#endif
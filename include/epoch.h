@@ -1,37 +1,61 @@
 #pragma once
 
-#include <atomic>
 #include <array>
-#include <tbb/enumerable_thread_specific.h>
-#include <tbb/combinable.h>
-
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/*
+ * Epoch-based reclamation. A thread reads shared nodes only inside an
+ * EpochGuard, which publishes the global epoch it entered in. A node that
+ * can no longer be found is retired instead of freed, stamped with the
+ * epoch of its retirement, and reclaimed once every thread has left the
+ * epochs before, as none of them can still be looking at it then.
+ *
+ * The unique tables retire the nodes a concurrent collection removes this
+ * way, see CHashTable::sweepConcurrently(). A thread that exits leaves the
+ * nodes it has not reclaimed yet to the threads that go on.
+ */
+
+// frees a retired node into the structure it came from
+using Reclaim = void (*)(void *owner, void *node);
+
+struct Retired {
+    void *node;
+    void *owner;
+    Reclaim reclaim;
+};
 
 struct DeleteEntry {
-    std::array<void*, 32> nodes;
+    std::array<Retired, 32> nodes;
     uint64_t epoch;
     std::size_t nodesCount;
     DeleteEntry *next;
 };
 
+// nodes retired by one thread, newest entry first
+struct DeletionList {
+    DeleteEntry *headDeletionList{nullptr};
+    DeleteEntry *freeLabelDeletes{nullptr};
+    std::size_t deletionListCount{0};
 
-struct DeletionList{
-        DeleteEntry* headDeletionList{nullptr};
-        DeleteEntry* freeLabelDeletes{nullptr};
-        std::size_t deletionListCount{0};
-
-        std::atomic<uint64_t> localEpoch;
-        std::size_t thresholdCounter{0};
-
-        ~DeletionList();
-        DeleteEntry* head();
+    ~DeletionList();
+    DeleteEntry *head();
 
-        void add(void* n, uint64_t globalEpoch);
-        void remove(DeleteEntry* label, DeleteEntry* prev);
+    void add(const Retired &n, uint64_t globalEpoch);
+    void remove(DeleteEntry *label, DeleteEntry *prev);
+    // moves the entries of other to this list
+    void splice(DeletionList &other);
+    // reclaims the entries retired before epoch; returns the number of nodes
+    std::size_t reclaim(uint64_t epoch);
 
-        std::size_t size();
+    std::size_t size();
 
-        uint64_t deleted = 0;
-        uint64_t added = 0;
+    uint64_t deleted = 0;
+    uint64_t added = 0;
 };
 
 class Epoch;
@@ -40,71 +64,76 @@ class EpochGuard;
 class ThreadInfo {
     friend class Epoch;
     friend class EpochGuard;
-    Epoch& epoch;
-    DeletionList& deletionList;
 
+    // epoch entered by the outermost guard, QUIESCENT outside of guards
+    std::atomic<uint64_t> localEpoch;
+    unsigned depth{0};
+    DeletionList deletionList;
 
-    DeletionList& getDeletionList() const;
-public:
+  public:
+    static constexpr uint64_t QUIESCENT = std::numeric_limits<uint64_t>::max();
 
-    ThreadInfo(Epoch& epoche);
-
-    ThreadInfo(const ThreadInfo &ti) : epoch(ti.epoch), deletionList(ti.deletionList) {
-    }
-
-    ~ThreadInfo();
-
-    Epoch& getEpoch() const;
+    ThreadInfo() : localEpoch(QUIESCENT) {}
+    ThreadInfo(const ThreadInfo &) = delete;
+    ThreadInfo &operator=(const ThreadInfo &) = delete;
 };
 
 class Epoch {
-    friend class ThreadInfo;
-    std::atomic<uint64_t> currentEpoch{0}; //global epoch
-
-    tbb::enumerable_thread_specific<DeletionList> deletionLists;
-
-    size_t startGCThreshhold;
-
+    std::atomic<uint64_t> currentEpoch{0}; // global epoch
+
+    // threads register on first use and leave when they exit
+    std::mutex threadsMutex;
+    std::vector<ThreadInfo *> threads;
+    // retired by threads that have exited, under threadsMutex
+    DeletionList orphans;
+
+    // the ThreadInfo of the calling thread per Epoch, deregistered at exit
+    struct Registration {
+        std::vector<std::pair<Epoch *, ThreadInfo *>> infos;
+        ~Registration();
+    };
+    static inline thread_local Registration registration;
+
+    uint64_t oldestEpoch();
+    void leave(ThreadInfo *info);
+
+  public:
+    Epoch() = default;
+    ~Epoch();
 
-public:
-    Epoch(size_t startGCThreshhold) : startGCThreshhold(startGCThreshhold) { }
+    ThreadInfo &threadInfo();
 
-    ~Epoch();
+    void enterEpoch(ThreadInfo &info);
+    void exitEpoch(ThreadInfo &info);
 
-    void enterEpoch(ThreadInfo &epochInfo);
+    // retires n for the calling thread, to be reclaimed by it later
+    void markNodeForDeletion(const Retired &n);
 
-    void markNodeForDeletion(void *n, ThreadInfo &epochInfo);
+    // advances the epoch and waits until no thread is in an earlier one
+    void synchronize();
 
-    void exitEpochAndCleanup(ThreadInfo &info);
+    // reclaims what the calling thread and the threads that have exited
+    // retired before the epoch of every thread still inside a guard; returns
+    // the number of nodes
+    std::size_t cleanup();
 
     void showDeleteRatio();
-
 };
 
-class EpochGuard {
-    ThreadInfo& threadEpochInfo;
-public:
+// the Epoch of the node tables
+extern Epoch nodeEpoch;
 
-    EpochGuard(ThreadInfo& threadEpochInfo) : threadEpochInfo(threadEpochInfo) {
-        threadEpochInfo.getEpoch().enterEpoch(threadEpochInfo);
-    }
+class EpochGuard {
+    Epoch &epoch;
+    ThreadInfo &info;
 
-    ~EpochGuard() {
-        threadEpochInfo.getEpoch().exitEpochAndCleanup(threadEpochInfo);
+  public:
+    explicit EpochGuard(Epoch &epoch) : epoch(epoch), info(epoch.threadInfo()) {
+        epoch.enterEpoch(info);
     }
-};
-
-class EpochGuardReadonly {
-public:
 
-    EpochGuardReadonly(ThreadInfo& threadEpochInfo) {
-        threadEpochInfo.getEpoch().enterEpoch(threadEpochInfo);
-    }
+    ~EpochGuard() { epoch.exitEpoch(info); }
 
-    ~EpochGuardReadonly() {
-    }
+    EpochGuard(const EpochGuard &) = delete;
+    EpochGuard &operator=(const EpochGuard &) = delete;
 };
-
-inline ThreadInfo::~ThreadInfo() {
-    deletionList.localEpoch.store(std::numeric_limits<uint64_t>::max());
-}
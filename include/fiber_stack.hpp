@@ -0,0 +1,50 @@
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+#include <boost/context/protected_fixedsize_stack.hpp>
+#include <boost/context/stack_context.hpp>
+
+/*
+ * Stack allocator of fibers: protected_fixedsize_stack (mapped with a guard
+ * page below it) whose stacks are not unmapped when their fiber is done but
+ * kept by the thread that freed them for the next fiber it starts with a
+ * stack of the same size. Forked fibers are many and short, so mapping every
+ * stack afresh would cost more than their work.
+ */
+class ReusedStack {
+    using Stack = boost::context::stack_context;
+
+    // the stacks a thread has freed by the size they were asked for,
+    // unmapped when it exits
+    struct Cache {
+        std::unordered_map<std::size_t, std::vector<Stack>> stacks;
+
+        ~Cache() {
+            for (auto &[size, free] : stacks) {
+                for (Stack &s : free) {
+                    boost::context::protected_fixedsize_stack(s.size).deallocate(s);
+                }
+            }
+        }
+    };
+    static inline thread_local Cache cache;
+
+    std::size_t size;
+
+  public:
+    explicit ReusedStack(std::size_t size) : size(size) {}
+
+    Stack allocate() {
+        std::vector<Stack> &free = cache.stacks[size];
+        if (free.empty()) {
+            return boost::context::protected_fixedsize_stack(size).allocate();
+        }
+        Stack s = free.back();
+        free.pop_back();
+        return s;
+    }
+
+    // the fiber keeps the allocator that made its stack, so size is the class
+    void deallocate(Stack &s) noexcept { cache.stacks[size].push_back(s); }
+};
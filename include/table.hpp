@@ -5,11 +5,25 @@
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
+#include <climits>
+#include <cmath>
 #include <functional>
 #include <iostream>
 #include <mutex>
+#include <new>
+#include <optional>
 #include <random>
 #include <stdio.h>
+#include <type_traits>
+#include <sys/mman.h>
+#include <utility>
+#ifdef isMT
+#include "epoch.h"
+#include <atomic>
+#include <thread>
+#include <tbb/enumerable_thread_specific.h>
+#endif
 
 /*
  * CL_MASK and CL_MASK_R are for the probe sequence calculation.
@@ -20,34 +34,994 @@ static const uint64_t CL_MASK_R = ((LINE_SIZE) / 8) - 1;  // X&CL_MASK_R = X%8
                                                           //
                                                           //
 
-template <typename T, typename Hash = std::hash<T>,
-          typename ValueEqual = std::equal_to<T>>
-class CHashTable {
+// Hash() of a node only mixes its edges together; finalize it so that both
+// the bucket index (low bits) and the fingerprint (high bits) are usable.
+template <typename T, typename Hash> inline std::size_t nodeHash(const T &n) {
+    return murmur_hash(Hash()(n));
+}
+
+/*
+ * One V for each thread, for state that a table keeps apart per thread so
+ * that lookups need not synchronize on it, such as counters and node
+ * allocation caches. Without isMT there is just the one V.
+ */
+template <typename V> class PerThread {
   public:
-    CHashTable(QubitCount n) : _tables{n}, _qn(n){};
+    explicit PerThread(const V &init = V{}) : _v(init) {}
+    // each V is made by make() instead, when its thread first needs it
+    template <typename F, typename = std::enable_if_t<std::is_invocable_r_v<V, F>>>
+    explicit PerThread(F make)
+#ifdef isMT
+        : _v(make) {}
+#else
+        : _v(make()) {}
+#endif
 
-    QubitCount getQubitCount() const { return _qn; }
+    V &local() {
+#ifdef isMT
+        return _v.local();
+#else
+        return _v;
+#endif
+    }
 
-    T *getNode() {
-        if (_cache.available != nullptr) {
-            T *p = _cache.available;
-            _cache.available = p->next;
-            p->next = nullptr;
+    // visits the V of every thread that has used local() so far
+    template <typename F> void forEach(F f) {
+#ifdef isMT
+        for (V &v : _v) {
+            f(v);
+        }
+#else
+        f(_v);
+#endif
+    }
+
+    template <typename F> void forEach(F f) const {
+#ifdef isMT
+        for (const V &v : _v) {
+            f(v);
+        }
+#else
+        f(_v);
+#endif
+    }
+
+  private:
+#ifdef isMT
+    tbb::enumerable_thread_specific<V, tbb::cache_aligned_allocator<V>,
+                                    tbb::ets_key_per_instance>
+        _v;
+#else
+    V _v;
+#endif
+};
+
+/*
+ * Bytes of node slabs that all arenas sharing it may map together. Going
+ * over cap makes NodeArena::allocate() throw std::bad_alloc; collecting
+ * before that is up to the caller (see gc()). A cap of 0 is no limit.
+ */
+struct SlabBudget {
+    std::size_t cap{0};
+    std::size_t used{0};
+};
+
+/*
+ * Node storage of a CHashTable: fixed-size slabs of SLAB_BYTES mapped
+ * straight from the OS, optionally on huge pages, plus a free list through
+ * T::next. Nodes are handed out from the free list first and otherwise
+ * bumped off the last slab. sweep() unmaps slabs none of whose nodes
+ * survived a collection.
+ *
+ * Every node also has a 32-bit NodeHandle, slab << SLOT_BITS | slot, where
+ * slab indexes a registry shared by all arenas of T. Slabs are aligned to
+ * SLAB_BYTES and slot 0 holds the slab index instead of a node, so handle()
+ * needs no lookup, slot 0 is never a handle and TERMINAL names T::terminal.
+ *
+ * With isMT every thread allocates from and releases to a cache of its own,
+ * which trades BATCH nodes at a time with the shared free list and slabs
+ * under slabMutex(). Everything else, forEach() and sweep() included, needs
+ * the other threads to stay out of the arena.
+ */
+template <typename T> class NodeArena {
+  public:
+    static constexpr unsigned SLOT_BITS = 15;
+    static constexpr NodeHandle SLOT_MASK = (1u << SLOT_BITS) - 1;
+    static constexpr std::size_t MAX_SLABS = std::size_t{1} << (32 - SLOT_BITS);
+    static constexpr std::size_t SLOTS = SLAB_BYTES / sizeof(T);
+    static constexpr std::size_t PER_SLAB = SLOTS - 1;
+    static_assert(SLOTS <= SLOT_MASK + 1);
+    static_assert(sizeof(NodeHandle) <= sizeof(T));
+
+    explicit NodeArena(SlabBudget *budget = nullptr, bool hugePages = false)
+        : _budget(budget), _hugePages(hugePages) {}
+    NodeArena(NodeArena &&other) noexcept { swap(other); }
+    NodeArena &operator=(NodeArena &&other) noexcept {
+        swap(other);
+        return *this;
+    }
+    ~NodeArena() {
+        for (T *slab : _slabs) {
+            unmap(slab);
+        }
+    }
+
+    static NodeHandle handle(const T *p) {
+        if (p == T::terminal) {
+            return static_cast<NodeHandle>(TERMINAL);
+        }
+        const auto addr = reinterpret_cast<std::uintptr_t>(p);
+        const auto base = addr & ~(SLAB_BYTES - 1);
+        const NodeHandle slab = *reinterpret_cast<const NodeHandle *>(base);
+        return slab << SLOT_BITS | static_cast<NodeHandle>((addr - base) / sizeof(T));
+    }
+
+    static T *node(NodeHandle h) { return _registry[h >> SLOT_BITS] + (h & SLOT_MASK); }
+
+    T *allocate() {
+#ifdef isMT
+        Cache &c = _cache.local();
+        if (c.head == nullptr) {
+            refill(c);
+        }
+        T *p = c.head;
+        c.head = p->next;
+        c.count--;
+        return p;
+#else
+        if (_available != nullptr) {
+            T *p = _available;
+            _available = p->next;
             return p;
         }
+        return bump();
+#endif
+    }
+
+    void release(T *p) {
+#ifdef isMT
+        Cache &c = _cache.local();
+        p->next = c.head;
+        c.head = p;
+        if (++c.count > 2 * BATCH) {
+            spill(c);
+        }
+#else
+        push(p);
+#endif
+    }
+
+    // visits every node allocate() has handed out
+    template <typename F> void forEach(F f) {
+        for (std::size_t i = 0; i < _slabs.size(); i++) {
+            const std::size_t end = i + 1 == _slabs.size() ? _top : SLOTS;
+            for (std::size_t j = 1; j < end; j++) {
+                f(_slabs[i][j]);
+            }
+        }
+    }
+
+    /*
+     * Rebuilds the free list from every handed-out node for which keep()
+     * returns false. A slab with no kept node goes back to the OS instead,
+     * unless nodes are still bumped off it. The list is built so that the
+     * lowest slabs are refilled first, which leaves the others more likely
+     * to empty out. Returns the number of slabs unmapped.
+     */
+    template <typename F> std::size_t sweep(F keep) {
+#ifdef isMT
+        _cache.forEach([](Cache &c) { c = Cache{}; });
+#endif
+        _available = nullptr;
+        std::vector<T *> slabs;
+        std::size_t released = 0;
+        for (std::size_t i = _slabs.size(); i-- > 0;) {
+            const bool last = i + 1 == _slabs.size();
+            const std::size_t end = last ? _top : SLOTS;
+            T *head = _available;
+            bool used = false;
+            for (std::size_t j = end; j-- > 1;) {
+                if (keep(_slabs[i][j])) {
+                    used = true;
+                } else {
+                    push(&_slabs[i][j]);
+                }
+            }
+            if (used || last) {
+                slabs.push_back(_slabs[i]);
+            } else {
+                _available = head;
+                unmap(_slabs[i]);
+                released++;
+            }
+        }
+        std::reverse(slabs.begin(), slabs.end());
+        _slabs.swap(slabs);
+        return released;
+    }
+
+    // nodes the mapped slabs can hold
+    std::size_t capacity() const { return _slabs.size() * PER_SLAB; }
+    std::size_t bytes() const { return _slabs.size() * SLAB_BYTES; }
+    std::size_t slabs() const { return _slabs.size(); }
+
+  private:
+    void push(T *p) {
+        p->next = _available;
+        _available = p;
+    }
+
+    T *bump() {
+        if (_slabs.empty() || _top == SLOTS) {
+            _slabs.push_back(map());
+            _top = 1;
+        }
+        return new (_slabs.back() + _top++) T{};
+    }
+
+#ifdef isMT
+    static constexpr std::size_t BATCH = 64;
+
+    struct Cache {
+        T *head{nullptr};
+        std::size_t count{0};
+    };
+
+    // slabs and budgets are shared by the arenas of both node types
+    static std::mutex &slabMutex() {
+        static std::mutex m;
+        return m;
+    }
+
+    void refill(Cache &c) {
+        std::lock_guard<std::mutex> lock(slabMutex());
+        for (; c.count < BATCH; c.count++) {
+            T *p = _available;
+            if (p != nullptr) {
+                _available = p->next;
+            } else {
+                p = bump();
+                p->v = -2; // free until handed out, as far as forEach() goes
+            }
+            p->next = c.head;
+            c.head = p;
+        }
+    }
+
+    // hands all but BATCH of the cached nodes back to the shared list
+    void spill(Cache &c) {
+        T *first = c.head;
+        T *last = first;
+        for (std::size_t i = 1; i < c.count - BATCH; i++) {
+            last = last->next;
+        }
+        c.head = last->next;
+        c.count = BATCH;
+
+        std::lock_guard<std::mutex> lock(slabMutex());
+        last->next = _available;
+        _available = first;
+    }
+#endif
+
+    T *map() {
+        if (_budget != nullptr) {
+            if (_budget->cap != 0 && _budget->used + SLAB_BYTES > _budget->cap) {
+                throw std::bad_alloc();
+            }
+            _budget->used += SLAB_BYTES;
+        }
+        std::vector<NodeHandle> &freeSlabs = unusedSlabs();
+        if (freeSlabs.empty() && _nextSlab == MAX_SLABS) {
+            giveBack();
+            throw std::bad_alloc();
+        }
+
+        void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        if (_hugePages) {
+            // needs reserved huge pages (vm.nr_hugepages), so fall back quietly
+            p = mmap(nullptr, SLAB_BYTES, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        }
+#endif
+        if (p == MAP_FAILED) {
+            p = mapAligned();
+#ifdef MADV_HUGEPAGE
+            if (_hugePages) {
+                madvise(p, SLAB_BYTES, MADV_HUGEPAGE);
+            }
+#endif
+        }
+
+        NodeHandle slab;
+        if (freeSlabs.empty()) {
+            slab = _nextSlab++;
+        } else {
+            slab = freeSlabs.back();
+            freeSlabs.pop_back();
+        }
+        _registry[slab] = static_cast<T *>(p);
+        *static_cast<NodeHandle *>(p) = slab;
+        return static_cast<T *>(p);
+    }
+
+    // over-maps by one slab and trims, as mmap only aligns to pages
+    void *mapAligned() {
+        void *p = mmap(nullptr, 2 * SLAB_BYTES, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            giveBack();
+            throw std::bad_alloc();
+        }
+        const auto addr = reinterpret_cast<std::uintptr_t>(p);
+        const auto aligned = (addr + SLAB_BYTES - 1) & ~(SLAB_BYTES - 1);
+        if (aligned != addr) {
+            munmap(p, aligned - addr);
+        }
+        munmap(reinterpret_cast<void *>(aligned + SLAB_BYTES), addr + SLAB_BYTES - aligned);
+        return reinterpret_cast<void *>(aligned);
+    }
+
+    void unmap(T *slab) {
+        const NodeHandle index = *reinterpret_cast<const NodeHandle *>(slab);
+        _registry[index] = nullptr;
+        unusedSlabs().push_back(index);
+        munmap(slab, SLAB_BYTES);
+        giveBack();
+    }
+
+    void giveBack() {
+        if (_budget != nullptr) {
+            _budget->used -= SLAB_BYTES;
+        }
+    }
+
+    void swap(NodeArena &other) noexcept {
+        std::swap(_slabs, other._slabs);
+        std::swap(_top, other._top);
+        std::swap(_available, other._available);
+        std::swap(_budget, other._budget);
+        std::swap(_hugePages, other._hugePages);
+#ifdef isMT
+        std::swap(_cache, other._cache);
+#endif
+    }
+
+    static std::vector<NodeHandle> &unusedSlabs() {
+        static std::vector<NodeHandle> slabs;
+        return slabs;
+    }
+
+    // slab 0 is T::terminal, so that node(TERMINAL) needs no branch
+    inline static T *_registry[MAX_SLABS] = {T::terminal};
+    inline static NodeHandle _nextSlab = 1;
+
+    std::vector<T *> _slabs;
+    std::size_t _top{0}; // next slot to hand out from the last slab
+    T *_available{nullptr};
+    SlabBudget *_budget{nullptr};
+    bool _hugePages{false};
+#ifdef isMT
+    PerThread<Cache> _cache;
+#endif
+};
+
+/*
+ * Bucket layouts for one qubit level of CHashTable.
+ *
+ * Both start at UT_INIT_SZ and double once they get too full. Doubling does
+ * not stop the world: the previous array is kept in _old and REHASH_STEP
+ * buckets (or cache lines) of it are moved over on every lookup that touches
+ * the level, so lookups consult both arrays until the migration is finished.
+ */
+
+// Singly linked chains through T::next.
+template <typename T, typename Hash, typename ValueEqual>
+class ChainedBuckets {
+  public:
+    ChainedBuckets() : _buckets(UT_INIT_SZ, nullptr) {}
+
+    // `compared` is increased by the number of nodes looked at
+    T *find(std::size_t h, const T *node, std::size_t &compared) {
+        if (!_old.empty()) {
+            migrate(REHASH_STEP);
+        }
+
+        T *found = chain(_buckets[h & (_buckets.size() - 1)], node, compared);
+        if (found == nullptr && !_old.empty()) {
+            const std::size_t oldKey = h & (_old.size() - 1);
+            if (oldKey >= _migrated) {
+                found = chain(_old[oldKey], node, compared);
+            }
+        }
+        return found;
+    }
+
+    // the node equal to `node`, which is inserted if there is none yet
+    T *findOrInsert(std::size_t h, T *node, std::size_t &compared) {
+        T *found = find(h, node, compared);
+        if (found != nullptr) {
+            return found;
+        }
+        insert(h, node);
+        return node;
+    }
+
+    void insert(std::size_t h, T *node) {
+        T *&head = _buckets[h & (_buckets.size() - 1)];
+        node->next = head;
+        head = node;
+        _count++;
+
+        if (_count > _buckets.size() * MAX_LOAD_FACTOR) {
+            grow();
+        }
+    }
+
+    std::size_t size() const { return _count; }
+    std::size_t capacity() const { return _buckets.size() + _old.size(); }
+
+    // drops every node and resizes for `expected` insertions
+    void clear(std::size_t expected) {
+        std::size_t n = UT_INIT_SZ;
+        while (n * MAX_LOAD_FACTOR < expected) {
+            n *= 2;
+        }
+        std::vector<T *>(n, nullptr).swap(_buckets);
+        std::vector<T *>().swap(_old);
+        _migrated = 0;
+        _count = 0;
+    }
+
+  private:
+    static constexpr std::size_t MAX_LOAD_FACTOR = 1;
+    static constexpr std::size_t REHASH_STEP = 16;
+
+    static T *chain(T *current, const T *node, std::size_t &compared) {
+        while (current != nullptr) {
+            compared++;
+            if (ValueEqual()(*node, *current)) {
+                return current;
+            }
+            current = current->next;
+        }
+        return nullptr;
+    }
+
+    void migrate(std::size_t steps) {
+        const std::size_t mask = _buckets.size() - 1;
+        const std::size_t end = std::min(_old.size(), _migrated + steps);
+        for (; _migrated < end; _migrated++) {
+            T *current = _old[_migrated];
+            while (current != nullptr) {
+                T *next = current->next;
+                T *&head = _buckets[nodeHash<T, Hash>(*current) & mask];
+                current->next = head;
+                head = current;
+                current = next;
+            }
+            _old[_migrated] = nullptr;
+        }
+        if (_migrated == _old.size()) {
+            std::vector<T *>().swap(_old);
+            _migrated = 0;
+        }
+    }
+
+    void grow() {
+        if (!_old.empty()) {
+            migrate(_old.size());
+        }
+        _old.swap(_buckets);
+        _buckets.assign(_old.size() * 2, nullptr);
+        _migrated = 0;
+    }
+
+    std::vector<T *> _buckets;
+    std::vector<T *> _old;
+    std::size_t _migrated{0};
+    std::size_t _count{0};
+};
+
+/*
+ * Open addressing over 64-bit slots, probed one cache line at a time. A slot
+ * keeps the node pointer in its low TAG_SHIFT bits and the top bits of the
+ * node's hash above them, so a probe only dereferences a node whose
+ * fingerprint already matches. A probe visits the whole home line before it
+ * moves on to the next one and ends at the first empty slot, so with at most
+ * MAX_LOAD of the slots occupied a lookup typically costs one line fetch.
+ *
+ * A line with an empty slot ends every probe that reaches it. The migration
+ * therefore starts right after such a line and only pauses after migrating
+ * one, so a node still in _old is always found by probing _old from its
+ * home line, and a home line that has been migrated has nothing left there.
+ */
+template <typename T, typename Hash, typename ValueEqual>
+class LineBuckets {
+  public:
+    LineBuckets() : _slots(UT_INIT_SZ, EMPTY) {}
+
+    // `compared` is increased by the number of occupied slots looked at
+    T *find(std::size_t h, const T *node, std::size_t &compared) {
+        if (!_old.empty()) {
+            migrate(REHASH_STEP);
+        }
+
+        T *found = probe(_slots, h, node, compared);
+        if (found == nullptr && !_old.empty()) {
+            const std::size_t nlines = _old.size() / LINE_SLOTS;
+            const std::size_t home = (h & (_old.size() - 1)) / LINE_SLOTS;
+            if ((home + nlines - _start) % nlines >= _migrated) {
+                found = probe(_old, h, node, compared);
+            }
+        }
+        return found;
+    }
+
+    // the node equal to `node`, which is inserted if there is none yet
+    T *findOrInsert(std::size_t h, T *node, std::size_t &compared) {
+        T *found = find(h, node, compared);
+        if (found != nullptr) {
+            return found;
+        }
+        insert(h, node);
+        return node;
+    }
+
+    void insert(std::size_t h, T *node) {
+        place(_slots, h, node);
+        _count++;
+
+        if (_count * MAX_LOAD_DEN > _slots.size() * MAX_LOAD_NUM) {
+            grow();
+        }
+    }
+
+    std::size_t size() const { return _count; }
+    std::size_t capacity() const { return _slots.size() + _old.size(); }
+
+    // drops every node and resizes for `expected` insertions
+    void clear(std::size_t expected) {
+        std::size_t n = UT_INIT_SZ;
+        while (n * MAX_LOAD_NUM < expected * MAX_LOAD_DEN) {
+            n *= 2;
+        }
+        std::vector<uint64_t>(n, EMPTY).swap(_slots);
+        std::vector<uint64_t>().swap(_old);
+        _start = 0;
+        _migrated = 0;
+        _count = 0;
+    }
+
+  private:
+    static constexpr std::size_t MAX_LOAD_NUM = 3; // MAX_LOAD = 3/4
+    static constexpr std::size_t MAX_LOAD_DEN = 4;
+    static constexpr std::size_t REHASH_STEP = 2; // cache lines
+    static constexpr std::size_t LINE_SLOTS = CL_MASK_R + 1;
+
+    // a slot is the upper half of the hash over the node's NodeHandle, which
+    // is never 0
+    static constexpr uint64_t EMPTY = 0;
+
+    static uint64_t fingerprint(std::size_t h) { return h & HASH_MASK; }
+
+    static uint64_t pack(std::size_t h, const T *node) {
+        return fingerprint(h) | NodeArena<T>::handle(node);
+    }
+
+    static T *unpack(uint64_t s) {
+        return NodeArena<T>::node(static_cast<NodeHandle>(s & INDEX_MASK));
+    }
+
+    static T *probe(const std::vector<uint64_t> &slots, std::size_t h,
+                    const T *node, std::size_t &compared) {
+        const std::size_t mask = slots.size() - 1;
+        const uint64_t fp = fingerprint(h);
+        std::size_t line = h & mask & CL_MASK;
+
+        for (std::size_t n = 0; n < slots.size(); n += LINE_SLOTS) {
+            for (std::size_t i = 0; i < LINE_SLOTS; i++) {
+                const uint64_t s = slots[line | ((h + i) & CL_MASK_R)];
+                if (s == EMPTY) {
+                    return nullptr;
+                }
+                compared++;
+                if ((s & HASH_MASK) == fp && ValueEqual()(*node, *unpack(s))) {
+                    return unpack(s);
+                }
+            }
+            line = (line + LINE_SLOTS) & mask;
+        }
+        return nullptr;
+    }
+
+    static void place(std::vector<uint64_t> &slots, std::size_t h, T *node) {
+        const std::size_t mask = slots.size() - 1;
+        std::size_t line = h & mask & CL_MASK;
+
+        for (;;) {
+            for (std::size_t i = 0; i < LINE_SLOTS; i++) {
+                uint64_t &s = slots[line | ((h + i) & CL_MASK_R)];
+                if (s == EMPTY) {
+                    s = pack(h, node);
+                    return;
+                }
+            }
+            line = (line + LINE_SLOTS) & mask;
+        }
+    }
+
+    // moves at least `lines` lines of _old, stopping after a non-full one
+    void migrate(std::size_t lines) {
+        const std::size_t nlines = _old.size() / LINE_SLOTS;
+        for (std::size_t done = 1; _migrated < nlines; done++) {
+            const std::size_t line = ((_start + _migrated) % nlines) * LINE_SLOTS;
+            bool full = true;
+            for (std::size_t i = 0; i < LINE_SLOTS; i++) {
+                uint64_t &s = _old[line + i];
+                if (s == EMPTY) {
+                    full = false;
+                    continue;
+                }
+                T *node = unpack(s);
+                place(_slots, nodeHash<T, Hash>(*node), node);
+                s = EMPTY;
+            }
+            _migrated++;
+            if (!full && done >= lines) {
+                break;
+            }
+        }
+        if (_migrated == nlines) {
+            std::vector<uint64_t>().swap(_old);
+            _migrated = 0;
+        }
+    }
+
+    void grow() {
+        if (!_old.empty()) {
+            migrate(_old.size());
+        }
+        _old.swap(_slots);
+        _slots.assign(_old.size() * 2, EMPTY);
+        _migrated = 0;
 
-        if (_cache.chunkIt == _cache.chunkEndIt) {
-            _cache.chunks.emplace_back(_cache.allocationSize);
-            _cache.allocations += _cache.allocationSize;
-            _cache.allocationSize *= GROWTH_FACTOR;
-            _cache.chunkID++;
-            _cache.chunkIt = _cache.chunks[_cache.chunkID].begin();
-            _cache.chunkEndIt = _cache.chunks[_cache.chunkID].end();
+        const std::size_t nlines = _old.size() / LINE_SLOTS;
+        for (std::size_t line = 0; line < nlines; line++) {
+            const auto begin = _old.begin() + line * LINE_SLOTS;
+            if (std::find(begin, begin + LINE_SLOTS, EMPTY) != begin + LINE_SLOTS) {
+                _start = (line + 1) % nlines;
+                break;
+            }
         }
+    }
+
+    std::vector<uint64_t> _slots;
+    std::vector<uint64_t> _old;
+    std::size_t _start{0};    // first line of _old to migrate
+    std::size_t _migrated{0}; // lines of _old migrated so far
+    std::size_t _count{0};
+};
+
+#ifdef isMT
+/*
+ * State of the concurrent collection of the nodes of type T, see
+ * CHashTable::sweepConcurrently(). While it marks, every node taken from a
+ * unique table or compute cache is marked with all it reaches (shade()),
+ * so that it survives as if it were a root; while it sweeps, unmarked ones
+ * are not taken any more (admit()). Nodes handed out since the collection
+ * began (gen >= Collection<T>::gen) are kept regardless.
+ */
+enum class GcPhase : std::uint8_t { Idle, Mark, Sweep };
+
+template <typename T> struct Collection {
+    inline static std::atomic<GcPhase> phase{GcPhase::Idle};
+    inline static std::uint16_t gen{0};
+};
+
+template <typename T> inline bool isMarked(const T *n) {
+    return __atomic_load_n(&n->marked, __ATOMIC_ACQUIRE);
+}
+
+// marks n and whatever it reaches, unless it is newer than the collection
+template <typename T> inline void shade(T *n) {
+    if (n->v < 0 || n->gen >= Collection<T>::gen || isMarked(n) ||
+        __atomic_exchange_n(&n->marked, true, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    for (auto &e : n->children) {
+        shade(e.n);
+    }
+}
+
+// whether a node found in a table or cache may be used
+template <typename T> inline bool admit(T *n) {
+    if (Collection<T>::phase.load(std::memory_order_acquire) == GcPhase::Idle) {
+        return true;
+    }
+    EpochGuard guard(nodeEpoch);
+    switch (Collection<T>::phase.load()) {
+    case GcPhase::Mark:
+        shade(n);
+        return true;
+    case GcPhase::Sweep:
+        // reclaimed ones (v == -2) are turned down by isCurrent()
+        return n->v < 0 || n->gen >= Collection<T>::gen || isMarked(n);
+    default:
+        return true;
+    }
+}
+#endif
+
+#ifdef isMT
+/*
+ * LineBuckets for threads that look up concurrently. Slots are the same, but
+ * atomic, and a node is inserted by a CAS on the first empty slot of its
+ * probe sequence. As slots never become empty again, two threads inserting
+ * equal nodes race for the same slot and the loser finds the winner's node
+ * there, so findOrInsert() needs no lock.
+ *
+ * Growing is not incremental. The thread whose insertion passes MAX_LOAD
+ * freezes every slot of the array, copies the nodes to a private array of
+ * twice the size and publishes that. A frozen slot still matches, but a
+ * probe that would insert into one waits for the new array and starts over,
+ * so no insertion is lost in the old array. Old arrays stay mapped until the
+ * next clear(), as other threads may still be probing them.
+ *
+ * remove() turns a slot into a TOMBSTONE, which probes pass over and
+ * growing drops, so that a concurrent collection can take nodes out.
+ */
+template <typename T, typename Hash, typename ValueEqual>
+class AtomicBuckets {
+  public:
+    AtomicBuckets() { clear(0); }
+    ~AtomicBuckets() { release(); }
+    AtomicBuckets(const AtomicBuckets &) = delete;
+    AtomicBuckets &operator=(const AtomicBuckets &) = delete;
+
+    // `compared` is increased by the number of occupied slots looked at
+    T *findOrInsert(std::size_t h, T *node, std::size_t &compared) {
+        for (;;) {
+            Slots *a = _array.load(std::memory_order_acquire);
+            T *found = probe(*a, h, node, compared);
+            if (found != nullptr) {
+                return found;
+            }
+            // the array is being replaced
+            while (_array.load(std::memory_order_acquire) == a) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    void insert(std::size_t h, T *node) {
+        std::size_t compared = 0;
+        findOrInsert(h, node, compared);
+    }
+
+    // takes node out; false if it is not in the buckets
+    bool remove(std::size_t h, T *node) {
+        const uint64_t s = pack(h, node);
+        for (;;) {
+            Slots *a = _array.load(std::memory_order_acquire);
+            const std::size_t mask = a->size - 1;
+            std::size_t line = h & mask & CL_MASK;
+            bool replaced = false;
+            for (std::size_t n = 0; n < a->size && !replaced; n += LINE_SLOTS) {
+                for (std::size_t i = 0; i < LINE_SLOTS && !replaced; i++) {
+                    std::atomic<uint64_t> &slot = a->slots[line | ((h + i) & CL_MASK_R)];
+                    uint64_t expected = s;
+                    if (slot.compare_exchange_strong(expected, TOMBSTONE,
+                                                     std::memory_order_acq_rel)) {
+                        _tombstones.fetch_add(1, std::memory_order_relaxed);
+                        return true;
+                    }
+                    if (expected == EMPTY || expected == FROZEN) {
+                        return false;
+                    }
+                    replaced = expected == (s | FROZEN);
+                }
+                line = (line + LINE_SLOTS) & mask;
+            }
+            if (!replaced) {
+                return false;
+            }
+            // try again in the array replacing this one
+            while (_array.load(std::memory_order_acquire) == a) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    // visits every node of the current array; inserts meanwhile may be missed
+    template <typename F> void forEach(F f) const {
+        const Slots *a = _array.load(std::memory_order_acquire);
+        for (std::size_t i = 0; i < a->size; i++) {
+            const uint64_t s = a->slots[i].load(std::memory_order_acquire) & ~FROZEN;
+            if (s != EMPTY && s != TOMBSTONE) {
+                f(unpack(s));
+            }
+        }
+    }
+
+    std::size_t size() const {
+        return _count.load(std::memory_order_relaxed) - _tombstones.load(std::memory_order_relaxed);
+    }
+    std::size_t capacity() const { return _array.load(std::memory_order_relaxed)->size; }
+
+    // drops every node and resizes for `expected` insertions; no other
+    // thread may use the buckets meanwhile
+    void clear(std::size_t expected) {
+        std::size_t n = UT_INIT_SZ;
+        while (n * MAX_LOAD_NUM < expected * MAX_LOAD_DEN) {
+            n *= 2;
+        }
+        release();
+        _array.store(new Slots(n), std::memory_order_relaxed);
+        _count.store(0, std::memory_order_relaxed);
+        _tombstones.store(0, std::memory_order_relaxed);
+    }
+
+  private:
+    static constexpr std::size_t MAX_LOAD_NUM = 3; // MAX_LOAD = 3/4
+    static constexpr std::size_t MAX_LOAD_DEN = 4;
+    static constexpr std::size_t LINE_SLOTS = CL_MASK_R + 1;
+
+    static constexpr uint64_t EMPTY = 0;
+    // the lowest fingerprint bit marks a slot of an array being replaced
+    static constexpr uint64_t FROZEN = uint64_t{1} << HASH_SHIFT;
+    // handle 1 is in slab 0, which only holds T::terminal
+    static constexpr uint64_t TOMBSTONE = 1;
 
-        auto p = &(*_cache.chunkIt);
+    struct Slots {
+        explicit Slots(std::size_t n) : size(n), slots(new std::atomic<uint64_t>[n]) {
+            for (std::size_t i = 0; i < n; i++) {
+                slots[i].store(EMPTY, std::memory_order_relaxed);
+            }
+        }
+        ~Slots() { delete[] slots; }
+
+        std::size_t size;
+        std::atomic<uint64_t> *slots;
+        Slots *retired{nullptr}; // the array this one replaced
+    };
+
+    static uint64_t fingerprint(std::size_t h) { return h & HASH_MASK & ~FROZEN; }
+
+    static uint64_t pack(std::size_t h, const T *node) {
+        return fingerprint(h) | NodeArena<T>::handle(node);
+    }
+
+    static T *unpack(uint64_t s) {
+        return NodeArena<T>::node(static_cast<NodeHandle>(s & INDEX_MASK));
+    }
+
+    /*
+     * The node equal to `node`, after inserting `node` if there is none.
+     * nullptr means that the probe ran into a frozen empty slot, or found no
+     * empty one at all, and has to be repeated in the next array.
+     */
+    T *probe(Slots &a, std::size_t h, T *node, std::size_t &compared) {
+        const std::size_t mask = a.size - 1;
+        const uint64_t fp = fingerprint(h);
+        std::size_t line = h & mask & CL_MASK;
+
+        for (std::size_t n = 0; n < a.size; n += LINE_SLOTS) {
+            for (std::size_t i = 0; i < LINE_SLOTS; i++) {
+                std::atomic<uint64_t> &slot = a.slots[line | ((h + i) & CL_MASK_R)];
+                uint64_t s = slot.load(std::memory_order_acquire);
+                if (s == EMPTY) {
+                    if (slot.compare_exchange_strong(s, pack(h, node),
+                                                     std::memory_order_acq_rel,
+                                                     std::memory_order_acquire)) {
+                        inserted(a);
+                        return node;
+                    }
+                    // lost the slot, but maybe to an equal node
+                }
+                if (s == FROZEN) {
+                    return nullptr;
+                }
+                if ((s & ~FROZEN) == TOMBSTONE) {
+                    continue;
+                }
+                compared++;
+                if ((s & HASH_MASK & ~FROZEN) == fp && ValueEqual()(*node, *unpack(s)) &&
+                    admit(unpack(s))) {
+                    return unpack(s);
+                }
+            }
+            line = (line + LINE_SLOTS) & mask;
+        }
+        grow(a);
+        return nullptr;
+    }
+
+    void inserted(Slots &a) {
+        const std::size_t count = _count.fetch_add(1, std::memory_order_relaxed) + 1;
+        if (count * MAX_LOAD_DEN > a.size * MAX_LOAD_NUM) {
+            grow(a);
+        }
+    }
+
+    // replaces `a` with an array of twice the size, unless another thread
+    // already does
+    void grow(Slots &a) {
+        if (_growing.exchange(true, std::memory_order_acquire)) {
+            return;
+        }
+        if (_array.load(std::memory_order_relaxed) == &a) {
+            Slots *next = new Slots(a.size * 2);
+            const std::size_t mask = next->size - 1;
+            std::size_t dropped = 0;
+            for (std::size_t i = 0; i < a.size; i++) {
+                const uint64_t s = a.slots[i].fetch_or(FROZEN, std::memory_order_acq_rel);
+                if (s == EMPTY) {
+                    continue;
+                }
+                if (s == TOMBSTONE) {
+                    dropped++;
+                    continue;
+                }
+                // the fingerprint alone does not give the home line
+                const std::size_t h = nodeHash<T, Hash>(*unpack(s));
+                std::size_t line = h & mask & CL_MASK;
+                for (bool placed = false; !placed; line = (line + LINE_SLOTS) & mask) {
+                    for (std::size_t j = 0; j < LINE_SLOTS && !placed; j++) {
+                        std::atomic<uint64_t> &slot = next->slots[line | ((h + j) & CL_MASK_R)];
+                        if (slot.load(std::memory_order_relaxed) == EMPTY) {
+                            slot.store(s, std::memory_order_relaxed);
+                            placed = true;
+                        }
+                    }
+                }
+            }
+            next->retired = &a;
+            _count.fetch_sub(dropped, std::memory_order_relaxed);
+            _tombstones.fetch_sub(dropped, std::memory_order_relaxed);
+            _array.store(next, std::memory_order_release);
+        }
+        _growing.store(false, std::memory_order_release);
+    }
+
+    void release() {
+        Slots *a = _array.exchange(nullptr, std::memory_order_relaxed);
+        while (a != nullptr) {
+            delete std::exchange(a, a->retired);
+        }
+    }
+
+    std::atomic<Slots *> _array{nullptr};
+    std::atomic<std::size_t> _count{0}; // occupied slots, tombstones included
+    std::atomic<std::size_t> _tombstones{0};
+    std::atomic<bool> _growing{false};
+};
+#endif
+
+// bucket layout of CHashTable unless given
+#ifdef isMT
+template <typename T, typename Hash, typename ValueEqual>
+using DefaultBuckets = AtomicBuckets<T, Hash, ValueEqual>;
+#else
+template <typename T, typename Hash, typename ValueEqual>
+using DefaultBuckets = LineBuckets<T, Hash, ValueEqual>;
+#endif
+
+template <typename T, typename Hash = std::hash<T>,
+          typename ValueEqual = std::equal_to<T>,
+          template <typename, typename, typename> class Buckets = DefaultBuckets>
+class CHashTable {
+  public:
+    CHashTable(QubitCount n, SlabBudget *budget = nullptr, bool hugePages = false)
+        : _tables(n), _stats(std::vector<LevelStats>(n)), _arena(budget, hugePages), _qn(n){};
+
+    QubitCount getQubitCount() const { return _qn; }
+
+    T *getNode() {
+        T *p = _arena.allocate();
         p->next = nullptr;
-        ++_cache.chunkIt;
+        p->gen = gcEpoch;
         return p;
     }
 
@@ -58,74 +1032,450 @@ class CHashTable {
         }
 
         p->v = -2;
-
-        p->next = _cache.available;
-        _cache.available = p;
+        _arena.release(p);
     }
 
     T *lookup(T *node) {
-        const auto key = Hash()(*node) % NBUCKETS;
-        const Qubit v = node->v;
+#ifdef isMT
+        // a node removed by a concurrent sweep is not reclaimed before this
+        // lookup is done with it
+        std::optional<EpochGuard> guard;
+        if (Collection<T>::phase.load(std::memory_order_acquire) != GcPhase::Idle) {
+            guard.emplace(nodeEpoch);
+        }
+#endif
+        const std::size_t h = nodeHash<T, Hash>(*node);
+        Table &t = _tables[node->v];
+        LevelStats &s = _stats.local()[node->v];
+        s.lookups++;
 
-        T *current = _tables[v]._table[key];
-        T *previous = current;
+        std::size_t compared = 0;
+        T *found = t.findOrInsert(h, node, compared);
+        s.chain[std::min(compared, s.chain.size() - 1)]++;
+        if (found != node) {
+            assert(found->v == node->v);
+            s.hits++;
+            returnNode(node);
+            return found;
+        }
 
-        if (current == nullptr) {
-            _tables[v]._table[key] = node;
-            return node;
+        s.inserts++;
+        return node;
+    }
+
+    // Mark phase: flags every node reachable from `node`.
+    static void mark(T *node) {
+        if (node == nullptr || node->v < 0 || node->marked) {
+            return;
+        }
+        node->marked = true;
+        for (auto &e : node->children) {
+            mark(e.n);
         }
+    }
 
-        while (current != nullptr) {
-            if (ValueEqual()(*node, *current)) {
-                assert(current->v == node->v);
+    /*
+     * Sweep phase: every node handed out so far that was not marked goes
+     * back to the free list, and each level is rebuilt from the marked ones,
+     * so no bucket layout has to support deletion. The marks are cleared
+     * again. Slabs left without live nodes are unmapped, see
+     * takeReleasedSlabs(). Returns the number of nodes freed.
+     */
+    std::size_t sweep() {
+        std::vector<std::size_t> live(_qn, 0);
+        _arena.forEach([&live](T &n) {
+            if (n.v >= 0 && n.marked) {
+                live[n.v]++;
+            }
+        });
+        for (QubitCount q = 0; q < _qn; q++) {
+            _tables[q].clear(live[q]);
+        }
 
-                returnNode(node);
+        std::size_t freed = 0;
+        _released += _arena.sweep([this, &freed](T &n) {
+            if (n.v >= 0 && n.marked) {
+                n.marked = false;
+                _tables[n.v].insert(nodeHash<T, Hash>(n), &n);
+                return true;
+            }
+            if (n.v >= 0) {
+                _stats.local()[n.v].evictions++;
+                freed++;
+            }
+            n.v = -2;
+            return false;
+        });
+        return freed;
+    }
 
-                return current;
+#ifdef isMT
+    /*
+     * Concurrent collection: other threads go on looking up and building
+     * nodes meanwhile. beginMarking() has to be called where no thread holds
+     * a node that is not reachable from the roots handed to markRoot(); what
+     * they take from the tables and caches after that is kept by admit().
+     */
+    static void beginMarking() {
+        Collection<T>::gen = gcEpoch;
+        Collection<T>::phase.store(GcPhase::Mark);
+    }
+
+    static void markRoot(T *node) {
+        if (node != nullptr) {
+            shade(node);
+        }
+    }
+
+    /*
+     * Takes out every node that is neither marked nor newer than the
+     * collection and retires it to nodeEpoch, which reclaims it once no
+     * thread can still be looking at it. Clears the marks again and returns
+     * the number of nodes freed. Slabs stay mapped.
+     */
+    std::size_t sweepConcurrently() {
+        Collection<T>::phase.store(GcPhase::Sweep);
+        // every shade() begun while marking is finished
+        nodeEpoch.synchronize();
+
+        std::size_t freed = 0;
+        std::vector<T *> dead;
+        for (QubitCount q = 0; q < _qn; q++) {
+            dead.clear();
+            _tables[q].forEach([&dead](T *n) {
+                if (n->gen < Collection<T>::gen && !isMarked(n)) {
+                    dead.push_back(n);
+                }
+            });
+            for (T *n : dead) {
+                if (_tables[q].remove(nodeHash<T, Hash>(*n), n)) {
+                    nodeEpoch.markNodeForDeletion({n, this, &reclaim});
+                    _stats.local()[q].evictions++;
+                    freed++;
+                }
             }
+        }
+        nodeEpoch.synchronize();
+        nodeEpoch.cleanup();
 
-            previous = current;
-            current = current->next;
+        Collection<T>::phase.store(GcPhase::Idle);
+        // nobody looks at the marks any more
+        nodeEpoch.synchronize();
+        for (const Table &t : _tables) {
+            t.forEach([](T *n) { __atomic_store_n(&n->marked, false, __ATOMIC_RELEASE); });
         }
+        return freed;
+    }
+#endif
 
-        previous->next = node;
-        return node;
+    /*
+     * Slabs unmapped by sweeps since the last call. Anything still pointing
+     * at their nodes, such as compute cache entries, must be dropped before
+     * it is dereferenced again.
+     */
+    std::size_t takeReleasedSlabs() { return std::exchange(_released, 0); }
+
+    TableStats stats() const {
+        TableStats ts{std::vector<LevelStats>(_qn), 0};
+        _stats.forEach([&ts](const std::vector<LevelStats> &levels) {
+            for (std::size_t q = 0; q < levels.size(); q++) {
+                ts.levels[q] += levels[q];
+            }
+        });
+        for (QubitCount q = 0; q < _qn; q++) {
+            LevelStats &s = ts.levels[q];
+            s.live = _tables[q].size();
+            s.bytes = _tables[q].capacity() * sizeof(void *) + s.live * sizeof(T);
+            ts.bytes += _tables[q].capacity() * sizeof(void *);
+        }
+        ts.bytes += _arena.bytes();
+        return ts;
+    }
+
+    void resetStats() {
+        _stats.forEach([](std::vector<LevelStats> &levels) {
+            for (LevelStats &s : levels) {
+                s = LevelStats{};
+            }
+        });
+    }
+
+    // restamps every node as handed out in epoch 0
+    void resetGenerations() {
+        _arena.forEach([](T &n) { n.gen = 0; });
+    }
+
+    std::size_t get_live_nodes() const {
+        std::size_t live = 0;
+        for (const Table &t : _tables) {
+            live += t.size();
+        }
+        return live;
     }
 
     void dump(){
-        std::cout << "#chunk = " << _cache.chunkID << std::endl;
+        std::cout << "#slab = " << _arena.slabs() << std::endl;
+        for (QubitCount q = 0; q < _qn; q++) {
+            if (_tables[q].size() == 0)
+                continue;
+            std::cout << "q" << q << ": " << _tables[q].size() << " nodes in "
+                      << _tables[q].capacity() << " buckets" << std::endl;
+        }
     }
 
     std::size_t get_allocations(){
-        return _cache.allocations;
+        return _arena.capacity();
+    }
+
+    // visits every node currently in the table
+    template <typename F> void forEachLive(F f) {
+        _arena.forEach([&f](T &n) {
+            if (n.v >= 0) {
+                f(n);
+            }
+        });
     }
 
   private:
-    struct Table {
-        T *_table[NBUCKETS] = {nullptr};
-    };
+    using Table = Buckets<T, Hash, ValueEqual>;
+
+#ifdef isMT
+    static void reclaim(void *table, void *node) {
+        static_cast<CHashTable *>(table)->returnNode(static_cast<T *>(node));
+    }
+#endif
 
     std::vector<Table> _tables;
+    PerThread<std::vector<LevelStats>> _stats;
 
-    struct Cache {
-        T *available{};
-        std::vector<std::vector<T>> chunks{
-            1, std::vector<T>{INITIAL_ALLOCATION_SIZE}};
-        std::size_t chunkID{0};
-        typename std::vector<T>::iterator chunkIt{chunks[0].begin()};
-        typename std::vector<T>::iterator chunkEndIt{chunks[0].end()};
-        std::size_t allocationSize{INITIAL_ALLOCATION_SIZE * GROWTH_FACTOR};
-        std::size_t allocations = INITIAL_ALLOCATION_SIZE;
+    NodeArena<T> _arena;
+    std::size_t _released{0};
+
+    QubitCount _qn;
+
+};
+
+/*
+ * Interns the real and imaginary parts of edge weights. A part within
+ * Complex::TOLERANCE of a value seen before is replaced by that value, so
+ * weights that only differ by rounding become bit-identical. Node hashing
+ * over the raw doubles then agrees with the tolerant compare, and that
+ * compare is decided by its exact fast path.
+ *
+ * Values live in cells of width TOLERANCE, found by open addressing on the
+ * cell number. A cell holds at most one value, as two values in one cell
+ * are closer than TOLERANCE; a value can still match one in either
+ * neighbouring cell. Stored values are thus more than TOLERANCE apart, and
+ * re-interning them keeps them as they are.
+ *
+ * With isMT a slot is just the atomic bits of its value, claimed by a CAS,
+ * and the cell is recomputed from the value. Two threads may then store
+ * values of neighbouring cells that are within TOLERANCE, which only costs
+ * sharing. The table does not grow under concurrent lookups: a value that
+ * finds it at its load limit is passed through, and reserve() makes room
+ * while the engine is quiescent, see collectWeights().
+ */
+class ComplexTable {
+  public:
+    ComplexTable() { clear(); }
+
+    Complex lookup(const Complex &c) { return {intern(c.r), intern(c.i)}; }
+
+    // forgets every value but the seeded ones, leaving room for `values`
+    void clear(std::size_t values = 0) {
+        std::vector<Slot>(INITIAL_SLOTS).swap(_slots);
+        _count = 0;
+        reserve(values);
+        for (double x : {0.0, 0.5, SQRT2, 1.0}) {
+            intern(x);
+            intern(-x);
+        }
+        _stats.forEach([](LevelStats &s) { s = LevelStats{}; });
+    }
+
+    // makes room for `values` values without growing; not thread-safe
+    void reserve(std::size_t values) {
+        if (2 * values > _slots.size()) {
+            rehash(2 * values);
+        }
+    }
+
+    std::size_t size() const { return _count; }
+
+    LevelStats stats() const {
+        LevelStats s;
+        _stats.forEach([&s](const LevelStats &t) { s += t; });
+        s.live = _count;
+        s.bytes = _slots.size() * sizeof(Slot);
+        return s;
+    }
+
+    void resetStats() {
+        _stats.forEach([](LevelStats &s) {
+            s.lookups = s.hits = s.inserts = 0;
+            s.chain = {};
+        });
+    }
+
+  private:
+#ifdef isMT
+    // grows only in reserve(), so start big enough for WEIGHTS_MIN values
+    static constexpr std::size_t INITIAL_SLOTS = 4 * WEIGHTS_MIN;
+#else
+    static constexpr std::size_t INITIAL_SLOTS = 1 << 12;
+#endif
+    static constexpr std::size_t CELL_RUN = 16;
+    static constexpr std::int64_t EMPTY = INT64_MIN;
+    // weights in normalized nodes have magnitude at most 1
+    static constexpr double MAX_VALUE = 2.0;
+
+#ifdef isMT
+    struct Slot {
+        Slot() : bits(EMPTY_BITS) {}
+        Slot(Slot &&other) noexcept : bits(other.bits.load(std::memory_order_relaxed)) {}
+
+        // a NaN, which intern() never stores
+        static constexpr std::uint64_t EMPTY_BITS = ~std::uint64_t{0};
+        std::atomic<std::uint64_t> bits;
     };
 
-    std::size_t collected;
+    static double valueOf(std::uint64_t bits) {
+        double x;
+        std::memcpy(&x, &bits, sizeof x);
+        return x;
+    }
+
+    static std::uint64_t bitsOf(double x) {
+        std::uint64_t bits;
+        std::memcpy(&bits, &x, sizeof bits);
+        return bits;
+    }
 
-    Cache _cache;
+    std::int64_t cellAt(std::size_t i) const {
+        const std::uint64_t bits = _slots[i].bits.load(std::memory_order_acquire);
+        return bits == Slot::EMPTY_BITS ? EMPTY : cellOf(valueOf(bits));
+    }
 
-    QubitCount _qn;
+    double valueAt(std::size_t i) const {
+        return valueOf(_slots[i].bits.load(std::memory_order_acquire));
+    }
+#else
+    struct Slot {
+        std::int64_t cell{EMPTY};
+        double value{0.0};
+    };
+
+    std::int64_t cellAt(std::size_t i) const { return _slots[i].cell; }
+    double valueAt(std::size_t i) const { return _slots[i].value; }
+#endif
+
+    static std::int64_t cellOf(double x) {
+        return static_cast<std::int64_t>(std::llround(x / Complex::TOLERANCE));
+    }
 
+    double intern(double x) {
+        if (!(std::abs(x) <= MAX_VALUE)) {
+            return x;
+        }
+        LevelStats &stats = _stats.local();
+        stats.lookups++;
+        const double q = x / Complex::TOLERANCE;
+        const auto cell = static_cast<std::int64_t>(std::llround(q));
+        // the neighbour on the side x leans towards is the likelier match
+        const std::int64_t side = q < static_cast<double>(cell) ? -1 : 1;
+        std::size_t compared = 0;
+        for (std::int64_t c : {cell, cell + side, cell - side}) {
+            const std::size_t i = find(c);
+            if (cellAt(i) == EMPTY) {
+                continue;
+            }
+            compared++;
+            const double value = valueAt(i);
+            if (std::abs(value - x) <= Complex::TOLERANCE) {
+                stats.hits++;
+                stats.chain[compared]++;
+                return value;
+            }
+        }
+        stats.chain[compared]++;
+        stats.inserts++;
+        return insert(cell, x);
+    }
+
+    // slot of `cell`, or the empty slot where it would go; runs of
+    // CELL_RUN cells start at one hashed slot, so that the neighbours of a
+    // cell are mostly in the same cache line
+    std::size_t find(std::int64_t cell) const {
+        const std::size_t mask = _slots.size() - 1;
+        const auto c = static_cast<std::size_t>(cell);
+        std::size_t i = (murmur_hash(c / CELL_RUN) + c % CELL_RUN) & mask;
+        for (std::int64_t at = cellAt(i); at != EMPTY && at != cell; at = cellAt(i)) {
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    // the value interned for `x`
+    double insert(std::int64_t cell, double x) {
+#ifdef isMT
+        for (;;) {
+            if (2 * (_count + 1) > _slots.size()) {
+                return x;
+            }
+            const std::size_t i = find(cell);
+            std::uint64_t expected = Slot::EMPTY_BITS;
+            if (_slots[i].bits.compare_exchange_strong(expected, bitsOf(x),
+                                                       std::memory_order_acq_rel)) {
+                _count++;
+                return x;
+            }
+            // another thread took the slot, perhaps for this very cell
+            if (cellOf(valueOf(expected)) == cell) {
+                return valueOf(expected);
+            }
+        }
+#else
+        if (2 * (_count + 1) > _slots.size()) {
+            rehash(2 * _slots.size());
+        }
+        _slots[find(cell)] = {cell, x};
+        _count++;
+        return x;
+#endif
+    }
+
+    void rehash(std::size_t slots) {
+        std::size_t n = _slots.size();
+        while (n < slots) {
+            n *= 2;
+        }
+        std::vector<Slot> old(n);
+        old.swap(_slots);
+        for (std::size_t i = 0; i < old.size(); i++) {
+#ifdef isMT
+            const std::uint64_t bits = old[i].bits.load(std::memory_order_relaxed);
+            if (bits != Slot::EMPTY_BITS) {
+                _slots[find(cellOf(valueOf(bits)))].bits.store(bits, std::memory_order_relaxed);
+            }
+#else
+            if (old[i].cell != EMPTY) {
+                _slots[find(old[i].cell)] = old[i];
+            }
+#endif
+        }
+    }
+
+    std::vector<Slot> _slots;
+#ifdef isMT
+    std::atomic<std::size_t> _count{0};
+#else
+    std::size_t _count{0};
+#endif
+    PerThread<LevelStats> _stats;
 };
 
+extern ComplexTable cUnique;
+
 using mNodeTable = CHashTable<mNode>;
 extern mNodeTable mUnique;
 
@@ -7,6 +7,9 @@
 #include <boost/fiber/mutex.hpp>
 #include <boost/fiber/condition_variable.hpp>
 #include <boost/fiber/algo/algorithm.hpp>
+#include <boost/fiber/algo/round_robin.hpp>
+#include <boost/fiber/detail/thread_barrier.hpp>
+#include <boost/fiber/scheduler.hpp>
 #include "wsq.hpp"
 #include <thread>
 #include <atomic>
@@ -16,46 +19,64 @@
 #include "cache.hpp"
 
 
-#ifdef CACHE
-extern oneapi::tbb::enumerable_thread_specific<AddCache> _aCache;
-extern oneapi::tbb::enumerable_thread_specific<MulCache> _mCache;
-#endif
-#ifdef CACHE_GLOBAL
-extern AddCache _aCache_global;
-extern MulCache _mCache_global;
-#endif
-
 struct Scheduler;
 
+// ready queue of every my_ws: boost's spinlocked ring buffer or the
+// lock-free Chase-Lev deque of wsq.hpp
+enum class ReadyQueue { Spinlock, ChaseLev };
+
 namespace boost{
 namespace fibers{
 namespace algo{
 
+class my_ws;
+
+// the my_ws of all threads of one Scheduler, which steal from each other
+struct StealPool {
+    explicit StealPool(std::uint32_t threads) : schedulers(threads), barrier(threads) {}
+
+    std::vector< intrusive_ptr< my_ws > >                   schedulers;
+    std::atomic< std::uint32_t >                            counter{ 0 };
+    detail::thread_barrier                                  barrier;
+};
+
 class my_ws : public algorithm {
 private:
-    static std::atomic< std::uint32_t >                     counter_;
-    static std::vector< intrusive_ptr< my_ws > >    schedulers_;
-
+    StealPool                                             & pool_;
     std::uint32_t                                           id_;
-    std::uint32_t                                           thread_count_;
-    
+    int                                                     node_;
+    // victims on the NUMA node of this thread, then those on others
+    std::vector< std::uint32_t >                            near_{};
+    std::vector< std::uint32_t >                            far_{};
+    ReadyQueue                                              kind_;
+
 #ifdef BOOST_FIBERS_USE_SPMC_QUEUE
     detail::context_spmc_queue                              rqueue_{};
 #else
     detail::context_spinlock_queue                          rqueue_{};
 #endif
+    // with ReadyQueue::ChaseLev; pinned contexts cannot migrate, so they
+    // wait in pqueue_ where nobody steals them
+    WorkStealingQueue<context*>                             wqueue_{ 1024 };
+    scheduler::ready_queue_type                             pqueue_{};
 
-//    WorkStealingQueue<context*>                             rqueue_{2048};
     std::mutex                                              mtx_{};
     std::condition_variable                                 cnd_{};
     bool                                                    flag_{ false };
     bool                                                    suspend_;
+    // rounds without a fiber to run, see suspend_until()
+    std::uint32_t                                           idle_{ 0 };
+    static constexpr std::uint32_t                          SPIN_ROUNDS = 64;
 
-    static void init_( std::uint32_t, std::vector< intrusive_ptr< my_ws > > &);
+    // counted by this thread as the thief
+    std::atomic< std::uint64_t >                            attempts_{ 0 };
+    std::atomic< std::uint64_t >                            steals_{ 0 };
+
+    context * steal_from( std::vector< std::uint32_t > const&) noexcept;
 
 public:
 
-    my_ws( std::uint32_t, bool = false);
+    my_ws( StealPool &, ReadyQueue, bool = false);
 
     my_ws( my_ws const&) = delete;
     my_ws( my_ws &&) = delete;
@@ -68,27 +89,37 @@ public:
     context * pick_next() noexcept override;
 
     virtual context * steal() noexcept {
-        /*
-        auto ctx_opt = rqueue_.steal();
-        if(ctx_opt){
-            return *ctx_opt;
-        }else{
-            return nullptr;
+        if ( ReadyQueue::ChaseLev == kind_) {
+            std::optional< context * > ctx = wqueue_.steal();
+            return ctx ? * ctx : nullptr;
         }
-        */
         return rqueue_.steal();
     }
 
     bool has_ready_fibers() const noexcept override {
+        if ( ReadyQueue::ChaseLev == kind_) {
+            return ! wqueue_.empty() || ! pqueue_.empty();
+        }
         return ! rqueue_.empty();
     }
 
     void suspend_until( std::chrono::steady_clock::time_point const&) noexcept override;
 
     void notify() noexcept override;
+
+    std::uint64_t steal_attempts() const noexcept { return attempts_.load( std::memory_order_relaxed); }
+    std::uint64_t steals() const noexcept { return steals_.load( std::memory_order_relaxed); }
 };
 }}}
 
+// steal attempts and successes of all threads of a Scheduler, and the time
+// they spent looking for a victim (steal_timer)
+struct StealStats {
+    std::uint64_t attempts{0};
+    std::uint64_t steals{0};
+    duration_micro time{0};
+};
+
 struct WorkerThread{
     int _id;
     Scheduler* _sched; 
@@ -99,27 +130,34 @@ class Scheduler{
     friend struct WorkerThread;
     
 public:
-    Scheduler(int n, int gcfreq);
+    Scheduler(int n, int gcfreq, ReadyQueue queue = ReadyQueue::ChaseLev);
     ~Scheduler();
 
     void addGate(const mEdge& e);
-    vEdge buildCircuit(vEdge v);
+    // Applies the added gates to v, fused first, collecting concurrently
+    // with v, the gates, keep and keepGates as roots. Any other DD the
+    // caller holds is invalid afterwards. The last collection, weights
+    // included, is done when it returns.
+    vEdge buildCircuit(vEdge v, const std::vector<vEdge> &keep = {},
+                       const std::vector<mEdge> &keepGates = {});
     mEdge buildUnitary(const std::vector<mEdge>& g);
+    StealStats stealStats() const;
 private:
     void spawn();
-    void clearCache();
 
     const int _nworkers;
+    // gates between checks of the live nodes in buildCircuit
     const int _gcfreq;
+    const ReadyQueue _queue;
+    boost::fibers::algo::StealPool _pool;
 
     std::vector<WorkerThread> _workers;
     std::vector<mEdge> _gates;
 
     boost::fibers::condition_variable_any cond_stop;
     boost::fibers::mutex mtx_stop;
+    bool _stop{false};
 };
 
 
 
-void makeUniqueForV(vEdge& root, CHashTable<vNode>& v);
-
@@ -47,6 +47,13 @@ std::pair<vEdge, char> _measureOneCollapsing(vEdge &rootEdge, const Qubit index)
 
 
 
+std::pair<vEdge, std::string> _measureCollapsing(vEdge &rootEdge, const std::vector<Qubit> &qubits){
+    std::string result = measureCollapsing(rootEdge, qubits, mt);
+    return std::pair<vEdge, std::string>(rootEdge, result);
+}
+
+
+
 std::vector<std::complex<double>> _getVector(vEdge &rootEdge){
     size_t dim;
     std_complex *vec = rootEdge.getVector(&dim);
@@ -71,12 +78,70 @@ mEdge makeControlGate(QubitCount q, std::string name, Qubit target, const std::v
     return makeGate(q, name, target, c);
 }
 
+vEdge applyGate(const vEdge &state, std::string name, Qubit target){
+    return applyGate(state, gateMap[name], target);
+}
+vEdge applyControlGate(const vEdge &state, std::string name, Qubit target, const std::vector<Qubit> controls){
+    return applyGate(state, gateMap[name], target, get_controls(controls));
+}
+
+CircuitOp gateOp(std::string name, Qubit target, const std::vector<Qubit> controls){
+    return CircuitOp::gate(gateMap[name], target, get_controls(controls));
+}
+
 PYBIND11_MODULE(pyQDD, m){
+    py::class_<LevelStats>(m, "LevelStats")
+        .def_readonly("lookups", &LevelStats::lookups)
+        .def_readonly("hits", &LevelStats::hits)
+        .def_readonly("inserts", &LevelStats::inserts)
+        .def_readonly("evictions", &LevelStats::evictions)
+        .def_readonly("live", &LevelStats::live)
+        .def_readonly("bytes", &LevelStats::bytes)
+        .def_readonly("chain", &LevelStats::chain);
+    py::class_<TableStats>(m, "TableStats")
+        .def_readonly("levels", &TableStats::levels)
+        .def_readonly("bytes", &TableStats::bytes);
+    py::class_<EngineStats>(m, "EngineStats")
+        .def_readonly("vUnique", &EngineStats::vUnique)
+        .def_readonly("mUnique", &EngineStats::mUnique)
+        .def_readonly("addCache", &EngineStats::addCache)
+        .def_readonly("mulCache", &EngineStats::mulCache)
+        .def_readonly("cUnique", &EngineStats::cUnique);
+#ifdef isMT
+    py::enum_<CacheTiers>(m, "CacheTiers")
+        .value("Local", CacheTiers::Local)
+        .value("Shared", CacheTiers::Shared)
+        .value("Both", CacheTiers::Both);
+#endif
+    py::class_<EngineConfig>(m, "EngineConfig")
+        .def(py::init<>())
+        .def_readwrite("qubits", &EngineConfig::qubits)
+        .def_readwrite("cacheBuckets", &EngineConfig::cacheBuckets)
+        .def_readwrite("cacheChunk", &EngineConfig::cacheChunk)
+        .def_readwrite("growthFactor", &EngineConfig::growthFactor)
+        .def_readwrite("gcNodes", &EngineConfig::gcNodes)
+        .def_readwrite("nodeMemory", &EngineConfig::nodeMemory)
+        .def_readwrite("hugePages", &EngineConfig::hugePages)
+        .def_readwrite("internWeights", &EngineConfig::internWeights)
+        .def_readwrite("fusionSpan", &EngineConfig::fusionSpan)
+        .def_readwrite("fusionNodes", &EngineConfig::fusionNodes)
+#ifdef isMT
+        .def_readwrite("cacheTiers", &EngineConfig::cacheTiers)
+        .def_readwrite("sharedCacheBuckets", &EngineConfig::sharedCacheBuckets)
+        .def_readwrite("forkLevel", &EngineConfig::forkLevel)
+#endif
+        .def_static("forCircuit", &EngineConfig::forCircuit);
     py::class_<vEdge>(m, "vEdge").def("printVector",&vEdge::printVector).def("printVector_sparse",&vEdge::printVector_sparse);
     py::class_<mEdge>(m, "mEdge").def("printMatrix",&mEdge::printMatrix).def("getEigenMatrix", &mEdge::getEigenMatrix);
     m.def("makeZeroState", makeZeroState);
     m.def("mv_multiply", mv_multiply).def("mm_multiply", mm_multiply);
-    m.def("get_nNodes", get_nNodes).def("gc", gc);
+    m.def("fuseGates", fuseGates);
+    m.def("get_nNodes", py::overload_cast<vEdge>(&get_nNodes))
+     .def("get_nNodes", py::overload_cast<mEdge>(&get_nNodes))
+     .def("gc", py::overload_cast<vEdge>(&gc))
+     .def("gc", py::overload_cast<vEdge, const std::vector<mEdge> &>(&gc));
+    m.def("getStats", getStats).def("resetStats", resetStats);
+    m.def("configure", configure).def("getConfig", getConfig, py::return_value_policy::copy);
 
     // Gates
     m.def("makeGate", py::overload_cast<QubitCount, GateMatrix, Qubit>(&makeGate))
@@ -84,11 +149,36 @@ PYBIND11_MODULE(pyQDD, m){
      .def("makeGate", py::overload_cast<QubitCount, std::string, Qubit>(&makeGate))
      .def("makeGate", py::overload_cast<QubitCount, std::string, Qubit, const Controls &>(&makeGate))
      .def("makeControlGate", makeControlGate);
+    m.def("applyGate", py::overload_cast<const vEdge &, const GateMatrix &, Qubit, const Controls &>(&applyGate),
+          py::arg("state"), py::arg("g"), py::arg("target"), py::arg("c") = Controls{})
+     .def("applyGate", py::overload_cast<const vEdge &, std::string, Qubit>(&applyGate))
+     .def("applyControlGate", applyControlGate);
     m.def("RX", RX).def("RY", RY).def("RZ", RZ).def("CX", CX).def("SWAP", makeSwap);
     m.def("rxmat", rx).def("rymat", ry).def("rzmat", rz).def("u1", u1).def("u2", u2).def("u3", u3).def("u", u).def("p", p).def("r", r);
 
     // Measure
     m.def("measureAll", _measureAll)
-     .def("measureOneCollapsing", _measureOneCollapsing);
+     .def("measureOneCollapsing", _measureOneCollapsing)
+     .def("measureCollapsing", _measureCollapsing)
+     .def("collapse", collapse)
+     .def("sampleShots", sampleShots)
+     .def("marginalProbabilities", marginalProbabilities);
+
+    // Expectation values
+    m.def("innerProduct", innerProduct)
+     .def("expectation", py::overload_cast<const vEdge &, const std::string &>(&expectation))
+     .def("expectation", py::overload_cast<const vEdge &, const mEdge &>(&expectation));
+
+    // Circuits with mid-circuit measurements
+    py::class_<CircuitOp>(m, "CircuitOp")
+        .def_static("gate", py::overload_cast<const GateMatrix &, Qubit, const Controls &>(&CircuitOp::gate),
+                    py::arg("g"), py::arg("target"), py::arg("c") = Controls{})
+        .def_static("gate", py::overload_cast<const mEdge &>(&CircuitOp::gate))
+        .def_static("gate", gateOp, py::arg("name"), py::arg("target"),
+                    py::arg("controls") = std::vector<Qubit>{})
+        .def_static("measure", &CircuitOp::measure)
+        .def_static("reset", &CircuitOp::reset)
+        .def_readwrite("condition", &CircuitOp::condition);
+    m.def("simulateBranching", simulateBranching);
     m.def("getVector", _getVector);
 }
\ No newline at end of file
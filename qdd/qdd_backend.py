@@ -1,6 +1,7 @@
 from typing import Any, Dict, List, Optional, Tuple, Union
 import traceback
 import os
+import random
 import sys
 import uuid
 import dataclasses
@@ -85,7 +86,7 @@ class QddBackend(BackendV1):
     _DEFAULT_CONFIG: Dict[str, Any] = {
         'backend_name': 'qasm_simulator',
         'backend_version': __version__,
-        'n_qubits': 100,  # inclusive
+        'n_qubits': 1024,  # inclusive; the engine is sized per circuit, see 'memory_budget'
         'basis_gates': sorted([
             'x', 'y', 'z', 'h', 's', 'sdg', 't', 'tdg',
             'id', 'sx', 'sxdg',
@@ -113,6 +114,9 @@ class QddBackend(BackendV1):
 
     _DEFAULT_SHOTS = 1024
 
+    # bytes the unique tables and compute caches of one circuit may take
+    _DEFAULT_MEMORY_BUDGET = 4 << 30
+
     # If user specify runtime options that are not included in the default option list, the runtime options are ignored
     # and ignorance warnings will be emitted.
     # This dict is used for suppressing the ignorance warnings.
@@ -142,6 +146,7 @@ class QddBackend(BackendV1):
             shots=QddBackend._DEFAULT_SHOTS,
             memory=False,
             seed_simulator=None,
+            memory_budget=QddBackend._DEFAULT_MEMORY_BUDGET,
         )
     
     @staticmethod
@@ -229,6 +234,7 @@ class QddBackend(BackendV1):
             'shots': run_options.get('shots', self.options.shots),
             'memory': run_options.get('memory', self.options.memory),
             'seed_simulator': run_options.get('seed_simulator', self.options.seed_simulator),
+            'memory_budget': run_options.get('memory_budget', self.options.memory_budget),
         }
 
         if ('parameter_binds' in run_options) and (run_options['parameter_binds'] is not None):
@@ -298,9 +304,10 @@ class QddBackend(BackendV1):
         self._create_qubitmap(circ)
         self._create_cbitmap(circ)
         sampled_values = [None] * options['shots']
+        pyQDD.configure(pyQDD.EngineConfig.forCircuit(n_qubit, options['memory_budget']))
         print(len(circ.data), " gates")
         if circ_prop.stable_final_state:
-            current = pyQDD.makeZeroState(n_qubit)
+            gates = []
             for i, qargs, cargs in circ.data:
                 qiskit_gate_type = type(i)
 
@@ -314,7 +321,7 @@ class QddBackend(BackendV1):
                 if qiskit_gate_type in _supported_qiskit_gates:
                     if qiskit_gate_type in _qiskit_gates_1q:
                         gate = pyQDD.makeGate(n_qubit, _qiskit_gates_1q[qiskit_gate_type], self.get_qID(qargs[0]))
-                        current = pyQDD.mv_multiply(gate, current)
+                        gates.append(gate)
                     elif qiskit_gate_type in _qiskit_rotations_1q:
                         if qiskit_gate_type == qiskit_gates.U3Gate or qiskit_gate_type == qiskit_gates.UGate:
                             matrix = _qiskit_rotations_1q[qiskit_gate_type](i.params[0],i.params[1],i.params[2])
@@ -323,16 +330,16 @@ class QddBackend(BackendV1):
                         else:
                             matrix = _qiskit_rotations_1q[qiskit_gate_type](i.params[0])
                         gate = pyQDD.makeGate(n_qubit, matrix, self.get_qID(qargs[0]))
-                        current = pyQDD.mv_multiply(gate, current)
+                        gates.append(gate)
                     elif qiskit_gate_type in _qiskit_gates_2q:
                         gate = _qiskit_gates_2q[qiskit_gate_type](n_qubit, self.get_qID(qargs[1]), self.get_qID(qargs[0]))
-                        current = pyQDD.mv_multiply(gate, current)
+                        gates.append(gate)
                     elif qiskit_gate_type in _qiskit_1q_control:
                         controls = []
                         for idx in range(len(qargs)-1):
                             controls.append(self.get_qID(qargs[idx]))
                         gate = pyQDD.makeControlGate(n_qubit, _qiskit_1q_control[qiskit_gate_type], self.get_qID(qargs[-1]), controls)
-                        current = pyQDD.mv_multiply(gate, current)
+                        gates.append(gate)
                     else:
                         raise RuntimeError(f'Unsupported gate or instruction:'
                                        f' type={qiskit_gate_type.__name__}, name={i.name}.'
@@ -344,81 +351,90 @@ class QddBackend(BackendV1):
                     raise RuntimeError(f'Unsupported gate or instruction:'
                                        f' type={qiskit_gate_type.__name__}, name={i.name}.'
                                        f' It needs to transpile the circuit before evaluating it.')
-                current = pyQDD.gc(current);
-            
-            for i in range(options['shots']):
-                _, result_tmp = pyQDD.measureAll(current, False)
+
+            # runs of gates are applied as one, see fuseGates() in dd.h;
+            # gc(current, gates) keeps the fused gates and sweeps mUnique of
+            # the products fusion has dropped
+            gates = pyQDD.fuseGates(gates)
+            current = pyQDD.makeZeroState(n_qubit)
+            for gate in gates:
+                current = pyQDD.mv_multiply(gate, current)
+                current = pyQDD.gc(current, gates)
+
+            # all shots are drawn at once, see sampleShots() in dd.h
+            seed = options['seed_simulator']
+            if seed is None:
+                seed = random.getrandbits(64)
+            sampled_counts = Counter()
+            mapping: Dict[Clbit, Qubit] = circ_prop.clbit_final_values
+            for result_tmp, count in pyQDD.sampleShots(current, options['shots'], seed).items():
                 result_final_tmp = ['0'] * n_cbit
-                mapping: Dict[Clbit, Qubit] = circ_prop.clbit_final_values
                 for cbit in mapping:
-                    result_final_tmp[self.get_cID(cbit)] = result_tmp[len(result_tmp)-1-self.get_qID(mapping[cbit])]                
-                sampled_values[i] = ''.join(reversed(result_final_tmp))
+                    result_final_tmp[self.get_cID(cbit)] = result_tmp[len(result_tmp)-1-self.get_qID(mapping[cbit])]
+                sampled_counts[''.join(reversed(result_final_tmp))] += count
+            if options['memory']:
+                sampled_values = list(sampled_counts.elements())
+                random.Random(seed).shuffle(sampled_values)
 
         else:
-            for shot in range(options['shots']):
-                current = pyQDD.makeZeroState(n_qubit)
-                val_cbit = ['0'] * n_cbit
-                for i, qargs, cargs in circ.data:
-                    qiskit_gate_type = type(i)
-
-                    # filter out special cases first
-                    if qiskit_gate_type == Barrier:
-                        continue
+            # the circuit is run once per branch of its measurements, see
+            # simulateBranching() in dd.h
+            ops = []
+            for i, qargs, cargs in circ.data:
+                qiskit_gate_type = type(i)
+
+                # filter out special cases first
+                if qiskit_gate_type == Barrier:
+                    continue
 
-                    if qiskit_gate_type in _supported_qiskit_gates:
-                        
-                        skipGate = False
-                        for c_idx in cargs:
-                            if val_cbit[self.get_cID(c_idx)] == '0':
-                                skipGate = True
-                                break
-                        if skipGate:
-                            continue
-
-                        if qiskit_gate_type in _qiskit_gates_1q:
-                            gate = pyQDD.makeGate(n_qubit, _qiskit_gates_1q[qiskit_gate_type], self.get_qID(qargs[0]))
-                            current = pyQDD.mv_multiply(gate, current)
-                        elif qiskit_gate_type in _qiskit_rotations_1q:
-                            if qiskit_gate_type == qiskit_gates.U3Gate or qiskit_gate_type == qiskit_gates.UGate:
-                                matrix = _qiskit_rotations_1q[qiskit_gate_type](i.params[0],i.params[1],i.params[2])
-                            elif qiskit_gate_type == qiskit_gates.U2Gate or qiskit_gate_type == qiskit_gates.RGate:
-                                matrix = _qiskit_rotations_1q[qiskit_gate_type](i.params[0],i.params[1])
-                            else:
-                                matrix = _qiskit_rotations_1q[qiskit_gate_type](i.params[0])
-                            gate = pyQDD.makeGate(n_qubit, matrix, self.get_qID(qargs[0]))
-                            current = pyQDD.mv_multiply(gate, current)
-                        elif qiskit_gate_type in _qiskit_gates_2q:
-                            gate = _qiskit_gates_2q[qiskit_gate_type](n_qubit, self.get_qID(qargs[1]), self.get_qID(qargs[0]))# target, control
-                            current = pyQDD.mv_multiply(gate, current)
-                        elif qiskit_gate_type in _qiskit_1q_control:
-                            controls = []
-                            for idx in range(len(qargs)-1):
-                                controls.append(self.get_qID(qargs[idx]))
-                            gate = pyQDD.makeControlGate(n_qubit, _qiskit_1q_control[qiskit_gate_type], self.get_qID(qargs[-1]), controls)
-                            current = pyQDD.mv_multiply(gate, current)
+                if qiskit_gate_type in _supported_qiskit_gates:
+                    if qiskit_gate_type in _qiskit_gates_1q:
+                        op = pyQDD.CircuitOp.gate(_qiskit_gates_1q[qiskit_gate_type], self.get_qID(qargs[0]))
+                    elif qiskit_gate_type in _qiskit_rotations_1q:
+                        if qiskit_gate_type == qiskit_gates.U3Gate or qiskit_gate_type == qiskit_gates.UGate:
+                            matrix = _qiskit_rotations_1q[qiskit_gate_type](i.params[0],i.params[1],i.params[2])
+                        elif qiskit_gate_type == qiskit_gates.U2Gate or qiskit_gate_type == qiskit_gates.RGate:
+                            matrix = _qiskit_rotations_1q[qiskit_gate_type](i.params[0],i.params[1])
                         else:
-                            raise NotImplementedError
+                            matrix = _qiskit_rotations_1q[qiskit_gate_type](i.params[0])
+                        op = pyQDD.CircuitOp.gate(matrix, self.get_qID(qargs[0]))
+                    elif qiskit_gate_type in _qiskit_gates_2q:
+                        gate = _qiskit_gates_2q[qiskit_gate_type](n_qubit, self.get_qID(qargs[1]), self.get_qID(qargs[0]))# target, control
+                        op = pyQDD.CircuitOp.gate(gate)
+                    elif qiskit_gate_type in _qiskit_1q_control:
+                        controls = []
+                        for idx in range(len(qargs)-1):
+                            controls.append(self.get_qID(qargs[idx]))
+                        op = pyQDD.CircuitOp.gate(_qiskit_1q_control[qiskit_gate_type], self.get_qID(qargs[-1]), controls)
                     else:
-                        if qiskit_gate_type == Measure:
-                            current, val_cbit[self.get_cID(cargs[0])] = pyQDD.measureOneCollapsing(current, self.get_qID(qargs[0]))
-                        elif qiskit_gate_type == Reset:
-                            current,_meas_result = pyQDD.measureOneCollapsing(current, self.get_qID(qargs[0]))
-                            if _meas_result == '1':
-                                gate = pyQDD.makeGate(n_qubit, "X", self.get_qID(qargs[0]))
-                                current = pyQDD.mv_multiply(gate, current)
-                        else:
-                            # We assume the given Qiskit circuit has already been transpiled into a circuit of basis gates only.
-                            raise RuntimeError(f'Unsupported gate or instruction:'
-                                       f' type={qiskit_gate_type.__name__}, name={i.name}.'
-                                       f' It needs to transpile the circuit before evaluating it.')
-                    current = pyQDD.gc(current);
-                sampled_values[shot] = ''.join(reversed(val_cbit))
-
-        hex_sampled_counts = Counter(sampled_values)
-        result_data: Dict[str, Any] = {'counts': hex_sampled_counts}
+                        raise NotImplementedError
+                    # the gate is skipped on branches where any of its classical bits is 0
+                    op.condition = [self.get_cID(c_idx) for c_idx in cargs]
+                elif qiskit_gate_type == Measure:
+                    op = pyQDD.CircuitOp.measure(self.get_qID(qargs[0]), self.get_cID(cargs[0]))
+                elif qiskit_gate_type == Reset:
+                    op = pyQDD.CircuitOp.reset(self.get_qID(qargs[0]))
+                else:
+                    # We assume the given Qiskit circuit has already been transpiled into a circuit of basis gates only.
+                    raise RuntimeError(f'Unsupported gate or instruction:'
+                                   f' type={qiskit_gate_type.__name__}, name={i.name}.'
+                                   f' It needs to transpile the circuit before evaluating it.')
+                ops.append(op)
+
+            seed = options['seed_simulator']
+            if seed is None:
+                seed = random.getrandbits(64)
+            sampled_counts = Counter(pyQDD.simulateBranching(n_qubit, n_cbit, ops, options['shots'], seed))
+            if options['memory']:
+                sampled_values = list(sampled_counts.elements())
+                random.Random(seed).shuffle(sampled_values)
+            # the branches end in different states, none of which is the final one
+            current = None
+
+        result_data: Dict[str, Any] = {'counts': sampled_counts}
         if options['memory']:
             result_data['memory'] = sampled_values
-        if self._save_SV:
+        if self._save_SV and current is not None:
             result_data["statevector"] = pyQDD.getVector(current)
         header = QddBackend._create_experiment_header(circ)
         result = {
@@ -430,7 +446,8 @@ class QddBackend(BackendV1):
             'header': header,
         }
 
-        print("nQubit", n_qubit, "nGates", len(circ.data), "nNodes", pyQDD.get_nNodes(current))
+        if current is not None:
+            print("nQubit", n_qubit, "nGates", len(circ.data), "nNodes", pyQDD.get_nNodes(current))
         return result
 
     
@@ -30,7 +30,7 @@ static mEdge groverIteration(Scheduler &s, const std::string &oracle,
 
     // prepare oracle
     Controls controls;
-    for (auto i = 0; i < n_qubits; i++) {
+    for (Qubit i = 0; i < Qubit(n_qubits); i++) {
         controls.emplace(Control{i, oracle.at(i) == '1' ? Control::Type::pos
                                                         : Control::Type::neg});
     }
@@ -46,11 +46,11 @@ static mEdge groverIteration(Scheduler &s, const std::string &oracle,
     mEdge d = makeIdent(n_qubits);
     g.push_back(d);
     // 1. H to data qubits
-    for (auto i = 0; i < n_qubits; i++) {
+    for (Qubit i = 0; i < Qubit(n_qubits); i++) {
         g.emplace_back(makeGate(total_qubits, Hmat, i));
     }
     // 2. X to data qubits
-    for (auto i = 0; i < n_qubits; i++) {
+    for (Qubit i = 0; i < Qubit(n_qubits); i++) {
         g.emplace_back(makeGate(total_qubits, Xmat, i));
     }
 
@@ -59,7 +59,7 @@ static mEdge groverIteration(Scheduler &s, const std::string &oracle,
 
     // 4. CX to the last data qubit
     Controls diff_controls;
-    for (auto i = 0; i < n_qubits - 1; i++) {
+    for (Qubit i = 0; i < Qubit(n_qubits) - 1; i++) {
         diff_controls.emplace(Control{i, Control::Type::pos});
     }
     g.emplace_back(makeGate(total_qubits, Xmat, n_qubits - 1, diff_controls));
@@ -68,13 +68,13 @@ static mEdge groverIteration(Scheduler &s, const std::string &oracle,
     g.emplace_back(makeGate(total_qubits, Hmat, n_qubits - 1));
 
     // 6. X to data qubits
-    for (auto i = 0; i < n_qubits; i++) {
+    for (Qubit i = 0; i < Qubit(n_qubits); i++) {
         g.emplace_back(makeGate(total_qubits, Xmat, i));
     }
 
     // 7. H to all qubits
 
-    for (auto i = 0; i < n_qubits; i++) {
+    for (Qubit i = 0; i < Qubit(n_qubits); i++) {
         g.emplace_back(makeGate(total_qubits, Hmat, i));
     }
 
@@ -102,7 +102,7 @@ vEdge grover(Scheduler &s, QubitCount n_qubits) {
     // Generate random oracle
     std::uniform_int_distribution<int> dist(0, 1); // range is inclusive
     std::string oracle = std::string(n_qubits, '0');
-    for (Qubit i = 0; i < n_qubits; i++) {
+    for (QubitCount i = 0; i < n_qubits; i++) {
         if (dist(mt) == 1) {
             oracle[i] = '1';
         }
@@ -120,7 +120,7 @@ vEdge grover(Scheduler &s, QubitCount n_qubits) {
     std::vector<mEdge> setup_gates;
     setup_gates.emplace_back(makeGate(total_qubits, Xmat, n_qubits));
     // apply H to all qubits
-    for (auto i = 0; i < n_qubits; i++) {
+    for (Qubit i = 0; i < Qubit(n_qubits); i++) {
         setup_gates.emplace_back(makeGate(total_qubits, Hmat, i));
     }
     mEdge setup = s.buildUnitary(setup_gates);
@@ -135,7 +135,6 @@ vEdge grover(Scheduler &s, QubitCount n_qubits) {
         s.addGate(full_iteration);
         j_pre++;
     }
-    int i = 0;
     for (unsigned long long j = j_pre; j < iterations; j += 8) {
         // std::cout<<"ite: "<<j_pre<<std::endl;
         s.addGate(full_iteration);
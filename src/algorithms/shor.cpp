@@ -229,8 +229,6 @@ void Shor::run() {
     for (unsigned int i = 0; i < 2 * required_bits; i++) {
         s.addGate(makeGate(n_qubits, Hmat, (n_qubits - 1) - i));
     }
-    const int mod =
-        std::ceil(2 * required_bits / 6.0); // log_0.9(0.5) is about 6
     for (unsigned int i = 0; i < 2 * required_bits; i++) {
         u_a(as[i], n, 0);
     }
@@ -251,7 +249,7 @@ void Shor::run() {
 
         s.addGate(makeGate(n_qubits, Hmat, n_qubits - 1 - i));
     }
-    vEdge result = s.buildCircuit(makeZeroState(n_qubits));
+    s.buildCircuit(makeZeroState(n_qubits));
 
     auto t2 = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double, std::micro> ms = t2 - t1;
@@ -4,10 +4,19 @@
 #include "table.hpp"
 #include <algorithm>
 #include <bitset>
+#include <limits>
 #include <map>
+#include <memory>
+#include <numeric>
+#include <optional>
 #include <queue>
 #include <unordered_set>
 
+#ifdef isMT
+  #include <boost/fiber/fiber.hpp>
+  #include "fiber_stack.hpp"
+#endif
+
 #ifdef isMPI
   #include <boost/mpi/communicator.hpp>
   #include <boost/mpi/environment.hpp>
@@ -17,8 +26,11 @@
 
 #define SUBTASK_THRESHOLD 5
 
-mNodeTable mUnique(NQUBITS);
-vNodeTable vUnique(NQUBITS);
+static EngineConfig config;
+static SlabBudget nodeBudget;
+ComplexTable cUnique;
+mNodeTable mUnique(NQUBITS, &nodeBudget);
+vNodeTable vUnique(NQUBITS, &nodeBudget);
 
 std::vector<mEdge> identityTable(NQUBITS);
 
@@ -30,12 +42,22 @@ mEdge mEdge::zero{.w = {0.0, 0.0}, .n = mNode::terminal};
 vEdge vEdge::one{.w = {1.0, 0.0}, .n = vNode::terminal};
 vEdge vEdge::zero{.w = {0.0, 0.0}, .n = vNode::terminal};
 
+#ifdef isMT
+TieredAddCache _aCache(NQUBITS);
+TieredMulCache _mCache(NQUBITS);
+#else
 AddCache _aCache(NQUBITS);
 MulCache _mCache(NQUBITS);
+#endif
+
+std::uint16_t gcEpoch = 0;
 
-static int LIMIT = 10000;
 const int MINUS = 3;
 
+static std_complex internWeight(const std_complex &w) {
+    return config.internWeights ? cUnique.lookup(w) : w;
+}
+
 static mEdge normalizeM(const mEdge &e) {
 
     // check for all zero weights
@@ -51,8 +73,6 @@ static mEdge normalizeM(const mEdge &e) {
                                    });
 
     std_complex max_weight = result->w;
-    const std::size_t idx = std::distance(e.n->children.begin(), result);
-
 
     // parents weight
     std_complex new_weight = max_weight * e.w;
@@ -71,7 +91,7 @@ static mEdge normalizeM(const mEdge &e) {
             if(r.isApproximatelyOne()){
                 r = {1.0, 0.0};
             }
-            e.n->children[i].w = r;
+            e.n->children[i].w = internWeight(r);
         }
     }
 
@@ -115,6 +135,8 @@ static vEdge normalizeV(const vEdge &e) {
         e.n->children[min_idx].w = {1.0, 0.0};
     }else if(e.n->children[min_idx].w.isApproximatelyZero()){
         e.n->children[min_idx] = vEdge::zero;
+    }else{
+        e.n->children[min_idx].w = internWeight(e.n->children[min_idx].w);
     }
 
     // making new node
@@ -244,8 +266,8 @@ MatrixXcf mEdge::getEigenMatrix(){
     MatrixGuard g(m, dim);
     MatrixXcf M(dim,dim);
 
-    for(auto i = 0; i < dim; i++){
-        for(auto j = 0; j < dim; j++ ){
+    for(std::size_t i = 0; i < dim; i++){
+        for(std::size_t j = 0; j < dim; j++ ){
            M(i,j) = std::complex<double>{m[i][j].r, m[i][j].i}; 
         }
     }
@@ -273,7 +295,7 @@ mEdge makeIdent(Qubit q) {
 
 vEdge makeZeroState(QubitCount q) {
     vEdge e = makeVEdge(0, {vEdge::one, vEdge::zero});
-    for (Qubit i = 1; i < q; i++) {
+    for (QubitCount i = 1; i < q; i++) {
         e = makeVEdge(i, {{e, vEdge::zero}});
     }
     return e;
@@ -293,7 +315,7 @@ vEdge makeZeroStateMPI(QubitCount q, bmpi::communicator &world) {
 
 vEdge makeOneState(QubitCount q) {
     vEdge e = makeVEdge(0, {vEdge::zero, vEdge::one});
-    for (Qubit i = 1; i < q; i++) {
+    for (QubitCount i = 1; i < q; i++) {
         e = makeVEdge(i, {{vEdge::zero, e}});
     }
     return e;
@@ -352,7 +374,7 @@ mEdge makeGate(QubitCount q, GateMatrix g, Qubit target, const Controls &c) {
 
     auto e = makeMEdge(z, edges);
 
-    for (z = z + 1; z < q; z++) {
+    for (z = z + 1; z < Qubit(q); z++) {
         if (it != c.end() && it->qubit == z) {
             if (it->type == Control::Type::neg)
                 e = makeMEdge(z,
@@ -685,6 +707,26 @@ mEdge mm_add(const mEdge &lhs, const mEdge &rhs) {
     return mm_add2(lhs, rhs, root);
 }
 
+#ifdef isMT
+/*
+ * Calls f(0) .. f(N - 1), all but the last on fibers of their own that an
+ * idle worker of the running Scheduler may steal, and waits for them. f
+ * recurses through the levels below level, so the fibers get stacks sized
+ * to that depth rather than boost's fixed default, with a guard page.
+ */
+template <std::size_t N, typename F> static void forkJoin(F &f, Qubit level) {
+    std::array<boost::fibers::fiber, N - 1> forks;
+    for (std::size_t j = 0; j < N - 1; j++) {
+        forks[j] = boost::fibers::fiber(boost::fibers::launch::post, std::allocator_arg,
+                                        ReusedStack(fiberStackSize(level)), std::ref(f), j);
+    }
+    f(N - 1);
+    for (boost::fibers::fiber &t : forks) {
+        t.join();
+    }
+}
+#endif
+
 mEdge mm_multiply2(const mEdge &lhs, const mEdge &rhs, int32_t current_var) {
 
     if (lhs.w.isApproximatelyZero() || rhs.w.isApproximatelyZero()) {
@@ -722,14 +764,12 @@ mEdge mm_multiply2(const mEdge &lhs, const mEdge &rhs, int32_t current_var) {
     lcopy.w = {1.0, 0.0};
     rcopy.w = {1.0, 0.0};
 
-    std::array<mEdge, 4> edges;
-
+    std::array<mEdge, 8> xs, ys;
     for (auto i = 0; i < 4; i++) {
 
         std::size_t row = i >> 1;
         std::size_t col = i & 0x1;
 
-        std::array<mEdge, 2> product;
         for (auto k = 0; k < 2; k++) {
             if (lv == current_var && !lhs.isTerminal()) {
                 x = lnode->getEdge((row << 1) | k);
@@ -742,10 +782,33 @@ mEdge mm_multiply2(const mEdge &lhs, const mEdge &rhs, int32_t current_var) {
             } else {
                 y = rcopy;
             }
+            xs[(i << 1) | k] = x;
+            ys[(i << 1) | k] = y;
+        }
+    }
 
-            product[k] = mm_multiply2(x, y, current_var - 1);
+    std::array<mEdge, 8> product;
+    std::array<mEdge, 4> edges;
+    auto multiply = [&](std::size_t j) {
+        product[j] = mm_multiply2(xs[j], ys[j], current_var - 1);
+    };
+    auto add = [&](std::size_t i) {
+        edges[i] = mm_add2(product[i << 1], product[(i << 1) | 1], current_var - 1);
+    };
+
+#ifdef isMT
+    if (current_var >= config.forkLevel) {
+        forkJoin<8>(multiply, current_var);
+        forkJoin<4>(add, current_var);
+    } else
+#endif
+    {
+        for (std::size_t j = 0; j < 8; j++) {
+            multiply(j);
+        }
+        for (std::size_t i = 0; i < 4; i++) {
+            add(i);
         }
-        edges[i] = mm_add2(product[0], product[1], current_var - 1);
     }
 
     result = makeMEdge(current_var, edges);
@@ -770,6 +833,67 @@ mEdge mm_multiply(const mEdge &lhs, const mEdge &rhs) {
     return result;
 }
 
+// nodes of a gate, and the lowest and highest qubit it does not leave alone
+struct GateShape {
+    std::size_t nodes{0};
+    Qubit lo{std::numeric_limits<Qubit>::max()};
+    Qubit hi{-1};
+};
+
+static GateShape gateShape(const mEdge &gate) {
+    GateShape shape;
+    std::unordered_set<mNode *> visited;
+    std::vector<mNode *> stack{gate.n};
+    while (!stack.empty()) {
+        mNode *n = stack.back();
+        stack.pop_back();
+        if (n->v < 0 || !visited.insert(n).second) {
+            continue;
+        }
+        const auto &c = n->children;
+        // an identity on this qubit passes both halves through untouched
+        bool identity = c[0] == c[3] && c[1].w.isApproximatelyZero() &&
+                        c[2].w.isApproximatelyZero();
+        if (!identity) {
+            shape.lo = std::min(shape.lo, n->v);
+            shape.hi = std::max(shape.hi, n->v);
+        }
+        for (const mEdge &e : c) {
+            stack.push_back(e.n);
+        }
+    }
+    shape.nodes = visited.size();
+    return shape;
+}
+
+std::vector<mEdge> fuseGates(const std::vector<mEdge> &gates) {
+    if (config.fusionSpan == 0 || gates.empty()) {
+        return gates;
+    }
+    std::vector<mEdge> fused;
+    mEdge run = gates[0];
+    GateShape shape = gateShape(run);
+    for (std::size_t i = 1; i < gates.size(); i++) {
+        GateShape next = gateShape(gates[i]);
+        Qubit lo = std::min(shape.lo, next.lo);
+        Qubit hi = std::max(shape.hi, next.hi);
+        if (hi < lo || hi - lo < Qubit(config.fusionSpan)) {
+            mEdge product = mm_multiply(gates[i], run);
+            std::size_t nodes = gateShape(product).nodes;
+            if (nodes <= shape.nodes + next.nodes && nodes <= config.fusionNodes) {
+                run = product;
+                shape = {nodes, lo, hi};
+                continue;
+            }
+        }
+        fused.push_back(run);
+        run = gates[i];
+        shape = next;
+    }
+    fused.push_back(run);
+    return fused;
+}
+
 static void printVector2(const vEdge &edge, std::size_t row,
                          const std_complex &w, uint64_t left, std_complex *m) {
 
@@ -781,7 +905,7 @@ static void printVector2(const vEdge &edge, std::size_t row,
     } else if (edge.isTerminal()) {
         row = row << left;
 
-        for (std::size_t i = 0; i < (1 << left); i++) {
+        for (std::size_t i = 0; i < (std::size_t{1} << left); i++) {
             m[row | i] = wp;
         }
         return;
@@ -986,7 +1110,7 @@ static void printVector_sparse2(const vEdge &edge, std::size_t row,
     } else if (edge.isTerminal()) {
         if (norm(wp) > thr) {
             row = row << left;
-            for (std::size_t i = 0; i < (1 << left); i++) {
+            for (std::size_t i = 0; i < (std::size_t{1} << left); i++) {
                 m[row | i] = wp;
             }
         }
@@ -1004,7 +1128,6 @@ void vEdge::printVector_sparse() const {
         return;
     }
     Qubit q = this->getVar();
-    std::size_t dim = 1 << (q + 1);
 
     std::map<int, std_complex> map;
 
@@ -1027,7 +1150,7 @@ static void fillVector(const vEdge &edge, std::size_t row, const std_complex &w,
     } else if (edge.isTerminal()) {
         row = row << left;
 
-        for (std::size_t i = 0; i < (1 << left); i++) {
+        for (std::size_t i = 0; i < (std::size_t{1} << left); i++) {
             m[row | i] = wp;
         }
         return;
@@ -1089,10 +1212,9 @@ vEdge mv_multiply2(const mEdge &lhs, const vEdge &rhs, int32_t current_var) {
     lcopy.w = {1.0, 0.0};
     rcopy.w = {1.0, 0.0};
 
-    std::array<vEdge, 2> edges;
-
+    std::array<mEdge, 4> xs;
+    std::array<vEdge, 4> ys;
     for (auto i = 0; i < 2; i++) {
-        std::array<vEdge, 2> product;
         for (auto k = 0; k < 2; k++) {
             if (lv == current_var && !lhs.isTerminal()) {
                 x = lnode->getEdge((i << 1) | k);
@@ -1105,11 +1227,33 @@ vEdge mv_multiply2(const mEdge &lhs, const vEdge &rhs, int32_t current_var) {
             } else {
                 y = rcopy;
             }
-
-            product[k] = mv_multiply2(x, y, current_var - 1);
+            xs[(i << 1) | k] = x;
+            ys[(i << 1) | k] = y;
         }
+    }
 
-        edges[i] = vv_add2(product[0], product[1], current_var - 1);
+    std::array<vEdge, 4> product;
+    std::array<vEdge, 2> edges;
+    auto multiply = [&](std::size_t j) {
+        product[j] = mv_multiply2(xs[j], ys[j], current_var - 1);
+    };
+    auto add = [&](std::size_t i) {
+        edges[i] = vv_add2(product[i << 1], product[(i << 1) | 1], current_var - 1);
+    };
+
+#ifdef isMT
+    if (current_var >= config.forkLevel) {
+        forkJoin<4>(multiply, current_var);
+        forkJoin<2>(add, current_var);
+    } else
+#endif
+    {
+        for (std::size_t j = 0; j < 4; j++) {
+            multiply(j);
+        }
+        for (std::size_t i = 0; i < 2; i++) {
+            add(i);
+        }
     }
 
     result = makeVEdge(current_var, edges);
@@ -1139,23 +1283,235 @@ vEdge mv_multiply(mEdge lhs, vEdge rhs) {
     return v;
 }
 
-double assignProbabilities(const vEdge &edge,
-                           std::unordered_map<vNode *, double> &probs) {
-    auto it = probs.find(edge.n);
-    if (it != probs.end()) {
-        return edge.w.mag2() * it->second;
+namespace {
+
+// scales e by w, the zero edge if that is (nearly) zero
+vEdge scaled(const vEdge &e, const std_complex &w) {
+    std_complex weight = e.w * w;
+    if (weight.isApproximatelyZero()) {
+        return vEdge::zero;
+    }
+    return {weight, e.n};
+}
+
+// the children of e, carrying its weight
+std::array<vEdge, 2> split(const vEdge &e) {
+    if (e.w.isApproximatelyZero()) {
+        return {vEdge::zero, vEdge::zero};
     }
-    double sum{1};
-    if (!edge.isTerminal()) {
-        sum = assignProbabilities(edge.n->children.at(0), probs) +
-              assignProbabilities(edge.n->children.at(1), probs);
+    return {scaled(e.n->getEdge(0), e.w), scaled(e.n->getEdge(1), e.w)};
+}
+
+struct EdgePairHash {
+    std::size_t operator()(const std::pair<vEdge, vEdge> &p) const noexcept {
+        return hash_combine(std::hash<vEdge>()(p.first), std::hash<vEdge>()(p.second));
     }
+};
 
-    probs.insert({edge.n, sum});
+// One applyGate(), with the results of the nodes it has been through.
+class GateApplication {
+    std::array<std_complex, 4> g;
+    // phases and permutations only rescale or swap the halves
+    bool diagonal;
+    bool antidiagonal;
+    Qubit target;
+    // per qubit, whether it is a control and of which type
+    std::vector<std::optional<Control::Type>> controls;
+    // lowest control below the target, or the target without any
+    Qubit lowest;
+    std::unordered_map<vNode *, vEdge> above;
+    std::unordered_map<std::pair<vEdge, vEdge>, std::array<vEdge, 2>, EdgePairHash> below;
+    std::array<std::unordered_map<vNode *, vEdge>, 2> phased;
+
+    // a diagonal gate on the half of the target qubit e belongs to, at and
+    // below q: multiplies the part where the controls are met by its phase
+    vEdge phase(const vEdge &e, std::size_t half, Qubit q) {
+        const std_complex &w = g[half == 0 ? 0 : 3];
+        if (w.isApproximatelyOne()) {
+            return e;
+        }
+        if (q < lowest) {
+            return scaled(e, w);
+        }
+        if (e.w.isApproximatelyZero()) {
+            return vEdge::zero;
+        }
+        vEdge result;
+        auto it = phased[half].find(e.n);
+        if (it != phased[half].end()) {
+            result = it->second;
+        } else {
+            std::array<vEdge, 2> c = e.n->children;
+            if (controls[q]) {
+                std::size_t on = *controls[q] == Control::Type::pos ? 1 : 0;
+                c[on] = phase(c[on], half, q - 1);
+            } else {
+                c = {phase(c[0], half, q - 1), phase(c[1], half, q - 1)};
+            }
+            result = makeVEdge(q, c);
+            phased[half].emplace(e.n, result);
+        }
+        return scaled(result, e.w);
+    }
 
-    return edge.w.mag2() * sum;
+    // the gate on the two halves e0 and e1 of the qubits at and below q,
+    // split at the target
+    std::array<vEdge, 2> applyBelow(const vEdge &e0, const vEdge &e1, Qubit q) {
+        if (q < lowest) {
+            // no controls left, so every amplitude pair is mixed
+            if (antidiagonal) {
+                return {scaled(e1, g[1]), scaled(e0, g[2])};
+            }
+            return {vv_add(scaled(e0, g[0]), scaled(e1, g[1])),
+                    vv_add(scaled(e0, g[2]), scaled(e1, g[3]))};
+        }
+        auto key = std::make_pair(e0, e1);
+        auto it = below.find(key);
+        if (it != below.end()) {
+            return it->second;
+        }
+        std::array<vEdge, 2> a = split(e0);
+        std::array<vEdge, 2> b = split(e1);
+        std::array<vEdge, 2> result;
+        if (controls[q]) {
+            // the half where the control is not met is left alone
+            std::size_t on = *controls[q] == Control::Type::pos ? 1 : 0;
+            std::array<vEdge, 2> x = applyBelow(a[on], b[on], q - 1);
+            std::array<vEdge, 2> out0, out1;
+            out0[on] = x[0];
+            out0[1 - on] = a[1 - on];
+            out1[on] = x[1];
+            out1[1 - on] = b[1 - on];
+            result = {makeVEdge(q, out0), makeVEdge(q, out1)};
+        } else {
+            std::array<vEdge, 2> x = applyBelow(a[0], b[0], q - 1);
+            std::array<vEdge, 2> y = applyBelow(a[1], b[1], q - 1);
+            result = {makeVEdge(q, {x[0], y[0]}), makeVEdge(q, {x[1], y[1]})};
+        }
+        below.emplace(key, result);
+        return result;
+    }
+
+  public:
+    GateApplication(const GateMatrix &m, Qubit target, const Controls &c, Qubit top)
+        : target(target), controls(top + 1), lowest(target) {
+        for (std::size_t i = 0; i < 4; i++) {
+            g[i] = {m[i].real(), m[i].imag()};
+        }
+        diagonal = g[1].isApproximatelyZero() && g[2].isApproximatelyZero();
+        antidiagonal = g[0].isApproximatelyZero() && g[3].isApproximatelyZero();
+        for (const Control &control : c) {
+            assert(control.qubit <= top && control.qubit != target);
+            controls[control.qubit] = control.type;
+            lowest = std::min(lowest, control.qubit);
+        }
+    }
+
+    vEdge apply(const vEdge &e) {
+        if (e.w.isApproximatelyZero()) {
+            return vEdge::zero;
+        }
+        vEdge result;
+        auto it = above.find(e.n);
+        if (it != above.end()) {
+            result = it->second;
+        } else {
+            Qubit q = e.getVar();
+            std::array<vEdge, 2> c = e.n->children;
+            if (q == target && diagonal) {
+                c = {phase(c[0], 0, q - 1), phase(c[1], 1, q - 1)};
+            } else if (q == target) {
+                c = applyBelow(c[0], c[1], q - 1);
+            } else if (controls[q]) {
+                std::size_t on = *controls[q] == Control::Type::pos ? 1 : 0;
+                c[on] = apply(c[on]);
+            } else {
+                c = {apply(c[0]), apply(c[1])};
+            }
+            result = makeVEdge(q, c);
+            above.emplace(e.n, result);
+        }
+        result.w = result.w * e.w;
+        if (result.w.isApproximatelyZero()) {
+            return vEdge::zero;
+        }
+        if (result.w.isApproximatelyOne()) {
+            result.w = {1.0, 0.0};
+        }
+        return result;
+    }
+};
+
+} // namespace
+
+vEdge applyGate(const vEdge &state, const GateMatrix &g, Qubit target, const Controls &c) {
+    if (state.isTerminal()) {
+        return state;
+    }
+    assert(target <= state.getVar());
+    return GateApplication(g, target, c, state.getVar()).apply(state);
+}
+
+/*
+ * Squared norms of the vectors below the nodes of vUnique, by NodeHandle,
+ * one array per slab. An entry only holds for a node of the same gen: nodes
+ * are only freed by collections, and every one that frees any moves on
+ * gcEpoch, which the nodes handed out again are stamped with.
+ */
+class NormCache {
+    using Arena = NodeArena<vNode>;
+
+    struct Entry {
+        double norm;
+        std::uint16_t gen;
+        bool valid{false};
+    };
+    std::vector<std::unique_ptr<Entry[]>> _slabs;
+
+    Entry &entry(const vNode *n) {
+        NodeHandle h = Arena::handle(n);
+        std::size_t slab = h >> Arena::SLOT_BITS;
+        if (slab >= _slabs.size()) {
+            _slabs.resize(slab + 1);
+        }
+        if (!_slabs[slab]) {
+            _slabs[slab] = std::make_unique<Entry[]>(Arena::SLOTS);
+        }
+        return _slabs[slab][h & Arena::SLOT_MASK];
+    }
+
+  public:
+    const double *find(const vNode *n) {
+        const Entry &e = entry(n);
+        return e.valid && e.gen == n->gen ? &e.norm : nullptr;
+    }
+
+    void store(const vNode *n, double norm) { entry(n) = {norm, n->gen, true}; }
+
+    void clear() { _slabs.clear(); }
+};
+
+static NormCache norms;
+
+static double nodeNorm(vNode *n) {
+    if (n == vNode::terminal) {
+        return 1.0;
+    }
+    if (const double *norm = norms.find(n)) {
+        return *norm;
+    }
+    double sum = 0;
+    for (const vEdge &e : n->children) {
+        if (!e.w.isApproximatelyZero()) {
+            sum += e.w.mag2() * nodeNorm(e.n);
+        }
+    }
+    norms.store(n, sum);
+    return sum;
 }
 
+double squaredNorm(const vEdge &e) { return e.w.mag2() * nodeNorm(e.n); }
+
 std::string measureAll(vEdge &rootEdge, const bool collapse,
                        std::mt19937_64 &mt, double epsilon) {
     if (std::abs(rootEdge.w.mag2() - 1.0L) > epsilon) {
@@ -1164,17 +1520,14 @@ std::string measureAll(vEdge &rootEdge, const bool collapse,
         }
     }
 
-    std::unordered_map<vNode *, double> probs;
-    assignProbabilities(rootEdge, probs);
-
     vEdge cur = rootEdge;
     const auto nqubits = static_cast<QubitCount>(rootEdge.getVar() + 1);
     std::string result(nqubits, '0');
     std::uniform_real_distribution<double> dist(0.0, 1.0L);
 
     for (Qubit i = rootEdge.getVar(); i >= 0; --i) {
-        double p0 = probs[cur.n->getEdge(0).n] * cur.n->getEdge(0).w.mag2();
-        double p1 = probs[cur.n->getEdge(1).n] * cur.n->getEdge(1).w.mag2();
+        double p0 = squaredNorm(cur.n->getEdge(0));
+        double p1 = squaredNorm(cur.n->getEdge(1));
         double tmp = p0 + p1;
 
         p0 /= tmp;
@@ -1192,7 +1545,7 @@ std::string measureAll(vEdge &rootEdge, const bool collapse,
     if (collapse) {
         vEdge e = vEdge::one;
         std::array<vEdge, 2> edges{};
-        for (Qubit p = 0; p < nqubits; p++) {
+        for (QubitCount p = 0; p < nqubits; p++) {
             if (result[p] == '0') {
                 edges[0] = e;
                 edges[1] = vEdge::zero;
@@ -1207,14 +1560,103 @@ std::string measureAll(vEdge &rootEdge, const bool collapse,
     return std::string{result.rbegin(), result.rend()};
 }
 
+namespace {
+
+const std::uint32_t NO_NODE = std::numeric_limits<std::uint32_t>::max();
+
+// a node of the state being sampled, see flattenForSampling()
+struct SampleNode {
+    Qubit v;
+    // probability of the 0 branch once the node is reached
+    double p0;
+    // NO_NODE for the terminal and zero edges
+    std::array<std::uint32_t, 2> children;
+};
+
+// numbers the nodes below e in post-order into nodes, returning the index of
+// e.n
+std::uint32_t flattenForSampling(const vEdge &e, std::vector<SampleNode> &nodes,
+                                 std::unordered_map<vNode *, std::uint32_t> &index) {
+    if (e.isTerminal()) {
+        return NO_NODE;
+    }
+    auto it = index.find(e.n);
+    if (it != index.end()) {
+        return it->second;
+    }
+    SampleNode node{e.n->v, 0.0, {NO_NODE, NO_NODE}};
+    std::array<double, 2> p;
+    for (std::size_t i = 0; i < 2; i++) {
+        const vEdge &child = e.n->children[i];
+        node.children[i] = flattenForSampling(child, nodes, index);
+        p[i] = squaredNorm(child);
+    }
+    node.p0 = p[0] + p[1] > 0 ? std::clamp(p[0] / (p[0] + p[1]), 0.0, 1.0) : 1.0;
+    nodes.push_back(node);
+    std::uint32_t i = nodes.size() - 1;
+    index.emplace(e.n, i);
+    return i;
+}
+
+// splits shots between the branches of nodes[i] binomially, so that the
+// draws cost the distinct outcomes rather than the shots
+void drawShots(const std::vector<SampleNode> &nodes, std::uint32_t i, std::size_t shots,
+               std::string &outcome, std::mt19937_64 &mt,
+               std::map<std::string, std::size_t> &counts) {
+    const SampleNode &node = nodes[i];
+    std::binomial_distribution<std::size_t> zeros(shots, node.p0);
+    std::size_t k = zeros(mt);
+    std::array<std::size_t, 2> split{k, shots - k};
+    char &bit = outcome[outcome.size() - 1 - node.v];
+    for (std::size_t b = 0; b < 2; b++) {
+        if (split[b] == 0) {
+            continue;
+        }
+        bit = b == 0 ? '0' : '1';
+        if (node.children[b] == NO_NODE) {
+            counts[outcome] += split[b];
+        } else {
+            drawShots(nodes, node.children[b], split[b], outcome, mt, counts);
+        }
+    }
+    bit = '0';
+}
+
+} // namespace
+
+std::map<std::string, std::size_t> sampleShots(const vEdge &rootEdge, std::size_t shots,
+                                               std::uint64_t seed) {
+    if (rootEdge.w.isApproximatelyZero()) {
+        throw std::runtime_error("led to a 0-vector");
+    }
+    std::map<std::string, std::size_t> counts;
+    if (shots == 0) {
+        return counts;
+    }
+    if (rootEdge.isTerminal()) {
+        counts[""] = shots;
+        return counts;
+    }
+
+    std::vector<SampleNode> nodes;
+    {
+        std::unordered_map<vNode *, std::uint32_t> index;
+        flattenForSampling(rootEdge, nodes, index);
+    }
+
+    std::mt19937_64 mt(seed);
+    std::string outcome(rootEdge.getVar() + 1, '0');
+    drawShots(nodes, nodes.size() - 1, shots, outcome, mt, counts);
+    return counts;
+}
+
 std::pair<double, double>
 determineMeasurementProbabilities(const vEdge &rootEdge, const Qubit index) {
+    // the squared weight of all paths to each node down to the index
     std::unordered_map<vNode *, double> probsMone;
-    std::set<vNode *> visited;
     std::queue<vNode *> q;
 
     probsMone[rootEdge.n] = rootEdge.w.mag2();
-    visited.insert(rootEdge.n);
     q.push(rootEdge.n);
 
     while (q.front()->v != index) {
@@ -1222,29 +1664,14 @@ determineMeasurementProbabilities(const vEdge &rootEdge, const Qubit index) {
         q.pop();
         const double prob = probsMone[ptr];
 
-        if (!ptr->children.at(0).w.isApproximatelyZero()) {
-            const double tmp1 = prob * ptr->children.at(0).w.mag2();
-
-            if (visited.find(ptr->children.at(0).n) != visited.end()) {
-                probsMone[ptr->children.at(0).n] =
-                    probsMone[ptr->children.at(0).n] + tmp1;
-            } else {
-                probsMone[ptr->children.at(0).n] = tmp1;
-                visited.insert(ptr->children.at(0).n);
-                q.push(ptr->children.at(0).n);
+        for (const vEdge &child : ptr->children) {
+            if (child.w.isApproximatelyZero()) {
+                continue;
             }
-        }
-
-        if (!ptr->children.at(1).w.isApproximatelyZero()) {
-            const double tmp1 = prob * ptr->children.at(1).w.mag2();
-
-            if (visited.find(ptr->children.at(1).n) != visited.end()) {
-                probsMone[ptr->children.at(1).n] =
-                    probsMone[ptr->children.at(1).n] + tmp1;
-            } else {
-                probsMone[ptr->children.at(1).n] = tmp1;
-                visited.insert(ptr->children.at(1).n);
-                q.push(ptr->children.at(1).n);
+            auto [it, fresh] = probsMone.try_emplace(child.n, 0.0);
+            it->second += prob * child.w.mag2();
+            if (fresh) {
+                q.push(child.n);
             }
         }
     }
@@ -1252,24 +1679,98 @@ determineMeasurementProbabilities(const vEdge &rootEdge, const Qubit index) {
     double pzero{0};
     double pone{0};
 
-    
-    std::unordered_map<vNode *, double> probs;
-    assignProbabilities(rootEdge, probs);
-
     while (!q.empty()) {
         vNode *ptr = q.front();
         q.pop();
 
-        if (!ptr->children.at(0).w.isApproximatelyZero()) {
-            pzero += probsMone[ptr] * probs[ptr->children.at(0).n] *
-                        ptr->children.at(0).w.mag2();
+        pzero += probsMone[ptr] * squaredNorm(ptr->children[0]);
+        pone += probsMone[ptr] * squaredNorm(ptr->children[1]);
+    }
+    return {pzero, pone};
+}
+
+namespace {
+
+// One collapse(): keeps the child of the outcome on the measured levels and
+// rewrites the nodes above them, sharing everything below the lowest one.
+class Collapse {
+    // per qubit, the child it collapses to
+    std::vector<std::optional<std::size_t>> outcomes;
+    Qubit lowest;
+    std::unordered_map<vNode *, vEdge> done;
+
+  public:
+    Collapse(const std::vector<Qubit> &qubits, const std::string &outcome, Qubit top)
+        : outcomes(top + 1), lowest(top + 1) {
+        assert(qubits.size() == outcome.size());
+        for (std::size_t i = 0; i < qubits.size(); i++) {
+            assert(qubits[i] >= 0 && qubits[i] <= top);
+            assert(outcome[i] == '0' || outcome[i] == '1');
+            outcomes[qubits[i]] = outcome[i] == '0' ? 0 : 1;
+            lowest = std::min(lowest, qubits[i]);
         }
+    }
 
-        if (!ptr->children.at(1).w.isApproximatelyZero()) {
-            pone += probsMone[ptr] * probs[ptr->children.at(1).n] * ptr->children.at(1).w.mag2();
+    // the part of e with the measured qubits at their outcomes, unnormalized
+    vEdge apply(const vEdge &e) {
+        if (e.w.isApproximatelyZero()) {
+            return vEdge::zero;
+        }
+        if (e.isTerminal() || e.getVar() < lowest) {
+            return e;
+        }
+        vEdge result;
+        auto it = done.find(e.n);
+        if (it != done.end()) {
+            result = it->second;
+        } else {
+            Qubit q = e.getVar();
+            std::array<vEdge, 2> c = e.n->children;
+            if (outcomes[q]) {
+                std::size_t b = *outcomes[q];
+                c[b] = apply(c[b]);
+                c[1 - b] = vEdge::zero;
+            } else {
+                c = {apply(c[0]), apply(c[1])};
+            }
+            result = c[0].w.isApproximatelyZero() && c[1].w.isApproximatelyZero()
+                         ? vEdge::zero
+                         : makeVEdge(q, c);
+            done.emplace(e.n, result);
         }
+        return scaled(result, e.w);
     }
-    return {pzero, pone};
+};
+
+// collapses rootEdge to outcome (one character per qubit), which has squared
+// norm p in it, and scales the result back to norm 1
+vEdge collapseTo(const vEdge &rootEdge, const std::vector<Qubit> &qubits,
+                 const std::string &outcome, double p) {
+    if (rootEdge.isTerminal()) {
+        return rootEdge;
+    }
+    vEdge e = Collapse(qubits, outcome, rootEdge.getVar()).apply(rootEdge);
+    e.w = e.w * std_complex{std::sqrt(1.0 / p), 0};
+    return e;
+}
+
+} // namespace
+
+vEdge collapse(const vEdge &rootEdge, const std::vector<Qubit> &qubits,
+               const std::string &outcome) {
+    if (rootEdge.isTerminal()) {
+        return rootEdge;
+    }
+    // bit k of the index is qubits[k]
+    std::size_t index = 0;
+    for (std::size_t k = 0; k < qubits.size(); k++) {
+        index |= std::size_t(outcome[k] == '1') << k;
+    }
+    const double p = marginalProbabilities(rootEdge, qubits)[index] * squaredNorm(rootEdge);
+    if (p <= 0) {
+        throw std::runtime_error("led to a 0-vector");
+    }
+    return collapseTo(rootEdge, qubits, outcome, p);
 }
 
 char measureOneCollapsing(vEdge &rootEdge, const Qubit index,
@@ -1283,51 +1784,263 @@ char measureOneCollapsing(vEdge &rootEdge, const Qubit index,
             std::to_string(pzero) + " + " + std::to_string(pone) + " = " +
             std::to_string(pzero + pone) + ", but should be 1!");
     }
-    GateMatrix measurementMatrix{cf_zero, cf_zero, cf_zero, cf_zero};
 
     std::uniform_real_distribution<double> dist(0.0, 1.0L);
 
-    double threshold = dist(mt);
-    double
-        normalizationFactor; // NOLINT(cppcoreguidelines-init-variables) always
-                             // assigned a value in the following block
-    char result; // NOLINT(cppcoreguidelines-init-variables) always assigned a
-                 // value in the following block
-
-    if (threshold < pzero / sum) {
-        measurementMatrix[0] = cf_one;
-        normalizationFactor = pzero;
-        result = '0';
-    } else {
-        measurementMatrix[3] = cf_one;
-        normalizationFactor = pone;
-        result = '1';
+    const char result = dist(mt) < pzero / sum ? '0' : '1';
+    rootEdge = collapseTo(rootEdge, {index}, std::string(1, result),
+                          result == '0' ? pzero : pone);
+    return result;
+}
+
+std::string measureCollapsing(vEdge &rootEdge, const std::vector<Qubit> &qubits,
+                              std::mt19937_64 &mt, double epsilon) {
+    if (qubits.empty()) {
+        return "";
+    }
+    // the bits of one basis state drawn from the whole state are a draw of
+    // the measured ones
+    const std::string all = measureAll(rootEdge, false, mt, epsilon);
+    std::string outcome(qubits.size(), '0');
+    for (std::size_t i = 0; i < qubits.size(); i++) {
+        outcome[i] = all[all.size() - 1 - qubits[i]];
+    }
+    rootEdge = collapse(rootEdge, qubits, outcome);
+    return outcome;
+}
+
+namespace {
+
+// One marginalProbabilities(). The distribution below a node covers the
+// measured qubits at or below its level, the lowest of them as bit 0.
+class Marginals {
+    // per qubit, how many measured qubits there are at or below it
+    std::vector<std::size_t> below;
+    std::vector<bool> measured;
+    Qubit lowest;
+    std::unordered_map<vNode *, std::vector<double>> done;
+
+    std::size_t size(Qubit q) const { return q < 0 ? 1 : std::size_t{1} << below[q]; }
+
+  public:
+    Marginals(const std::vector<Qubit> &qubits, Qubit top)
+        : below(top + 1, 0), measured(top + 1, false), lowest(top + 1) {
+        for (Qubit q : qubits) {
+            assert(q >= 0 && q <= top);
+            measured[q] = true;
+            lowest = std::min(lowest, q);
+        }
+        std::size_t count = 0;
+        for (Qubit q = 0; q <= top; q++) {
+            count += measured[q];
+            below[q] = count;
+        }
     }
 
-    mEdge measurementGate =
-        makeGate(rootEdge.getVar() + 1, measurementMatrix, index);
+    // the distribution of the node e.n at level q, unweighted
+    const std::vector<double> &of(const vEdge &e, Qubit q) {
+        auto it = done.find(e.n);
+        if (it != done.end()) {
+            return it->second;
+        }
+        std::vector<double> result(size(q), 0.0);
+        if (q < lowest) {
+            result[0] = nodeNorm(e.n);
+        } else {
+            const std::size_t half = size(q - 1);
+            for (std::size_t b = 0; b < 2; b++) {
+                const vEdge &child = e.n->children[b];
+                if (child.w.isApproximatelyZero()) {
+                    continue;
+                }
+                const double w = child.w.mag2();
+                const std::vector<double> &p = of(child, q - 1);
+                std::size_t offset = measured[q] ? b * half : 0;
+                for (std::size_t j = 0; j < half; j++) {
+                    result[offset + j] += w * p[j];
+                }
+            }
+        }
+        return done.emplace(e.n, std::move(result)).first->second;
+    }
+};
 
-    vEdge e = mv_multiply(measurementGate, rootEdge);
+struct NodePairHash {
+    std::size_t operator()(const std::pair<vNode *, vNode *> &p) const noexcept {
+        return hash_combine(std::hash<vNode *>()(p.first), std::hash<vNode *>()(p.second));
+    }
+};
 
-    std_complex c = {std::sqrt(1.0 / normalizationFactor), 0};
-    c = e.w * c;
-    e.w = c;
-    rootEdge = e;
+// One innerProduct(), with the products of the node pairs it has been
+// through, without the weights of the edges to them.
+class InnerProduct {
+    std::unordered_map<std::pair<vNode *, vNode *>, std_complex, NodePairHash> done;
 
+  public:
+    std_complex of(const vEdge &lhs, const vEdge &rhs) {
+        if (lhs.w.isApproximatelyZero() || rhs.w.isApproximatelyZero()) {
+            return {0.0, 0.0};
+        }
+        std_complex weight = std_complex{lhs.w.r, -lhs.w.i} * rhs.w;
+        if (lhs.isTerminal()) {
+            assert(rhs.isTerminal());
+            return weight;
+        }
+        assert(lhs.getVar() == rhs.getVar());
+        auto key = std::make_pair(lhs.n, rhs.n);
+        auto it = done.find(key);
+        if (it == done.end()) {
+            std_complex sum = of(lhs.n->children[0], rhs.n->children[0]) +
+                              of(lhs.n->children[1], rhs.n->children[1]);
+            it = done.emplace(key, sum).first;
+        }
+        return it->second * weight;
+    }
+};
+
+// One expectation() of a Pauli string: <lhs|P|rhs> over pairs of nodes, P
+// flipping (X, Y) or sign-changing (Y, Z) the branches on its levels. Below
+// the lowest of those it is the inner product of the two sides, the cached
+// squared norm where they have met the same node again.
+class PauliExpectation {
+    // per qubit
+    std::vector<char> paulis;
+    Qubit lowest;
+    std::unordered_map<std::pair<vNode *, vNode *>, std_complex, NodePairHash> done;
+    InnerProduct below;
+
+  public:
+    explicit PauliExpectation(const std::string &pauli)
+        : paulis(pauli.size()), lowest(static_cast<Qubit>(pauli.size())) {
+        for (std::size_t k = 0; k < pauli.size(); k++) {
+            const auto q = static_cast<Qubit>(pauli.size() - 1 - k);
+            paulis[q] = pauli[k];
+            if (pauli[k] != 'I') {
+                lowest = std::min(lowest, q);
+            }
+        }
+    }
+
+    std_complex of(const vEdge &lhs, const vEdge &rhs) {
+        if (lhs.w.isApproximatelyZero() || rhs.w.isApproximatelyZero()) {
+            return {0.0, 0.0};
+        }
+        std_complex weight = std_complex{lhs.w.r, -lhs.w.i} * rhs.w;
+        if (lhs.isTerminal()) {
+            return weight;
+        }
+        const Qubit q = lhs.getVar();
+        if (q < lowest) {
+            // a flip above has paired different nodes
+            if (lhs.n != rhs.n) {
+                return below.of(lhs, rhs);
+            }
+            return weight * std_complex{nodeNorm(lhs.n), 0.0};
+        }
+        auto key = std::make_pair(lhs.n, rhs.n);
+        auto it = done.find(key);
+        if (it == done.end()) {
+            const char p = paulis[q];
+            const std::size_t flip = p == 'X' || p == 'Y' ? 1 : 0;
+            std::array<std_complex, 2> phase{std_complex{1.0, 0.0}, std_complex{1.0, 0.0}};
+            if (p == 'Y') {
+                // <0|Y|1> = -i, <1|Y|0> = i
+                phase = {std_complex{0.0, -1.0}, std_complex{0.0, 1.0}};
+            } else if (p == 'Z') {
+                phase[1] = {-1.0, 0.0};
+            }
+            std_complex sum{0.0, 0.0};
+            for (std::size_t b = 0; b < 2; b++) {
+                const std::size_t row = b ^ flip;
+                sum += phase[row] * of(lhs.n->children[row], rhs.n->children[b]);
+            }
+            it = done.emplace(key, sum).first;
+        }
+        return it->second * weight;
+    }
+};
+
+} // namespace
+
+std::vector<double> marginalProbabilities(const vEdge &rootEdge, const std::vector<Qubit> &qubits) {
+    if (rootEdge.w.isApproximatelyZero()) {
+        throw std::runtime_error("led to a 0-vector");
+    }
+    std::vector<double> result(std::size_t{1} << qubits.size(), 0.0);
+    if (rootEdge.isTerminal()) {
+        result[0] = 1.0;
+        return result;
+    }
+    const Qubit top = rootEdge.getVar();
+    Marginals marginals(qubits, top);
+    const std::vector<double> &p = marginals.of(rootEdge, top);
+
+    // p has the measured qubits in ascending order, the result in that of qubits
+    std::vector<Qubit> sorted(qubits);
+    std::sort(sorted.begin(), sorted.end());
+    assert(std::adjacent_find(sorted.begin(), sorted.end()) == sorted.end());
+    const double norm = std::accumulate(p.begin(), p.end(), 0.0);
+    for (std::size_t j = 0; j < p.size(); j++) {
+        std::size_t i = 0;
+        for (std::size_t k = 0; k < qubits.size(); k++) {
+            std::size_t bit = std::lower_bound(sorted.begin(), sorted.end(), qubits[k]) -
+                              sorted.begin();
+            i |= (j >> bit & 1) << k;
+        }
+        result[i] = p[j] / norm;
+    }
     return result;
 }
 
-mEdge makeSwap(QubitCount q, Qubit target0, Qubit target1) {
-    Controls c1{Control{target0, Control::Type::pos}};
-    mEdge e1 = makeGate(q, Xmat, target1, c1);
+std::complex<double> innerProduct(const vEdge &lhs, const vEdge &rhs) {
+    std_complex c = InnerProduct().of(lhs, rhs);
+    return {c.r, c.i};
+}
 
-    Controls c2{Control{target1, Control::Type::pos}};
-    mEdge e2 = makeGate(q, Xmat, target0, c2);
+double expectation(const vEdge &state, const mEdge &observable) {
+    return innerProduct(state, mv_multiply(observable, state)).real() / squaredNorm(state);
+}
 
-    mEdge e3 = mm_multiply(e2, e1);
-    e3 = mm_multiply(e1, e3);
+double expectation(const vEdge &state, const std::string &pauli) {
+    const auto nqubits = static_cast<std::size_t>(state.getVar() + 1);
+    if (pauli.size() != nqubits) {
+        throw std::runtime_error("Pauli string " + pauli + " is not of " +
+                                 std::to_string(nqubits) + " qubits");
+    }
+    for (char c : pauli) {
+        if (c != 'I' && c != 'X' && c != 'Y' && c != 'Z') {
+            throw std::runtime_error("Pauli string " + pauli + " has " + c +
+                                     ", not one of I, X, Y and Z");
+        }
+    }
+    return PauliExpectation(pauli).of(state, state).r / squaredNorm(state);
+}
 
-    return e3;
+mEdge makeSwap(QubitCount q, Qubit target0, Qubit target1) {
+    Qubit lo = std::min(target0, target1);
+    Qubit hi = std::max(target0, target1);
+
+    // sub-matrices below hi for row and column bit r, c of hi; each is the
+    // identity but for the bits of lo, which must be c in the row and r in
+    // the column
+    std::array<mEdge, 4> edges;
+    for (int r = 0; r < 2; r++) {
+        for (int c = 0; c < 2; c++) {
+            std::array<mEdge, 4> children{mEdge::zero, mEdge::zero, mEdge::zero, mEdge::zero};
+            children[(c << 1) | r] = makeIdent(lo - 1);
+            mEdge e = makeMEdge(lo, children);
+            for (Qubit z = lo + 1; z < hi; z++) {
+                e = makeMEdge(z, {e, mEdge::zero, mEdge::zero, e});
+            }
+            edges[(r << 1) | c] = e;
+        }
+    }
+
+    mEdge e = makeMEdge(hi, edges);
+    for (Qubit z = hi + 1; z < Qubit(q); z++) {
+        e = makeMEdge(z, {e, mEdge::zero, mEdge::zero, e});
+    }
+    return e;
 }
 
 mEdge RX(QubitCount qnum, int target, double angle) {
@@ -1410,7 +2123,7 @@ void genDot2(vNode *node, std::vector<std::string> &result, int depth, std::unor
     std::stringstream node_ss;
     node_ss << (uint64_t)node << " [label=\"q" << depth << "\"]";
     result.push_back(node_ss.str());
-    for (int i = 0; i < node->children.size(); i++) {
+    for (std::size_t i = 0; i < node->children.size(); i++) {
         std::stringstream ss;
         ss << (uint64_t)node << " -> " << (uint64_t)node->children[i].n
            << " [label=\"" << i << node->children[i].w << "\"]";
@@ -1451,7 +2164,7 @@ void genDot2(mNode *node, std::vector<std::string> &result, int depth, std::unor
     std::stringstream node_ss;
     node_ss << (uint64_t)node << " [label=\"q" << depth << "\"]";
     result.push_back(node_ss.str());
-    for (int i = 0; i < node->children.size(); i++) {
+    for (std::size_t i = 0; i < node->children.size(); i++) {
         if(node->children[i].w.isApproximatelyZero()){
             continue;
         }
@@ -1524,13 +2237,13 @@ vNode *vec_to_vNode(std::vector<vContent> &table, vNodeTable &uniqTable) {
     std::unordered_map<int, vNode *> map;
     map[0] = &vNode::terminalNode;
 
-    for (int i = 1; i < table.size(); i++) {
+    for (std::size_t i = 1; i < table.size(); i++) {
         vNode *node = uniqTable.getNode();
         node->v = table[i].v;
         vNode *i0 = map[table[i].index[0]];
         vNode *i1 = map[table[i].index[1]];
-        vEdge e0 = {table[i].w[0], i0};
-        vEdge e1 = {table[i].w[1], i1};
+        vEdge e0 = {internWeight(table[i].w[0]), i0};
+        vEdge e1 = {internWeight(table[i].w[1]), i1};
         node->children = {e0, e1};
         node = uniqTable.lookup(node);
         map[i] = node;
@@ -1587,8 +2300,7 @@ void dump(boost::mpi::communicator &world, vEdge e, int cycle){
 }
 
 double adjust_weight(bmpi::communicator &world, vEdge rootEdge){
-    const auto &[pzero, pone] = determineMeasurementProbabilities(rootEdge, 0);
-    double amp = pzero + pone;
+    double amp = squaredNorm(rootEdge);
     double amp_sum = bmpi::all_reduce(world, amp, std::plus<double>());
     assert(amp_sum > 0);
     rootEdge.w = rootEdge.w / std_complex(std::sqrt(amp_sum), 0);
@@ -1603,31 +2315,376 @@ int get_nNodes(vEdge e){
     return num;
 }
 
-int GC_SIZE = 131072*16;
+int get_nNodes(mEdge e){
+    return gateShape(e).nodes;
+}
+
+static std::size_t collectV(const std::vector<vEdge> &roots) {
+    for (const vEdge &e : roots) {
+        vNodeTable::mark(e.n);
+    }
+    return vUnique.sweep();
+}
+
+static std::size_t collectM(const std::vector<mEdge> &roots) {
+    for (const mEdge &e : identityTable) {
+        mNodeTable::mark(e.n);
+    }
+    for (const mEdge &e : roots) {
+        mNodeTable::mark(e.n);
+    }
+    return mUnique.sweep();
+}
+
+// Invalidates every cache entry that refers to a node freed so far.
+static void advanceEpoch() {
+    if (vUnique.takeReleasedSlabs() + mUnique.takeReleasedSlabs() > 0) {
+        // some entries point into unmapped memory, where no check can go
+        _aCache.clearAll();
+        _mCache.clearAll();
+    }
+    if (++gcEpoch != 0) {
+        return;
+    }
+    // the stamps wrapped around, so start over from a clean slate
+    _aCache.clearAll();
+    _mCache.clearAll();
+    norms.clear();
+    vUnique.resetGenerations();
+    mUnique.resetGenerations();
+}
+
+static std::size_t weightsKept = 0;
+
+// Forgets the weights no live node uses any more, once cUnique has doubled.
+static void collectWeights() {
+    if (cUnique.size() < std::max(2 * weightsKept, WEIGHTS_MIN)) {
+        return;
+    }
+    cUnique.clear(cUnique.size());
+    vUnique.forEachLive([](const vNode &n) {
+        for (const vEdge &e : n.children) {
+            cUnique.lookup(e.w);
+        }
+    });
+    mUnique.forEachLive([](const mNode &n) {
+        for (const mEdge &e : n.children) {
+            cUnique.lookup(e.w);
+        }
+    });
+    weightsKept = cUnique.size();
+    // with isMT the table only grows here
+    cUnique.reserve(2 * weightsKept);
+}
+
+#ifdef isMT
+static std::shared_future<std::size_t> collecting;
+
+// waits for the concurrent collection, if one is running
+static void finishCollection() {
+    if (collecting.valid()) {
+        collecting.wait();
+        collecting = {};
+    }
+}
+
+std::shared_future<std::size_t> collectGarbageConcurrently(const std::vector<vEdge> &vroots,
+                                                           const std::vector<mEdge> &mroots) {
+    finishCollection();
+    // nodes handed out from here on are newer than the collection
+    advanceEpoch();
+    vNodeTable::beginMarking();
+    mNodeTable::beginMarking();
+
+    std::vector<mEdge> mall(identityTable);
+    mall.insert(mall.end(), mroots.begin(), mroots.end());
+    collecting = std::async(std::launch::async, [vroots, mall] {
+                     for (const vEdge &e : vroots) {
+                         vNodeTable::markRoot(e.n);
+                     }
+                     for (const mEdge &e : mall) {
+                         mNodeTable::markRoot(e.n);
+                     }
+                     return vUnique.sweepConcurrently() + mUnique.sweepConcurrently();
+                 }).share();
+    return collecting;
+}
+#else
+static void finishCollection() {}
+#endif
+
+void collectGarbage(const std::vector<vEdge> &vroots,
+                    const std::vector<mEdge> &mroots) {
+    finishCollection();
+    std::size_t freed = collectV(vroots) + collectM(mroots);
+    if (freed > 0) {
+        advanceEpoch();
+    }
+    collectWeights();
+}
+
+static std::size_t GC_SIZE = GC_NODES;
+
+static bool nodeMemoryLow() {
+    return nodeBudget.cap != 0 && nodeBudget.used >= nodeBudget.cap / 8 * 7;
+}
+
 vEdge gc(vEdge state){
-    if(vUnique.get_allocations()<GC_SIZE){
+    if(vUnique.get_live_nodes()<GC_SIZE && !nodeMemoryLow()){
         return state;
     }
-    std::cout << "vSize="<<vUnique.get_allocations() << " mSize=" << mUnique.get_allocations() << " vLimit="<<GC_SIZE;
+    finishCollection();
+    std::cout << "vSize="<<vUnique.get_live_nodes() << " mSize=" << mUnique.get_live_nodes() << " vLimit="<<GC_SIZE;
 
-    std::vector<vContent> v;
-    std::unordered_map<vNode *, int> map;
-    int nNodes = vNode_to_vec(state.n, v, map);
-    if(nNodes>GC_SIZE){
-        GC_SIZE += nNodes;
-    }
-    std::cout << " Current nNodes = " << nNodes << std::endl;
-
-    vNodeTable new_table(NQUBITS);
-    vUnique = std::move(new_table);
-    //mNodeTable new_table_m(NQUBITS);
-    //mUnique = std::move(new_table_m);
-    state.n = vec_to_vNode(v, vUnique);
-
-    AddCache newA(NQUBITS);
-    MulCache newM(NQUBITS);
-    _aCache = std::move(newA);
-    _mCache = std::move(newM);
-    std::cout << " gc_done " << std::endl;
+    if (collectV({state}) > 0) {
+        advanceEpoch();
+    }
+    collectWeights();
+
+    // keep collections amortized when most of the nodes are still in use
+    std::size_t live = vUnique.get_live_nodes();
+    GC_SIZE = std::max(GC_SIZE, 2 * live);
+    std::cout << " Current nNodes = " << live << " gc_done " << std::endl;
     return state;
-}
\ No newline at end of file
+}
+
+// gc(state, gates) for any number of states
+static void gcRoots(const std::vector<vEdge> &states, const std::vector<mEdge> &gates){
+    if(vUnique.get_live_nodes() + mUnique.get_live_nodes()<GC_SIZE && !nodeMemoryLow()){
+        return;
+    }
+    finishCollection();
+    std::cout << "vSize="<<vUnique.get_live_nodes() << " mSize=" << mUnique.get_live_nodes() << " vLimit="<<GC_SIZE;
+
+    collectGarbage(states, gates);
+
+    std::size_t live = vUnique.get_live_nodes() + mUnique.get_live_nodes();
+    GC_SIZE = std::max(GC_SIZE, 2 * live);
+    std::cout << " Current nNodes = " << live << " gc_done " << std::endl;
+}
+
+vEdge gc(vEdge state, const std::vector<mEdge> &gates){
+    gcRoots({state}, gates);
+    return state;
+}
+
+#ifdef isMT
+// live nodes when the running concurrent collection started
+static std::size_t collectingLive = 0;
+
+vEdge gcConcurrently(vEdge state, const std::vector<mEdge> &gates,
+                     const std::vector<vEdge> &states){
+    if (collecting.valid()) {
+        if (collecting.wait_for(std::chrono::seconds(0)) != std::future_status::ready &&
+            !nodeMemoryLow()) {
+            return state;
+        }
+        // the survivors of the last collection set the next threshold
+        std::size_t freed = collecting.get();
+        collecting = {};
+        GC_SIZE = std::max(GC_SIZE, 2 * (collectingLive - std::min(freed, collectingLive)));
+    }
+    std::size_t live = vUnique.get_live_nodes() + mUnique.get_live_nodes();
+    if(live<GC_SIZE && !nodeMemoryLow()){
+        return state;
+    }
+    collectingLive = live;
+    std::vector<vEdge> vroots{state};
+    vroots.insert(vroots.end(), states.begin(), states.end());
+    collectGarbageConcurrently(vroots, gates);
+    return state;
+}
+
+void finishGcConcurrently(){
+    if (!collecting.valid()) {
+        return;
+    }
+    std::size_t freed = collecting.get();
+    collecting = {};
+    GC_SIZE = std::max(GC_SIZE, 2 * (collectingLive - std::min(freed, collectingLive)));
+    collectWeights();
+}
+#endif
+
+namespace {
+
+// One simulateBranching(), walking the tree of measurement outcomes depth
+// first.
+class BranchingSimulation {
+    const std::vector<CircuitOp> &ops;
+    // the Matrix ops, which collections must keep
+    std::vector<mEdge> gates;
+    // the states measured further up the current branch, whose other
+    // outcomes are still to be run
+    std::vector<vEdge> pending;
+    // lowest bit first
+    std::string cbits;
+    std::mt19937_64 mt;
+
+    bool enabled(const CircuitOp &op) const {
+        return std::all_of(op.condition.begin(), op.condition.end(),
+                           [this](std::size_t b) { return cbits[b] == '1'; });
+    }
+
+    // splits the shots on state between the outcomes of the Measure or
+    // Reset ops[i] and runs the rest of the circuit on each
+    void branch(const vEdge &state, std::size_t i, std::size_t shots) {
+        const CircuitOp &op = ops[i];
+        const auto [pzero, pone] = determineMeasurementProbabilities(state, op.target);
+        const double sum = pzero + pone;
+        if (sum <= 0) {
+            throw std::runtime_error("led to a 0-vector");
+        }
+        std::binomial_distribution<std::size_t> zeros(shots, std::clamp(pzero / sum, 0.0, 1.0));
+        std::size_t k = zeros(mt);
+        const std::array<std::size_t, 2> split{k, shots - k};
+        const std::array<double, 2> p{pzero, pone};
+
+        const bool measure = op.kind == CircuitOp::Kind::Measure;
+        const char saved = measure ? cbits[op.cbit] : '0';
+        pending.push_back(state);
+        for (std::size_t b = 0; b < 2; b++) {
+            if (split[b] == 0) {
+                continue;
+            }
+            vEdge next = collapseTo(state, {op.target}, b == 0 ? "0" : "1", p[b]);
+            if (measure) {
+                cbits[op.cbit] = b == 0 ? '0' : '1';
+            } else if (b == 1) {
+                next = applyGate(next, Xmat, op.target);
+            }
+            run(next, i + 1, split[b]);
+        }
+        pending.pop_back();
+        if (measure) {
+            cbits[op.cbit] = saved;
+        }
+    }
+
+  public:
+    std::map<std::string, std::size_t> counts;
+
+    BranchingSimulation(const std::vector<CircuitOp> &ops, std::size_t nbits, std::uint64_t seed)
+        : ops(ops), cbits(nbits, '0'), mt(seed) {
+        for (const CircuitOp &op : ops) {
+            if (op.kind == CircuitOp::Kind::Matrix) {
+                gates.push_back(op.matrix);
+            }
+        }
+    }
+
+    // runs ops[i] onwards on state for the given shots
+    void run(vEdge state, std::size_t i, std::size_t shots) {
+        for (; i < ops.size(); i++) {
+            const CircuitOp &op = ops[i];
+            if (op.kind == CircuitOp::Kind::Measure || op.kind == CircuitOp::Kind::Reset) {
+                branch(state, i, shots);
+                return;
+            }
+            if (!enabled(op)) {
+                continue;
+            }
+            if (op.kind == CircuitOp::Kind::Gate) {
+                state = applyGate(state, op.g, op.target, op.controls);
+            } else {
+                state = mv_multiply(op.matrix, state);
+            }
+            pending.push_back(state);
+            gcRoots(pending, gates);
+            pending.pop_back();
+        }
+        counts[std::string(cbits.rbegin(), cbits.rend())] += shots;
+    }
+};
+
+} // namespace
+
+std::map<std::string, std::size_t> simulateBranching(QubitCount n, std::size_t cbits,
+                                                     const std::vector<CircuitOp> &ops,
+                                                     std::size_t shots, std::uint64_t seed) {
+    BranchingSimulation simulation(ops, cbits, seed);
+    if (shots > 0) {
+        simulation.run(makeZeroState(n), 0, shots);
+    }
+    return simulation.counts;
+}
+
+EngineStats getStats(){
+    LevelStats weights = cUnique.stats();
+    return {vUnique.stats(), mUnique.stats(), _aCache.stats(), _mCache.stats(),
+            {{weights}, weights.bytes}};
+}
+
+void resetStats(){
+    vUnique.resetStats();
+    mUnique.resetStats();
+    _aCache.resetStats();
+    _mCache.resetStats();
+    cUnique.resetStats();
+}
+
+static std::size_t floorPow2(std::size_t n) {
+    std::size_t p = 1;
+    while (p <= n / 2) {
+        p *= 2;
+    }
+    return p;
+}
+
+EngineConfig EngineConfig::forCircuit(QubitCount qubits, std::size_t memoryBudget) {
+    EngineConfig c;
+    c.qubits = qubits;
+
+    // half of the budget for the nodes of both unique tables, each costing
+    // its slot in the table besides itself
+    c.gcNodes = std::max(memoryBudget / 2 / (sizeof(mNode) + sizeof(std::uint64_t)),
+                         INITIAL_ALLOCATION_SIZE);
+    c.nodeMemory = std::max(memoryBudget / 2, 4 * SLAB_BYTES);
+
+    // the other half for the compute caches, assuming every level is reached
+    std::size_t cacheBudget = memoryBudget / 2;
+#ifdef isMT
+    // half of that for the shared tier, the rest for the caches of each thread
+    std::size_t sharedPerIndex = 2 * TieredAddCache::sharedEntryBytes() +
+                                 3 * 4 * TieredMulCache::sharedEntryBytes();
+    c.sharedCacheBuckets = std::max(floorPow2(cacheBudget / 2 / sharedPerIndex), std::size_t{1024});
+    cacheBudget = cacheBudget / 2 / (WORKERS + 1);
+#endif
+#ifdef FLAT_CACHE
+    std::size_t perIndex = 2 * AddCache::bucketBytes() + 3 * MulCache::bucketBytes();
+    c.cacheBuckets = std::max(floorPow2(cacheBudget / perIndex), std::size_t{1024});
+#else
+    // a filled slot costs its pointer and the bucket it points to
+    std::size_t perSlot = 2 * (sizeof(void *) + AddCache::bucketBytes()) +
+                          3 * (sizeof(void *) + MulCache::bucketBytes());
+    c.cacheBuckets = std::clamp(floorPow2(cacheBudget / perSlot / std::max(qubits, 1u)),
+                                std::size_t{256}, NBUCKETS);
+    c.cacheChunk = std::min(CACHE_CHUNK_SIZE, c.cacheBuckets * qubits);
+#endif
+    return c;
+}
+
+void configure(const EngineConfig &c) {
+    finishCollection();
+    config = c;
+    nodeBudget.cap = c.nodeMemory;
+    mUnique = mNodeTable(c.qubits, &nodeBudget, c.hugePages);
+    vUnique = vNodeTable(c.qubits, &nodeBudget, c.hugePages);
+    identityTable.assign(c.qubits, mEdge{});
+    cUnique.clear();
+    weightsKept = 0;
+#ifdef isMT
+    _aCache = TieredAddCache(c.qubits, c.cacheBuckets, c.cacheChunk, c.growthFactor,
+                             c.sharedCacheBuckets, c.cacheTiers);
+    _mCache = TieredMulCache(c.qubits, c.cacheBuckets, c.cacheChunk, c.growthFactor,
+                             c.sharedCacheBuckets, c.cacheTiers);
+#else
+    _aCache = AddCache(c.qubits, c.cacheBuckets, c.cacheChunk, c.growthFactor);
+    _mCache = MulCache(c.qubits, c.cacheBuckets, c.cacheChunk, c.growthFactor);
+#endif
+    gcEpoch = 0;
+    norms.clear();
+    GC_SIZE = c.gcNodes;
+}
+
+const EngineConfig &getConfig() { return config; }
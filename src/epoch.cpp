@@ -1,7 +1,10 @@
+#include <algorithm>
 #include <cassert>
 #include <iostream>
+#include <thread>
 #include "epoch.h"
 
+Epoch nodeEpoch;
 
 DeletionList::~DeletionList(){
     assert(deletionListCount == 0 && headDeletionList == nullptr);
@@ -35,7 +38,7 @@ void DeletionList::remove(DeleteEntry* label, DeleteEntry* prev){
     deleted += label->nodesCount;
 
 }
-void DeletionList::add(void *n, uint64_t globalEpoch) {
+void DeletionList::add(const Retired &n, uint64_t globalEpoch) {
     deletionListCount++;
     DeleteEntry* label;
     if (headDeletionList != nullptr && headDeletionList->nodesCount < headDeletionList->nodes.size()) {
@@ -62,93 +65,140 @@ DeleteEntry* DeletionList::head() {
     return headDeletionList;
 }
 
+void DeletionList::splice(DeletionList &other) {
+    while (other.headDeletionList != nullptr) {
+        DeleteEntry *label = other.headDeletionList;
+        other.headDeletionList = label->next;
+        label->next = headDeletionList;
+        headDeletionList = label;
+    }
+    deletionListCount += other.deletionListCount;
+    other.deletionListCount = 0;
+}
 
+std::size_t DeletionList::reclaim(uint64_t epoch) {
+    const uint64_t before = deleted;
+    DeleteEntry* cur = headDeletionList, *next, *prev = nullptr;
+    while (cur != nullptr) {
+        next = cur->next;
 
-void Epoch::enterEpoch(ThreadInfo& epochInfo) {
-    unsigned long curEpoch = currentEpoch.load(std::memory_order_relaxed);
-    epochInfo.getDeletionList().localEpoch.store(curEpoch, std::memory_order_release);
+        if (cur->epoch < epoch) {
+            for (std::size_t i = 0; i < cur->nodesCount; ++i) {
+                const Retired &r = cur->nodes[i];
+                r.reclaim(r.owner, r.node);
+            }
+            remove(cur, prev);
+        } else {
+            prev = cur;
+        }
+        cur = next;
+    }
+    return deleted - before;
 }
 
-void Epoch::markNodeForDeletion(void* n, ThreadInfo& epochInfo) {
-    epochInfo.getDeletionList().add(n, currentEpoch.load());
-    epochInfo.getDeletionList().thresholdCounter++;
+
+ThreadInfo &Epoch::threadInfo() {
+    for (auto &[epoch, info] : registration.infos) {
+        if (epoch == this) {
+            return *info;
+        }
+    }
+    ThreadInfo *info = new ThreadInfo();
+    {
+        std::lock_guard<std::mutex> lock(threadsMutex);
+        threads.push_back(info);
+    }
+    registration.infos.emplace_back(this, info);
+    return *info;
+}
+
+void Epoch::leave(ThreadInfo *info) {
+    assert(info->depth == 0);
+    std::lock_guard<std::mutex> lock(threadsMutex);
+    threads.erase(std::find(threads.begin(), threads.end(), info));
+    orphans.splice(info->deletionList);
+    delete info;
 }
 
-void Epoch::exitEpochAndCleanup(ThreadInfo& epochInfo) {
-    DeletionList& deletionList = epochInfo.getDeletionList();
-    if ((deletionList.thresholdCounter & (64 - 1)) == 1) {
-        currentEpoch++;
+Epoch::Registration::~Registration() {
+    for (auto &[epoch, info] : infos) {
+        epoch->leave(info);
     }
-    if (deletionList.thresholdCounter > startGCThreshhold) {
-        if (deletionList.size() == 0) {
-            deletionList.thresholdCounter = 0;
-            return;
-        }
-        deletionList.localEpoch.store(std::numeric_limits<uint64_t>::max());
+}
 
-        uint64_t oldestEpoch = std::numeric_limits<uint64_t>::max();
-        for (auto &epoch : deletionLists) {
-            auto e = epoch.localEpoch.load();
-            if (e < oldestEpoch) {
-                oldestEpoch = e;
-            }
-        }
+void Epoch::enterEpoch(ThreadInfo& info) {
+    if (info.depth++ == 0) {
+        // seq_cst, so that synchronize() either sees this thread inside or
+        // the thread sees everything published before the epoch advanced
+        info.localEpoch.store(currentEpoch.load());
+    }
+}
 
-        DeleteEntry* cur = deletionList.head(), *next, *prev = nullptr;
-        while (cur != nullptr) {
-            next = cur->next;
-
-            if (cur->epoch < oldestEpoch) {
-                for (std::size_t i = 0; i < cur->nodesCount; ++i) {
-                    delete (cur->nodes[i]);
-                }
-                deletionList.remove(cur, prev);
-            } else {
-                prev = cur;
-            }
-            cur = next;
-        }
-        deletionList.thresholdCounter = 0;
+void Epoch::exitEpoch(ThreadInfo& info) {
+    if (--info.depth == 0) {
+        info.localEpoch.store(ThreadInfo::QUIESCENT, std::memory_order_release);
     }
 }
 
+void Epoch::markNodeForDeletion(const Retired &n) {
+    threadInfo().deletionList.add(n, currentEpoch.load());
+}
 
-Epoch::~Epoch() {
-    uint64_t oldestEpoch = std::numeric_limits<uint64_t>::max();
-    for (auto &epoch : deletionLists) {
-        auto e = epoch.localEpoch.load();
-        if (e < oldestEpoch) {
-            oldestEpoch = e;
-        }
+uint64_t Epoch::oldestEpoch() {
+    uint64_t oldest = ThreadInfo::QUIESCENT;
+    std::lock_guard<std::mutex> lock(threadsMutex);
+    for (ThreadInfo *info : threads) {
+        oldest = std::min(oldest, info->localEpoch.load());
     }
-    for (auto &d : deletionLists) {
-        DeleteEntry* cur = d.head(), *next, *prev = nullptr;
-        while (cur != nullptr) {
-            next = cur->next;
+    return oldest;
+}
 
-            assert(cur->epoch < oldestEpoch);
-            for (std::size_t i = 0; i < cur->nodesCount; ++i) {
-                delete cur->nodes[i];
-            }
-            d.remove(cur, prev);
-            cur = next;
-        }
+void Epoch::synchronize() {
+    const uint64_t epoch = ++currentEpoch;
+    while (oldestEpoch() < epoch) {
+        std::this_thread::yield();
     }
 }
 
-void Epoch::showDeleteRatio() {
-    for (auto &d : deletionLists) {
-        std::cout << "deleted " << d.deleted << " of " << d.added << std::endl;
+std::size_t Epoch::cleanup() {
+    DeletionList &deletionList = threadInfo().deletionList;
+    const uint64_t oldest = oldestEpoch();
+    std::size_t reclaimed = 0;
+    if (deletionList.size() != 0) {
+        reclaimed += deletionList.reclaim(oldest);
+    }
+    std::lock_guard<std::mutex> lock(threadsMutex);
+    if (orphans.size() != 0) {
+        reclaimed += orphans.reclaim(oldest);
     }
+    return reclaimed;
 }
 
-ThreadInfo::ThreadInfo(Epoch &epoch)
-        : epoch(epoch), deletionList(epoch.deletionLists.local()) { }
 
-DeletionList &ThreadInfo::getDeletionList() const {
-    return deletionList;
+Epoch::~Epoch() {
+    // the threads that used this Epoch are done with it, but the calling
+    // one has not exited
+    std::vector<std::pair<Epoch *, ThreadInfo *>> &infos = registration.infos;
+    infos.erase(std::remove_if(infos.begin(), infos.end(),
+                               [this](const auto &r) { return r.first == this; }),
+                infos.end());
+    for (ThreadInfo *info : threads) {
+        orphans.splice(info->deletionList);
+        delete info;
+    }
+    DeleteEntry* cur = orphans.head(), *next;
+    while (cur != nullptr) {
+        next = cur->next;
+        // the owners may be gone already, so nothing is reclaimed
+        orphans.remove(cur, nullptr);
+        cur = next;
+    }
 }
 
-Epoch& ThreadInfo::getEpoch() const {
-    return epoch;
+void Epoch::showDeleteRatio() {
+    std::lock_guard<std::mutex> lock(threadsMutex);
+    for (ThreadInfo *info : threads) {
+        std::cout << "deleted " << info->deletionList.deleted << " of "
+                  << info->deletionList.added << std::endl;
+    }
 }
@@ -1,11 +1,17 @@
 
 #if defined(__linux__)
+#include <dirent.h>
 #include <sched.h>
 #endif
 
 #include "task.h"
+#include "fiber_stack.hpp"
+#include <algorithm>
+#include <cctype>
 #include <chrono>
+#include <cstring>
 #include <iostream>
+#include <string>
 #include <table.hpp>
 
 #include <random>
@@ -18,66 +24,106 @@
 
 using namespace std::chrono_literals;
 
+oneapi::tbb::enumerable_thread_specific<duration_micro> steal_timer;
+
 namespace boost {
 namespace fibers {
 namespace algo {
 
-std::atomic<std::uint32_t> my_ws::counter_{0};
-std::vector<intrusive_ptr<my_ws>> my_ws::schedulers_{};
-
-void my_ws::init_(std::uint32_t thread_count,
-                  std::vector<intrusive_ptr<my_ws>> &schedulers) {
-    // resize array of schedulers to thread_count, initilized with nullptr
-    std::vector<intrusive_ptr<my_ws>>{thread_count, nullptr}.swap(schedulers);
+// NUMA node of a logical cpu, 0 where the kernel does not tell
+static int numaNode(int cpu) {
+#if defined(__linux__)
+    std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    if (DIR *dir = opendir(path.c_str())) {
+        int node = 0;
+        while (dirent *entry = readdir(dir)) {
+            if (std::strncmp(entry->d_name, "node", 4) == 0 &&
+                std::isdigit(static_cast<unsigned char>(entry->d_name[4]))) {
+                node = std::atoi(entry->d_name + 4);
+                break;
+            }
+        }
+        closedir(dir);
+        return node;
+    }
+#endif
+    return 0;
 }
 
-my_ws::my_ws(std::uint32_t thread_count, bool suspend)
-    : id_{counter_++}, thread_count_{thread_count}, suspend_{suspend} {
-    static boost::fibers::detail::thread_barrier b{thread_count};
-    // initialize the array of schedulers
-    static std::once_flag flag;
-    std::call_once(flag, &my_ws::init_, thread_count_, std::ref(schedulers_));
+my_ws::my_ws(StealPool &pool, ReadyQueue kind, bool suspend)
+    : pool_{pool}, id_{pool.counter++}, node_{0}, kind_{kind}, suspend_{suspend} {
+#if defined(__linux__)
+    node_ = numaNode(sched_getcpu());
+#endif
     // register pointer of this scheduler
-    schedulers_[id_] = this;
-    b.wait();
+    pool_.schedulers[id_] = this;
+    pool_.barrier.wait();
+    for (std::uint32_t id = 0; id < pool_.schedulers.size(); id++) {
+        if (id != id_) {
+            (pool_.schedulers[id]->node_ == node_ ? near_ : far_).push_back(id);
+        }
+    }
 }
 
 void my_ws::awakened(context *ctx) noexcept {
+    if (ReadyQueue::ChaseLev == kind_ && ctx->is_context(type::pinned_context)) {
+        ctx->ready_link(pqueue_);
+        return;
+    }
     if (!ctx->is_context(type::pinned_context)) {
         ctx->detach();
     }
-    rqueue_.push(ctx);
+    if (ReadyQueue::ChaseLev == kind_) {
+        wqueue_.push(ctx);
+    } else {
+        rqueue_.push(ctx);
+    }
+}
+
+// tries as many randomly chosen victims of ids as there are
+context *my_ws::steal_from(std::vector<std::uint32_t> const &ids) noexcept {
+    static thread_local std::minstd_rand generator{std::random_device{}()};
+    context *victim = nullptr;
+    for (std::size_t count = 0; nullptr == victim && count < ids.size(); count++) {
+        std::uniform_int_distribution<std::size_t> distribution{0, ids.size() - 1};
+        attempts_.fetch_add(1, std::memory_order_relaxed);
+        victim = pool_.schedulers[ids[distribution(generator)]]->steal();
+    }
+    return victim;
 }
 
 context *my_ws::pick_next() noexcept {
-    context *victim = rqueue_.pop();
-    // std::optional<context*> victim_opt = rqueue_.pop();
-    // context* victim{nullptr};
+    context *victim = nullptr;
+    if (ReadyQueue::ChaseLev == kind_) {
+        if (!pqueue_.empty()) {
+            victim = &pqueue_.front();
+            pqueue_.pop_front();
+            idle_ = 0;
+            return victim;
+        }
+        std::optional<context *> ctx = wqueue_.pop();
+        victim = ctx ? *ctx : nullptr;
+    } else {
+        victim = rqueue_.pop();
+    }
     if (nullptr != victim) {
-        // if ( victim_opt) {
-        //    victim = *victim_opt;
+        idle_ = 0;
         boost::context::detail::prefetch_range(victim, sizeof(context));
         if (!victim->is_context(type::pinned_context)) {
             context::active()->attach(victim);
         }
     } else {
-        std::uint32_t id = 0;
-        std::size_t count = 0, size = schedulers_.size();
-        static thread_local std::minstd_rand generator{std::random_device{}()};
-        std::uniform_int_distribution<std::uint32_t> distribution{
-            0, static_cast<std::uint32_t>(thread_count_ - 1)};
-        do {
-            do {
-                ++count;
-                // random selection of one logical cpu
-                // that belongs to the local NUMA node
-                id = distribution(generator);
-                // prevent stealing from own scheduler
-            } while (id == id_);
-            // steal context from other scheduler
-            victim = schedulers_[id]->steal();
-        } while (nullptr == victim && count < size);
+        {
+            TimerGuard timer;
+            // victims on the same NUMA node first, they share a cache
+            victim = steal_from(near_);
+            if (nullptr == victim) {
+                victim = steal_from(far_);
+            }
+        }
         if (nullptr != victim) {
+            idle_ = 0;
+            steals_.fetch_add(1, std::memory_order_relaxed);
             boost::context::detail::prefetch_range(victim, sizeof(context));
             BOOST_ASSERT(!victim->is_context(type::pinned_context));
             context::active()->attach(victim);
@@ -88,7 +134,15 @@ context *my_ws::pick_next() noexcept {
 
 void my_ws::suspend_until(
     std::chrono::steady_clock::time_point const &time_point) noexcept {
-    if (suspend_) {
+    if (!suspend_) {
+        // back off after a while without anything to run or steal, so idle
+        // workers do not starve the busy ones of an oversubscribed machine
+        if (++idle_ < SPIN_ROUNDS) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(100us);
+        }
+    } else {
         if ((std::chrono::steady_clock::time_point::max)() == time_point) {
             std::unique_lock<std::mutex> lk{mtx_};
             cnd_.wait(lk, [this]() { return flag_; });
@@ -114,6 +168,15 @@ void my_ws::notify() noexcept {
 } // namespace fibers
 } // namespace boost
 
+static double hitRatio(const TableStats &ts) {
+    std::size_t hits = 0, lookups = 0;
+    for (const LevelStats &s : ts.levels) {
+        hits += s.hits;
+        lookups += s.lookups;
+    }
+    return (1.0 * hits) / lookups;
+}
+
 void Scheduler::spawn() {
 
     for (int i = 0; i < _nworkers; i++) {
@@ -122,140 +185,152 @@ void Scheduler::spawn() {
 
         _workers[i]._thread = new std::thread(
             [this](int id) {
+#if defined(__linux__)
+                // pinned before my_ws looks up the NUMA node it runs on
+                unsigned cpus = std::max(std::thread::hardware_concurrency(), 1u);
+                cpu_set_t cpuset;
+                CPU_ZERO(&cpuset);
+                CPU_SET(id % cpus, &cpuset);
+                if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset)) {
+                    std::cout << "pthread_setaffinity_np failed" << std::endl;
+                    exit(1);
+                }
+#endif
                 boost::fibers::use_scheduling_algorithm<
-                    boost::fibers::algo::my_ws>(this->_nworkers + 1);
+                    boost::fibers::algo::my_ws>(this->_pool, this->_queue);
                 {
                     std::unique_lock<boost::fibers::mutex> lk(this->mtx_stop);
-                    this->cond_stop.wait(lk);
+                    this->cond_stop.wait(lk, [this] { return this->_stop; });
                 }
             },
             i);
     }
 
-#if defined(__linux__)
-    for (int i = 0; i < _nworkers; i++) {
-        cpu_set_t cpuset;
-        CPU_ZERO(&cpuset);
-        CPU_SET(i, &cpuset);
-        if (pthread_setaffinity_np(_workers[i]._thread->native_handle(),
-                                   sizeof(cpu_set_t), &cpuset)) {
-            std::cout << "pthread_setaffinity_np failed" << std::endl;
-            exit(1);
-        }
-    }
-#endif
-
     boost::fibers::use_scheduling_algorithm<boost::fibers::algo::my_ws>(
-        this->_nworkers + 1);
+        this->_pool, this->_queue);
 }
 
-Scheduler::Scheduler(int n, int gcfreq) : _nworkers(n), _gcfreq(gcfreq) {
+Scheduler::Scheduler(int n, int gcfreq, ReadyQueue queue)
+    : _nworkers(n), _gcfreq(gcfreq), _queue(queue), _pool(n + 1) {
 
     for (int i = 0; i < _nworkers; i++) {
         _workers.emplace_back(WorkerThread());
     }
+    steal_timer.clear();
     this->spawn();
 }
 
 Scheduler::~Scheduler() {
+    {
+        std::unique_lock<boost::fibers::mutex> lk(mtx_stop);
+        _stop = true;
+    }
     cond_stop.notify_all();
 
     for (WorkerThread &w : _workers) {
         w._thread->join();
+        delete w._thread;
     }
+    // the pool goes away with this, so the main thread leaves it
+    boost::fibers::use_scheduling_algorithm<boost::fibers::algo::round_robin>();
 
-    std::size_t add_lk = 0;
-    std::size_t add_h = 0;
-    std::size_t mul_lk = 0;
-    std::size_t mul_h = 0;
-#ifdef CACHE
+    std::cout << "add cache hit ratio: " << hitRatio(getStats().addCache) << std::endl;
+    std::cout << "mul cache hit ratio: " << hitRatio(getStats().mulCache) << std::endl;
+}
 
-    for (AddCache &c : _aCache) {
-        add_lk += c.lookups;
-        add_h += c.hits;
+StealStats Scheduler::stealStats() const {
+    StealStats stats;
+    for (const auto &ws : _pool.schedulers) {
+        stats.attempts += ws->steal_attempts();
+        stats.steals += ws->steals();
     }
-    for (MulCache &c : _mCache) {
-        mul_lk += c.lookups;
-        mul_h += c.hits;
-    }
-#endif
-#ifdef CACHE_GLOBAL
-    add_lk = _aCache_global.lookups;
-    add_h = _aCache_global.hits;
-    mul_lk = _mCache_global.lookups;
-    mul_h = _mCache_global.hits;
-#endif
-    std::cout << "add cache hit ratio: " << (1.0 * add_h) / add_lk << std::endl;
-    std::cout << "mul cache hit ratio: " << (1.0 * mul_h) / mul_lk << std::endl;
+    stats.time = steal_timer.combine(std::plus<duration_micro>());
+    return stats;
 }
 
 void Scheduler::addGate(const mEdge &e) { _gates.emplace_back(e); }
 
-void Scheduler::clearCache() {
-#ifdef CACHE
-    for (auto _alocal : _aCache) {
-        // _alocal.hitRatio();
-        _alocal.clearAll();
-    }
-    for (auto _mlocal : _mCache) {
-        //_mlocal.hitRatio();
-        _mlocal.clearAll();
-    }
-#endif
-#ifdef CACHE_GLOBAL
-    _aCache_global.clearAll();
-    _mCache_global.clearAll();
-#endif
-}
-
-vEdge Scheduler::buildCircuit(vEdge input) {
+vEdge Scheduler::buildCircuit(vEdge input, const std::vector<vEdge> &keep,
+                              const std::vector<mEdge> &keepGates) {
 
     vEdge v = input;
 
-    for (auto i = 0; i < _gates.size(); i++) {
+    std::vector<mEdge> gates = fuseGates(_gates);
+    // the added gates stay usable after the fused ones are applied
+    std::vector<mEdge> roots = _gates;
+    if (gates.size() != _gates.size()) {
+        roots.insert(roots.end(), gates.begin(), gates.end());
+    }
+    roots.insert(roots.end(), keepGates.begin(), keepGates.end());
+
+    for (std::size_t i = 0; i < gates.size(); i++) {
         //        if(i%100==0)
         //          std::cout << "### " << i << " ###\n";
-        v = mv_multiply(_gates[i], v);
+        v = mv_multiply(gates[i], v);
 
+        // collects once the live nodes reach gcNodes, next to the gates
+        // applied meanwhile
         if (i % _gcfreq == 0 && i) {
-            std::cout << "gc" << std::endl;
-            //            v.incRef();
-            //            vUnique.gc();
-            //            v.decRef();
-            vNodeTable new_table(NQUBITS);
-            makeUniqueForV(v, new_table);
-            vUnique = std::move(new_table);
-            clearCache();
+            v = gcConcurrently(v, roots, keep);
         }
     }
+    // nothing collects behind the caller's back once this returns
+    finishGcConcurrently();
 
     return v;
 }
+/*
+ * Product g[hi - 1] * ... * g[lo]. Ranges of at most leaf gates are folded
+ * in order, longer ones are split in halves whose products are built at
+ * the same time, the upper one on a fiber an idle worker may steal.
+ */
+static mEdge multiplyRange(const std::vector<mEdge> &g, std::size_t lo, std::size_t hi,
+                           std::size_t leaf) {
+    if (hi - lo <= leaf) {
+        mEdge rhs = g[lo];
+        for (std::size_t i = lo + 1; i < hi; i++) {
+            rhs = mm_multiply(g[i], rhs);
+        }
+        return rhs;
+    }
+
+    std::size_t mid = lo + (hi - lo) / 2;
+    mEdge upper;
+    // the products recurse through every level of the gates on the fiber
+    boost::fibers::fiber fork(boost::fibers::launch::post, std::allocator_arg,
+                              ReusedStack(fiberStackSize(g[lo].getVar())),
+                              [&] { upper = multiplyRange(g, mid, hi, leaf); });
+    mEdge lower = multiplyRange(g, lo, mid, leaf);
+    fork.join();
+    return mm_multiply(upper, lower);
+}
+
 mEdge Scheduler::buildUnitary(const std::vector<mEdge> &g) {
 
     if (g.size() == 0) {
         return mEdge();
     }
 
-    mEdge rhs = g[0];
-    for (int i = 1; i < g.size(); i++) {
-        // std::cout<<"i: "<<i<<std::endl;
+    // about two ranges per thread, few enough that the larger products of
+    // the tree stay a small part of the work
+    std::size_t leaf = std::max<std::size_t>(g.size() / (2 * (_nworkers + 1)), 1);
+
+    // The first range is folded in order either way. Joining two products
+    // of its size costs about its nodes squared, folding the next range
+    // into it its nodes times those of the gates, so the tree only pays off
+    // while the products have no more nodes than the gates they are made
+    // of, and dense unitaries keep being folded.
+    std::size_t first = std::min(leaf, g.size());
+    mEdge rhs = multiplyRange(g, 0, first, leaf);
+    std::size_t gateNodes = 0;
+    for (std::size_t i = 0; i < first; i++) {
+        gateNodes += get_nNodes(g[i]);
+    }
+    if (first < g.size() && std::size_t(get_nNodes(rhs)) <= gateNodes) {
+        return mm_multiply(multiplyRange(g, first, g.size(), leaf), rhs);
+    }
+    for (std::size_t i = first; i < g.size(); i++) {
         rhs = mm_multiply(g[i], rhs);
     }
     return rhs;
 }
-
-void makeUniqueForV(vEdge &root, CHashTable<vNode> &v) {
-    if (root.isTerminal())
-        return;
-
-    makeUniqueForV(root.n->children[0], v);
-    makeUniqueForV(root.n->children[1], v);
-
-    vNode *n = v.getNode();
-    n->v = root.n->v;
-    n->children = root.n->children;
-    n = v.lookup(n);
-    root.n = n;
-    return;
-}
@@ -0,0 +1,39 @@
+#pragma once
+#include "common.h"
+#include "dd.h"
+#include <random>
+#include <vector>
+
+// Layers of RY rotations at random angles, each followed by a ladder of
+// CNOTs down the qubits.
+inline std::vector<mEdge> ryCxLayers(QubitCount n, int layers, std::uint64_t seed){
+    std::mt19937_64 mt(seed);
+    std::uniform_real_distribution<double> angle(0.0, 2 * PI);
+    std::vector<mEdge> gates;
+    for (int layer = 0; layer < layers; layer++) {
+        for (QubitCount q = 0; q < n; q++) {
+            gates.push_back(RY(n, q, angle(mt)));
+        }
+        for (QubitCount q = 1; q < n; q++) {
+            gates.push_back(CX(n, q, q - 1));
+        }
+    }
+    return gates;
+}
+
+inline std::vector<std_complex> amplitudes(const vEdge &v){
+    std::size_t dim;
+    std_complex *a = v.getVector(&dim);
+    std::vector<std_complex> result(a, a + dim);
+    delete[] a;
+    return result;
+}
+
+// of the dense vector, where squaredNorm(vEdge) walks the diagram
+inline double squaredNorm(const std::vector<std_complex> &amplitudes){
+    double norm = 0;
+    for (const std_complex &a : amplitudes) {
+        norm += a.r * a.r + a.i * a.i;
+    }
+    return norm;
+}
@@ -26,13 +26,13 @@ vEdge exec(int nQubits, bmpi::communicator &world){
     for (int target = 0; target < nQubits; target++){
         auto g = RX(nQubits, target, angle);
         v = mv_multiply_MPI(g, v, world);
-        v = gc(v);
+        v = gc(v, {});
     }
     angle = get_random();
     for (int target = 0; target < nQubits; target++){
         auto g = RZ(nQubits, target, angle);
         v = mv_multiply_MPI(g, v, world);
-        v = gc(v);
+        v = gc(v, {});
     }
 
     //entangler
@@ -41,7 +41,7 @@ vEdge exec(int nQubits, bmpi::communicator &world){
         int target = (i + 1) % nQubits;
         auto g = CX(nQubits, target, control);
         v = mv_multiply_MPI(g, v, world);
-        v = gc(v);
+        v = gc(v, {});
     }
 
     for (int k=0; k<8; k++){
@@ -50,20 +50,20 @@ vEdge exec(int nQubits, bmpi::communicator &world){
         for (int target = 0; target < nQubits; target++){
             auto g = RZ(nQubits, target, angle);
             v = mv_multiply_MPI(g, v, world);
-            v = gc(v);
+            v = gc(v, {});
         }
         angle = get_random();
         for (int target = 0; target < nQubits; target++)
         {
             auto g = RX(nQubits, target, angle);
             v = mv_multiply_MPI(g, v, world);
-            v = gc(v);
+            v = gc(v, {});
         }
         angle = get_random();
         for (int target = 0; target < nQubits; target++){
             auto g = RZ(nQubits, target, angle);
             v = mv_multiply_MPI(g, v, world);
-            v = gc(v);
+            v = gc(v, {});
         }
         //entangler
         for (int i = 0; i < nQubits; i++){
@@ -71,7 +71,7 @@ vEdge exec(int nQubits, bmpi::communicator &world){
             int target = (i + 1) % nQubits;
             auto g = CX(nQubits, target, control);
             v = mv_multiply_MPI(g, v, world);
-            v = gc(v);
+            v = gc(v, {});
         }
         if(world.rank()==0)
             std::cout << k+1 << " th iteration" << std::endl;
@@ -81,13 +81,13 @@ vEdge exec(int nQubits, bmpi::communicator &world){
     for (int target = 0; target < nQubits; target++){
         auto g = RZ(nQubits, target, angle);
         v = mv_multiply_MPI(g, v, world);
-        v = gc(v);
+        v = gc(v, {});
     }
     angle = get_random();
     for (int target = 0; target < nQubits; target++){
         auto g = RX(nQubits, target, angle);
         v = mv_multiply_MPI(g, v, world);
-        v = gc(v);
+        v = gc(v, {});
     }
     return v;
 }
@@ -105,13 +105,13 @@ vEdge exec(int nQubits){
     for (int target = 0; target < nQubits; target++){
         auto g = RX(nQubits, target, angle);
         v = mv_multiply(g, v);
-        v = gc(v);
+        v = gc(v, {});
     }
     angle = get_random();
     for (int target = 0; target < nQubits; target++){
         auto g = RZ(nQubits, target, angle);
         v = mv_multiply(g, v);
-        v = gc(v);
+        v = gc(v, {});
     }
     std::cout << "First rotation" << std::endl;
 
@@ -121,7 +121,7 @@ vEdge exec(int nQubits){
         int target = (i + 1) % nQubits;
         auto g = CX(nQubits, target, control);
         v = mv_multiply(g, v);
-        v = gc(v);
+        v = gc(v, {});
     }
     std::cout << "Entangler" << std::endl;
 
@@ -131,7 +131,7 @@ vEdge exec(int nQubits){
         for (int target = 0; target < nQubits; target++){
             auto g = RZ(nQubits, target, angle);
             v = mv_multiply(g, v);
-            v = gc(v);
+            v = gc(v, {});
         }
         std::cout << "mid rotation (1) " << k << std::endl;
         angle = get_random();
@@ -139,14 +139,14 @@ vEdge exec(int nQubits){
         {
             auto g = RX(nQubits, target, angle);
             v = mv_multiply(g, v);
-            v = gc(v);
+            v = gc(v, {});
         }
         std::cout << "mid rotation (2) " << k << std::endl;
         angle = get_random();
         for (int target = 0; target < nQubits; target++){
             auto g = RZ(nQubits, target, angle);
             v = mv_multiply(g, v);
-            v = gc(v);
+            v = gc(v, {});
         }
         std::cout << "mid rotation (3) " << k << std::endl;
         //entangler
@@ -155,7 +155,7 @@ vEdge exec(int nQubits){
             int target = (i + 1) % nQubits;
             auto g = CX(nQubits, target, control);
             v = mv_multiply(g, v);
-            v = gc(v);
+            v = gc(v, {});
         }
         std::cout << "entangler " << k << std::endl;
     }
@@ -164,18 +164,22 @@ vEdge exec(int nQubits){
     for (int target = 0; target < nQubits; target++){
         auto g = RZ(nQubits, target, angle);
         v = mv_multiply(g, v);
-        v = gc(v);
+        v = gc(v, {});
     }
     angle = get_random();
     for (int target = 0; target < nQubits; target++){
         auto g = RX(nQubits, target, angle);
         v = mv_multiply(g, v);
-        v = gc(v);
+        v = gc(v, {});
     }
     return v;
 }
 
 int main(int argc, char** argv){
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " nQubits" << std::endl;
+        return 1;
+    }
     auto start = std::chrono::high_resolution_clock::now();
     
     auto v = exec(std::atoi(argv[1]));
@@ -2,6 +2,13 @@
 
 #include "common.h"
 #include "dd.h"
+#include "table.hpp"
+#include "common.hpp"
+#include <random>
+#ifdef isMT
+#include "task.h"
+#include <thread>
+#endif
 
 bool isNearlyEqual(std_complex lhs, std::complex<double> rhs){
     // Here, tolerance is larger than dd.h
@@ -208,7 +215,7 @@ TEST(QddTest, InitialStateTest){
         size_t dim;
         std_complex *vec = v.getVector(&dim);
         ASSERT_TRUE(vec[0] == (std::complex<double>(1.0, 0.0)));
-        for(int i=1; i<dim; i++)
+        for(std::size_t i=1; i<dim; i++)
             ASSERT_TRUE(vec[i] == (std::complex<double>(0.0, 0.0)));
     }
     {
@@ -216,7 +223,7 @@ TEST(QddTest, InitialStateTest){
         vEdge v = makeOneState(2);
         size_t dim;
         std_complex *vec = v.getVector(&dim);
-        for(int i=0; i<dim-1; i++)
+        for(std::size_t i=0; i<dim-1; i++)
             ASSERT_TRUE(vec[i] == (std::complex<double>(0.0, 0.0)));
         ASSERT_TRUE(vec[3] == (std::complex<double>(1.0, 0.0)));
     }
@@ -336,7 +343,6 @@ TEST(QddTest, MeasureTest){
     }
 
     {
-        bool isZeroChecked = false, isOneChecked = false;
         std::map<char, int> resultmap{{'0',0},{'1',0}};
         for(int i=0;i<100;i++){
             vEdge state = makeZeroState(3);
@@ -352,6 +358,210 @@ TEST(QddTest, MeasureTest){
     
 }
 
+TEST(QddTest, CollapseTest){
+    const QubitCount n = 4;
+    std::mt19937_64 mt(0);
+    vEdge state = makeZeroState(n);
+    for (const mEdge &g : ryCxLayers(n, 1, 0)) {
+        state = mv_multiply(g, state);
+    }
+
+    // qubit 3 as 1 and qubit 1 as 0
+    vEdge collapsed = collapse(state, {3, 1}, "10");
+    std::vector<std_complex> before = amplitudes(state);
+    std::vector<std_complex> after = amplitudes(collapsed);
+    double p = 0;
+    for (std::size_t i = 0; i < before.size(); i++) {
+        if ((i >> 3 & 1) == 1 && (i >> 1 & 1) == 0) {
+            p += before[i].r * before[i].r + before[i].i * before[i].i;
+        }
+    }
+    for (std::size_t i = 0; i < before.size(); i++) {
+        bool kept = (i >> 3 & 1) == 1 && (i >> 1 & 1) == 0;
+        ASSERT_NEAR(after[i].r, kept ? before[i].r / std::sqrt(p) : 0, 1e-9);
+        ASSERT_NEAR(after[i].i, kept ? before[i].i / std::sqrt(p) : 0, 1e-9);
+    }
+    ASSERT_NEAR(squaredNorm(collapsed), 1.0, 1e-9);
+
+    // nothing below the measured qubit is rewritten
+    collapsed = collapse(state, {3}, "0");
+    ASSERT_EQ(collapsed.n->children[0].n, state.n->children[0].n);
+    ASSERT_TRUE(collapsed.n->children[1].w.isApproximatelyZero());
+
+    vEdge basis = mv_multiply(makeGate(n, Xmat, 0), makeZeroState(n));
+    ASSERT_THROW(collapse(basis, {0}, "0"), std::runtime_error);
+
+    // measured together, the qubits of a GHZ state agree
+    for (int i = 0; i < 20; i++) {
+        vEdge ghz = mv_multiply(makeGate(n, Hmat, 0), makeZeroState(n));
+        for (QubitCount q = 1; q < n; q++) {
+            ghz = mv_multiply(CX(n, q, 0), ghz);
+        }
+        std::string outcome = measureCollapsing(ghz, {0, 2}, mt);
+        ASSERT_TRUE(outcome == "00" || outcome == "11");
+        std::string all(n, outcome[0]);
+        ASSERT_EQ(measureAll(ghz, false, mt), all);
+    }
+}
+
+TEST(QddTest, ExpectationTest){
+    const QubitCount n = 4;
+    std::mt19937_64 mt(0);
+    std::uniform_real_distribution<double> angle(0.0, 2 * PI);
+    vEdge state = makeZeroState(n);
+    for (QubitCount q = 0; q < n; q++) {
+        state = mv_multiply(makeGate(n, u3(angle(mt), angle(mt), angle(mt)), q), state);
+    }
+    state = mv_multiply(CX(n, 2, 0), state);
+    state = mv_multiply(CX(n, 3, 1), state);
+
+    std::vector<std::complex<double>> v;
+    for (const std_complex &a : amplitudes(state)) {
+        v.emplace_back(a.r, a.i);
+    }
+    const std::size_t dim = v.size();
+
+    // bit k of the index is qubits[k]
+    const std::vector<Qubit> qubits{2, 0};
+    std::vector<double> marginal = marginalProbabilities(state, qubits);
+    ASSERT_EQ(marginal.size(), 4);
+    std::vector<double> expected(4, 0.0);
+    for (std::size_t i = 0; i < dim; i++) {
+        expected[(i >> 2 & 1) | (i & 1) << 1] += std::norm(v[i]);
+    }
+    for (std::size_t j = 0; j < 4; j++) {
+        ASSERT_NEAR(marginal[j], expected[j], 1e-9);
+    }
+    ASSERT_EQ(marginalProbabilities(state, {}), std::vector<double>{1.0});
+
+    std::complex<double> self = innerProduct(state, state);
+    ASSERT_NEAR(self.real(), squaredNorm(state), 1e-9);
+    ASSERT_NEAR(self.imag(), 0.0, 1e-9);
+
+    // the highest qubit first
+    auto dense = [&](const std::string &pauli) {
+        std::complex<double> sum = 0;
+        for (std::size_t i = 0; i < dim; i++) {
+            std::size_t j = i;
+            std::complex<double> phase = 1;
+            for (std::size_t k = 0; k < n; k++) {
+                const std::size_t q = n - 1 - k;
+                const std::size_t bit = i >> q & 1;
+                if (pauli[k] == 'X' || pauli[k] == 'Y') {
+                    j ^= std::size_t{1} << q;
+                }
+                if (pauli[k] == 'Y') {
+                    phase *= bit == 0 ? std::complex<double>(0, 1) : std::complex<double>(0, -1);
+                } else if (pauli[k] == 'Z' && bit == 1) {
+                    phase = -phase;
+                }
+            }
+            sum += std::conj(v[j]) * phase * v[i];
+        }
+        return sum.real();
+    };
+    // flips above identities pair different nodes below them
+    for (const std::string pauli : {"XIYZ", "XIII", "IYII", "XIIX", "IXIZ"}) {
+        ASSERT_NEAR(expectation(state, pauli), dense(pauli), 1e-9);
+    }
+
+    ASSERT_NEAR(expectation(state, "IIZI"), expectation(state, makeGate(n, Zmat, 1)), 1e-9);
+    ASSERT_NEAR(expectation(state, "IIII"), 1.0, 1e-9);
+    ASSERT_THROW(expectation(state, "XZ"), std::runtime_error);
+    ASSERT_THROW(expectation(state, "IIAI"), std::runtime_error);
+}
+
+TEST(QddTest, SampleShotsTest){
+    const QubitCount n = 4;
+    std::mt19937_64 mt(0);
+    vEdge state = makeZeroState(n);
+    for (const mEdge &g : ryCxLayers(n, 1, 0)) {
+        state = mv_multiply(g, state);
+    }
+    state = mv_multiply(makeGate(n, Xmat, 2), state);
+
+    const std::size_t shots = 100000;
+    std::map<std::string, std::size_t> counts = sampleShots(state, shots, 42);
+    ASSERT_EQ(counts, sampleShots(state, shots, 42));
+
+    std::vector<std_complex> a = amplitudes(state);
+    std::size_t total = 0;
+    for (const auto &[outcome, count] : counts) {
+        ASSERT_EQ(outcome.size(), n);
+        std::size_t i = std::stoul(outcome, nullptr, 2);
+        double p = a[i].r * a[i].r + a[i].i * a[i].i;
+        ASSERT_GT(p, 0);
+        ASSERT_NEAR(double(count) / shots, p, 0.01);
+        total += count;
+    }
+    ASSERT_EQ(total, shots);
+
+    // the same keys as measureAll
+    vEdge basis = mv_multiply(makeGate(n, Xmat, 0), makeZeroState(n));
+    std::map<std::string, std::size_t> one = sampleShots(basis, 10, 0);
+    ASSERT_EQ(one.size(), 1);
+    ASSERT_EQ(one.begin()->first, measureAll(basis, false, mt));
+    ASSERT_EQ(one.begin()->second, 10);
+}
+
+TEST(QddTest, BranchingTest){
+    const QubitCount n = 3;
+    const std::size_t shots = 100000;
+
+    // a measured qubit copied by a classically controlled X
+    std::vector<CircuitOp> ops{CircuitOp::gate(Hmat, 0), CircuitOp::measure(0, 0),
+                               CircuitOp::gate(Xmat, 1), CircuitOp::measure(1, 1)};
+    ops[2].condition = {0};
+    std::map<std::string, std::size_t> counts = simulateBranching(n, 2, ops, shots, 42);
+    ASSERT_EQ(counts, simulateBranching(n, 2, ops, shots, 42));
+    ASSERT_EQ(counts.size(), 2);
+    ASSERT_NEAR(double(counts["00"]) / shots, 0.5, 0.01);
+    ASSERT_EQ(counts["00"] + counts["11"], shots);
+
+    // the highest classical bit first, and measuring again changes nothing
+    const double theta = 1.0;
+    ops = {CircuitOp::gate(ry(theta), 2), CircuitOp::measure(2, 0), CircuitOp::measure(2, 2),
+           CircuitOp::gate(makeSwap(n, 1, 2)), CircuitOp::measure(1, 1)};
+    counts = simulateBranching(n, 3, ops, shots, 7);
+    ASSERT_EQ(counts.size(), 2);
+    ASSERT_NEAR(double(counts["111"]) / shots, std::sin(theta / 2) * std::sin(theta / 2), 0.01);
+    ASSERT_EQ(counts["000"] + counts["111"], shots);
+
+    // a reset qubit is 0 on every branch, and gates after it see that
+    ops = {CircuitOp::gate(Hmat, 0), CircuitOp::gate(Xmat, 1, {Control{0, Control::Type::pos}}),
+           CircuitOp::reset(0), CircuitOp::measure(0, 0), CircuitOp::measure(1, 1)};
+    counts = simulateBranching(n, 2, ops, shots, 3);
+    ASSERT_EQ(counts.size(), 2);
+    ASSERT_NEAR(double(counts["10"]) / shots, 0.5, 0.01);
+    ASSERT_EQ(counts["00"] + counts["10"], shots);
+
+    ASSERT_TRUE(simulateBranching(n, 2, ops, 0, 3).empty());
+}
+
+TEST(QddTest, SquaredNormTest){
+    const QubitCount n = 4;
+    auto expected = [](const vEdge &e) { return squaredNorm(amplitudes(e)); };
+
+    vEdge plus = makeZeroState(n);
+    for (QubitCount q = 0; q < n; q++) {
+        plus = mv_multiply(makeGate(n, Hmat, q), plus);
+    }
+    vEdge sum = vv_add(plus, makeZeroState(n));
+    ASSERT_NEAR(squaredNorm(plus), 1.0, 1e-9);
+    ASSERT_NEAR(squaredNorm(sum), expected(sum), 1e-9);
+    ASSERT_NEAR(squaredNorm(sum), expected(sum), 1e-9);
+
+    // the nodes of plus and sum are freed and handed out again for states
+    // of other norms
+    collectGarbage({}, {});
+    vEdge scaled = vv_add(makeOneState(n), makeOneState(n));
+    for (QubitCount q = 0; q < n; q += 2) {
+        scaled = mv_multiply(RY(n, q, 0.3), scaled);
+    }
+    ASSERT_NEAR(squaredNorm(scaled), 4.0, 1e-9);
+    ASSERT_NEAR(squaredNorm(scaled), expected(scaled), 1e-9);
+}
+
 TEST(QddTest, DotTest){
     {
         vEdge state = makeZeroState(2);
@@ -360,3 +570,513 @@ TEST(QddTest, DotTest){
         std::string dot = genDot(state);
     }
 }
+
+TEST(QddTest, GCTest){
+    const QubitCount n = 4;
+    vEdge state = makeZeroState(n);
+    for (QubitCount q = 0; q < n; q++) {
+        state = mv_multiply(makeGate(n, Hmat, q), state);
+    }
+    mEdge cx = CX(n, 1, 0);
+    state = mv_multiply(makeGate(n, Tmat, 0), state);
+    state = mv_multiply(cx, state);
+
+    size_t dim;
+    std_complex *before = state.getVector(&dim);
+
+    collectGarbage({state}, {cx});
+    ASSERT_EQ(vUnique.get_live_nodes(), get_nNodes(state));
+
+    // the surviving state and gate are untouched and still usable
+    std_complex *after = state.getVector(&dim);
+    for (size_t i = 0; i < dim; i++) {
+        ASSERT_TRUE(before[i] == after[i]);
+    }
+    vEdge back = mv_multiply(cx, state);
+    vEdge again = mv_multiply(cx, back);
+    std_complex *vec = again.getVector(&dim);
+    for (size_t i = 0; i < dim; i++) {
+        ASSERT_TRUE(vec[i].isApproximatelyEqual(before[i]));
+    }
+
+    // nothing is reachable from an empty root set except the identities
+    collectGarbage({}, {});
+    ASSERT_EQ(vUnique.get_live_nodes(), 0);
+}
+
+TEST(QddTest, GCCacheTest){
+    const QubitCount n = 3;
+    mEdge h = makeGate(n, Hmat, 1);
+    vEdge state = makeZeroState(n);
+    vEdge result = mv_multiply(h, state);
+    size_t dim;
+    std_complex *expected = result.getVector(&dim);
+
+    // the cached product is freed, and its nodes are reused by other states
+    collectGarbage({state}, {h});
+    for (QubitCount q = 0; q < n; q++) {
+        state = mv_multiply(makeGate(n, Xmat, q), state);
+    }
+    state = makeZeroState(n);
+
+    std_complex *vec = mv_multiply(h, state).getVector(&dim);
+    for (size_t i = 0; i < dim; i++) {
+        ASSERT_TRUE(vec[i].isApproximatelyEqual(expected[i]));
+    }
+}
+
+TEST(QddTest, ArenaTest){
+    SlabBudget budget{4 * SLAB_BYTES};
+    vNodeTable table(2, &budget);
+    const std::size_t perSlab = NodeArena<vNode>::PER_SLAB;
+    std::vector<vNode *> nodes;
+    for (std::size_t i = 0; i < 2 * perSlab + 1; i++) {
+        vNode *node = table.getNode();
+        node->v = 1;
+        node->children = {vEdge{{static_cast<double>(i), 0.0}, vNode::terminal}, vEdge::zero};
+        nodes.push_back(table.lookup(node));
+    }
+    ASSERT_EQ(budget.used, 3 * SLAB_BYTES);
+    for (vNode *node : {nodes.front(), nodes.back(), vNode::terminal}) {
+        ASSERT_EQ(NodeArena<vNode>::node(NodeArena<vNode>::handle(node)), node);
+    }
+    ASSERT_EQ(NodeArena<vNode>::handle(vNode::terminal), TERMINAL);
+
+    // only the slab nodes are still bumped off is kept
+    ASSERT_EQ(table.sweep(), 2 * perSlab + 1);
+    ASSERT_EQ(table.takeReleasedSlabs(), 2);
+    ASSERT_EQ(budget.used, SLAB_BYTES);
+
+    // a live node keeps its slab mapped, the one after it is emptied
+    vNode *kept = table.getNode();
+    kept->v = 0;
+    vNodeTable::mark(kept);
+    for (std::size_t i = 0; i < 2 * perSlab; i++) {
+        table.getNode()->v = 0;
+    }
+    ASSERT_EQ(table.sweep(), 2 * perSlab);
+    ASSERT_EQ(table.takeReleasedSlabs(), 1);
+    ASSERT_EQ(budget.used, 2 * SLAB_BYTES);
+
+    // the cap is hard
+    ASSERT_THROW(
+        for (std::size_t i = 0; i < 4 * perSlab; i++) { table.getNode(); },
+        std::bad_alloc);
+    ASSERT_EQ(budget.used, 4 * SLAB_BYTES);
+}
+
+TEST(QddTest, WeightTableTest){
+    ComplexTable table;
+    const double tol = Complex::TOLERANCE;
+    const Complex a = table.lookup({0.3, -0.7});
+    ASSERT_TRUE(a == Complex(0.3, -0.7));
+    // rounding noise on either side snaps to the value seen first
+    for (double d : {tol / 2, -tol / 2, 0.9 * tol, -0.9 * tol}) {
+        ASSERT_TRUE(table.lookup({0.3 + d, -0.7 - d}) == a);
+    }
+    ASSERT_FALSE(table.lookup({0.3 + 3 * tol, -0.7}) == a);
+    ASSERT_TRUE(table.lookup({-0.0, 1.0 - tol / 4}) == Complex(0.0, 1.0));
+
+    // the same state along two paths of rounding shares its nodes
+    const QubitCount n = 2;
+    for (double angle : {0.1, 0.7, 1.3, 2.9}) {
+        vEdge once = mv_multiply(RY(n, 0, 3 * angle), makeZeroState(n));
+        vEdge thrice = makeZeroState(n);
+        for (int i = 0; i < 3; i++) {
+            thrice = mv_multiply(RY(n, 0, angle), thrice);
+        }
+        ASSERT_EQ(once.n, thrice.n);
+    }
+}
+
+TEST(QddTest, ApplyGateTest){
+    const QubitCount n = 6;
+    std::mt19937_64 mt(0);
+    std::uniform_real_distribution<double> angle(0.0, 2 * PI);
+    vEdge state = makeZeroState(n);
+    for (const mEdge &g : ryCxLayers(n, 2, 1)) {
+        state = mv_multiply(g, state);
+    }
+
+    using Type = Control::Type;
+    std::vector<std::pair<Qubit, Controls>> cases{
+        {0, {}},
+        {3, {}},
+        {5, {}},
+        {2, {{4, Type::pos}}},
+        {4, {{1, Type::pos}}},
+        {3, {{0, Type::neg}, {5, Type::pos}}},
+        {2, {{0, Type::pos}, {1, Type::neg}, {4, Type::neg}}},
+        {0, {{1, Type::pos}, {2, Type::pos}, {3, Type::pos}, {4, Type::pos}, {5, Type::pos}}},
+    };
+    for (const auto &[target, controls] : cases) {
+        for (const GateMatrix &g : {Hmat, Xmat, Tmat, rz(angle(mt)), ry(angle(mt)),
+                                    u3(angle(mt), angle(mt), angle(mt))}) {
+            std::vector<std_complex> expected = amplitudes(mv_multiply(makeGate(n, g, target, controls), state));
+            std::vector<std_complex> actual = amplitudes(applyGate(state, g, target, controls));
+            for (std::size_t i = 0; i < actual.size(); i++) {
+                ASSERT_TRUE(actual[i].isApproximatelyEqual(expected[i]));
+            }
+        }
+    }
+
+    // on a basis state, where most of the state is the zero edge
+    vEdge zero = makeZeroState(n);
+    std::vector<std_complex> expected = amplitudes(mv_multiply(makeGate(n, Xmat, 1, {{3, Type::neg}}), zero));
+    std::vector<std_complex> actual = amplitudes(applyGate(zero, Xmat, 1, {{3, Type::neg}}));
+    for (std::size_t i = 0; i < actual.size(); i++) {
+        ASSERT_TRUE(actual[i].isApproximatelyEqual(expected[i]));
+    }
+}
+
+TEST(QddTest, SwapTest){
+    const QubitCount n = 5;
+    for (auto [t0, t1] : {std::pair<Qubit, Qubit>{0, 1}, {3, 1}, {0, 4}, {2, 3}}) {
+        mEdge cx1 = makeGate(n, Xmat, t1, Controls{Control{t0, Control::Type::pos}});
+        mEdge cx2 = makeGate(n, Xmat, t0, Controls{Control{t1, Control::Type::pos}});
+        mEdge expected = mm_multiply(cx1, mm_multiply(cx2, cx1));
+        mEdge swap = makeSwap(n, t0, t1);
+        ASSERT_TRUE(swap.getEigenMatrix().isApprox(expected.getEigenMatrix()));
+        ASSERT_EQ(swap, makeSwap(n, t1, t0));
+    }
+}
+
+TEST(QddTest, FuseGatesTest){
+    const QubitCount n = 6;
+    auto simulate = [&](QubitCount span, std::size_t *applied) {
+        EngineConfig config;
+        config.qubits = n;
+        config.fusionSpan = span;
+        configure(config);
+        std::mt19937_64 mt(0);
+        std::uniform_real_distribution<double> angle(0.0, 2 * PI);
+        std::vector<mEdge> gates;
+        for (int layer = 0; layer < 3; layer++) {
+            for (QubitCount q = 0; q < n; q++) {
+                gates.push_back(RY(n, q, angle(mt)));
+                gates.push_back(RZ(n, q, angle(mt)));
+            }
+            for (Qubit q = 1; q < Qubit(n); q++) {
+                gates.push_back(CX(n, q, q - 1));
+            }
+            gates.push_back(makeGate(n, Hmat, 0, Controls{Control{5, Control::Type::neg}}));
+        }
+        std::vector<mEdge> fused = fuseGates(gates);
+        *applied = fused.size();
+        vEdge v = makeZeroState(n);
+        for (const mEdge &g : fused) {
+            v = mv_multiply(g, v);
+        }
+        return amplitudes(v);
+    };
+
+    std::size_t gates;
+    std::vector<std_complex> expected = simulate(0, &gates);
+    for (QubitCount span : {1u, 2u, 3u, n}) {
+        std::size_t applied;
+        std::vector<std_complex> actual = simulate(span, &applied);
+        ASSERT_LT(applied, gates);
+        for (std::size_t i = 0; i < actual.size(); i++) {
+            ASSERT_NEAR(actual[i].r, expected[i].r, 1e-9);
+            ASSERT_NEAR(actual[i].i, expected[i].i, 1e-9);
+        }
+    }
+    configure(EngineConfig{});
+}
+
+#ifdef isMT
+TEST(QddTest, ConcurrentTableTest){
+    vNodeTable table(2);
+    ComplexTable weights;
+    const std::size_t nodes = 4 * UT_INIT_SZ; // enough to grow the level
+    const int threads = 4;
+    std::vector<std::vector<vNode *>> found(threads, std::vector<vNode *>(nodes));
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            // every thread builds every node, starting at a different one
+            for (std::size_t k = 0; k < nodes; k++) {
+                std::size_t i = (k + t * nodes / threads) % nodes;
+                vNode *node = table.getNode();
+                node->v = 1;
+                Complex w = weights.lookup({1.0 / (i + 1), 0.0});
+                node->children = {vEdge{w, vNode::terminal}, vEdge::zero};
+                found[t][i] = table.lookup(node);
+            }
+        });
+    }
+    for (std::thread &w : workers) {
+        w.join();
+    }
+    for (int t = 1; t < threads; t++) {
+        ASSERT_EQ(found[t], found[0]);
+    }
+    ASSERT_EQ(table.get_live_nodes(), nodes);
+    std::size_t lookups = 0, hits = 0;
+    for (const LevelStats &s : table.stats().levels) {
+        lookups += s.lookups;
+        hits += s.hits;
+    }
+    ASSERT_EQ(lookups, threads * nodes);
+    ASSERT_EQ(hits, (threads - 1) * nodes);
+    // nodes parked in the allocation caches are not live
+    ASSERT_EQ(table.sweep(), nodes);
+}
+
+TEST(QddTest, ParallelMultiplyTest){
+    const QubitCount n = 8;
+    auto simulate = [&](Qubit forkLevel) {
+        EngineConfig config;
+        config.qubits = n;
+        config.forkLevel = forkLevel;
+        configure(config);
+        vEdge v = makeZeroState(n);
+        for (const mEdge &g : ryCxLayers(n, 3, 0)) {
+            v = mv_multiply(g, v);
+        }
+        return amplitudes(v);
+    };
+
+    std::vector<std_complex> expected = simulate(NO_FORK);
+    for (ReadyQueue queue : {ReadyQueue::Spinlock, ReadyQueue::ChaseLev}) {
+        Scheduler scheduler(3, INT32_MAX, queue);
+        for (Qubit forkLevel : {Qubit(n - 2), Qubit(0)}) {
+            std::vector<std_complex> actual = simulate(forkLevel);
+            for (std::size_t i = 0; i < actual.size(); i++) {
+                ASSERT_NEAR(actual[i].r, expected[i].r, 1e-9);
+                ASSERT_NEAR(actual[i].i, expected[i].i, 1e-9);
+            }
+        }
+        StealStats stats = scheduler.stealStats();
+        ASSERT_LE(stats.steals, stats.attempts);
+    }
+    configure(EngineConfig{});
+}
+
+// Forked sub-products recurse through every level below the fork on the
+// stack of their fiber.
+TEST(QddTest, ForkDepthTest){
+    const QubitCount n = 400;
+    EngineConfig config;
+    config.qubits = n;
+    config.forkLevel = n - 10;
+    configure(config);
+    Scheduler scheduler(1, INT32_MAX);
+    std::mt19937_64 mt(0);
+
+    vEdge v = mv_multiply(makeGate(n, Hmat, 0), makeZeroState(n));
+    for (Qubit q = 1; q < Qubit(n); q++) {
+        v = mv_multiply(CX(n, q, q - 1), v);
+    }
+    std::string outcome = measureAll(v, false, mt);
+    ASSERT_TRUE(outcome == std::string(n, '0') || outcome == std::string(n, '1'));
+
+    // qubits 0, 1 and n - 1 entangled, the rest left at 0
+    mEdge ladder = mm_multiply(CX(n, 1, 0), makeGate(n, Hmat, 0));
+    ladder = mm_multiply(CX(n, n - 1, 0), ladder);
+    v = mv_multiply(ladder, makeZeroState(n));
+    outcome = measureAll(v, false, mt);
+    ASSERT_EQ(outcome.substr(1, n - 3), std::string(n - 3, '0'));
+    ASSERT_EQ(outcome.front(), outcome.back());
+    configure(EngineConfig{});
+}
+
+TEST(QddTest, BuildUnitaryTest){
+    Scheduler scheduler(3, INT32_MAX);
+    const QubitCount n = 4;
+    std::vector<mEdge> gates = ryCxLayers(n, 5, 0);
+    mEdge folded = gates[0];
+    for (std::size_t i = 1; i < gates.size(); i++) {
+        folded = mm_multiply(gates[i], folded);
+    }
+    MatrixXcf expected = folded.getEigenMatrix();
+
+    for (Qubit forkLevel : {NO_FORK, Qubit(0)}) {
+        EngineConfig config;
+        config.forkLevel = forkLevel;
+        configure(config);
+        // configure() drops every edge, so each run makes the gates again
+        MatrixXcf actual = scheduler.buildUnitary(ryCxLayers(n, 5, 0)).getEigenMatrix();
+        ASSERT_TRUE(actual.isApprox(expected, 1e-5));
+    }
+    configure(EngineConfig{});
+}
+
+// The products of a wide circuit recurse through all of its levels on the
+// fibers of the tree.
+TEST(QddTest, WideUnitaryTest){
+    const QubitCount wide = 400;
+    EngineConfig config;
+    config.qubits = wide;
+    configure(config);
+    Scheduler single(1, INT32_MAX);
+    std::vector<mEdge> hadamards;
+    for (Qubit q = 0; q < 8; q++) {
+        hadamards.push_back(makeGate(wide, Hmat, q * 50));
+    }
+    vEdge v = mv_multiply(single.buildUnitary(hadamards), makeZeroState(wide));
+    ASSERT_NEAR(squaredNorm(v), 1.0, 1e-9);
+    ASSERT_EQ(get_nNodes(v), wide);
+    configure(EngineConfig{});
+}
+
+TEST(QddTest, ConcurrentGCTest){
+    const QubitCount n = 8;
+    auto simulate = [&](bool collect) {
+        EngineConfig config;
+        config.qubits = n;
+        config.forkLevel = collect ? Qubit(0) : NO_FORK;
+        configure(config);
+        std::vector<mEdge> gates = ryCxLayers(n, 1, 0);
+
+        // every layer leaves the states before it as garbage, which the
+        // collection started after it frees while the next layers run
+        std::vector<std::shared_future<std::size_t>> collections;
+        vEdge v = makeZeroState(n);
+        for (int layer = 0; layer < 6; layer++) {
+            for (const mEdge &g : gates) {
+                v = mv_multiply(g, v);
+            }
+            if (collect) {
+                collections.push_back(collectGarbageConcurrently({v}, gates));
+            }
+        }
+        std::size_t freed = 0;
+        for (auto &c : collections) {
+            freed += c.get();
+        }
+        return std::make_pair(amplitudes(v), freed);
+    };
+
+    std::vector<std_complex> expected = simulate(false).first;
+    Scheduler scheduler(3, INT32_MAX);
+    auto [actual, freed] = simulate(true);
+    ASSERT_GT(freed, 0);
+    for (std::size_t i = 0; i < actual.size(); i++) {
+        ASSERT_NEAR(actual[i].r, expected[i].r, 1e-9);
+        ASSERT_NEAR(actual[i].i, expected[i].i, 1e-9);
+    }
+    configure(EngineConfig{});
+}
+
+// Nodes retired by threads that have exited are reclaimed by the ones that
+// go on.
+TEST(QddTest, EpochTest){
+    Epoch epoch;
+    std::atomic<int> reclaimed{0};
+    int nodes[8];
+    Reclaim count = [](void *owner, void *) {
+        static_cast<std::atomic<int> *>(owner)->fetch_add(1);
+    };
+    for (int t = 0; t < 4; t++) {
+        std::thread([&] {
+            EpochGuard guard(epoch);
+            for (int &n : nodes) {
+                epoch.markNodeForDeletion({&n, &reclaimed, count});
+            }
+        }).join();
+    }
+    epoch.synchronize();
+    ASSERT_EQ(epoch.cleanup(), 4 * 8);
+    ASSERT_EQ(reclaimed, 4 * 8);
+    ASSERT_EQ(epoch.cleanup(), 0);
+}
+
+TEST(QddTest, BuildCircuitTest){
+    const QubitCount n = 8;
+    auto simulate = [&](bool circuit) {
+        EngineConfig config;
+        config.qubits = n;
+        // low enough that buildCircuit collects all along
+        config.gcNodes = 64;
+        configure(config);
+        Scheduler scheduler(3, 1);
+        std::vector<mEdge> gates = ryCxLayers(n, 6, 0);
+        vEdge v = makeZeroState(n);
+        if (circuit) {
+            // a state and a unitary of the caller's, kept through the collections
+            vEdge other = makeZeroState(n);
+            for (const mEdge &g : ryCxLayers(n, 2, 1)) {
+                other = mv_multiply(g, other);
+            }
+            std::vector<std_complex> before = amplitudes(other);
+            mEdge unitary = scheduler.buildUnitary(ryCxLayers(n, 2, 2));
+            MatrixXcf matrix = unitary.getEigenMatrix();
+
+            for (const mEdge &g : gates) {
+                scheduler.addGate(g);
+            }
+            v = scheduler.buildCircuit(v, {other}, {unitary});
+            // nodes freed by the collections are handed out again
+            vEdge fresh = makeZeroState(n);
+            for (const mEdge &g : ryCxLayers(n, 3, 3)) {
+                fresh = mv_multiply(g, fresh);
+            }
+            EXPECT_EQ(amplitudes(other), before);
+            EXPECT_TRUE(unitary.getEigenMatrix().isApprox(matrix));
+        } else {
+            for (const mEdge &g : gates) {
+                v = mv_multiply(g, v);
+            }
+        }
+        return amplitudes(v);
+    };
+
+    std::vector<std_complex> expected = simulate(false);
+    std::vector<std_complex> actual = simulate(true);
+    for (std::size_t i = 0; i < actual.size(); i++) {
+        ASSERT_NEAR(actual[i].r, expected[i].r, 1e-9);
+        ASSERT_NEAR(actual[i].i, expected[i].i, 1e-9);
+    }
+    configure(EngineConfig{});
+}
+#endif
+
+TEST(QddTest, StatsTest){
+    const QubitCount n = 3;
+    resetStats();
+    vEdge state = makeZeroState(n);
+    state = mv_multiply(makeGate(n, Hmat, 2), state);
+    state = mv_multiply(makeGate(n, Hmat, 2), state);
+
+    EngineStats stats = getStats();
+    ASSERT_EQ(stats.vUnique.levels.size(), getConfig().qubits);
+    for (const TableStats *ts : {&stats.vUnique, &stats.mUnique, &stats.mulCache}) {
+        std::size_t lookups = 0, chained = 0, hits = 0;
+        for (const LevelStats &s : ts->levels) {
+            ASSERT_LE(s.hits, s.lookups);
+            lookups += s.lookups;
+            hits += s.hits;
+            for (std::size_t c : s.chain) {
+                chained += c;
+            }
+        }
+        ASSERT_GT(lookups, 0);
+        ASSERT_EQ(chained, lookups);
+        ASSERT_GT(ts->bytes, 0);
+    }
+    // the second H rebuilds nodes that the zero state already has
+    ASSERT_GT(stats.vUnique.levels[2].hits, 0);
+    ASSERT_GT(stats.mulCache.levels[2].inserts, 0);
+}
+
+TEST(QddTest, ConfigTest){
+    // beyond the default NQUBITS levels
+    const QubitCount n = 300;
+    configure(EngineConfig::forCircuit(n, std::size_t{256} << 20));
+    ASSERT_EQ(getConfig().qubits, n);
+
+    vEdge state = makeZeroState(n);
+    state = mv_multiply(makeGate(n, Hmat, 0), state);
+    for (QubitCount q = 1; q < n; q++) {
+        state = mv_multiply(CX(n, q, q - 1), state);
+    }
+    std::mt19937_64 mt(0);
+    std::string result = measureAll(state, false, mt);
+    ASSERT_EQ(result.size(), n);
+    ASSERT_TRUE(result == std::string(n, '0') || result == std::string(n, '1'));
+    ASSERT_EQ(getStats().vUnique.levels.size(), n);
+
+    configure(EngineConfig{});
+    ASSERT_EQ(getStats().mulCache.levels.size(), NQUBITS);
+}
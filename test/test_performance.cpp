@@ -1,6 +1,15 @@
 #include "gtest/gtest.h"
 #include "dd.h"
 #include "common.h"
+#include "table.hpp"
+#include "cache.hpp"
+#include "common.hpp"
+#include <numeric>
+#ifdef isMT
+#include "algorithms/shor.hpp"
+#include "task.h"
+#include <thread>
+#endif
 
 static unsigned long long CalculateIterations(const unsigned short n_qubits) {
     constexpr long double PI_4 =
@@ -20,7 +29,7 @@ mEdge buildUnitary(const std::vector<mEdge> &g) {
     }
 
     mEdge rhs = g[0];
-    for (int i = 1; i < g.size(); i++) {
+    for (std::size_t i = 1; i < g.size(); i++) {
         // std::cout<<"i: "<<i<<std::endl;
         rhs = mm_multiply(g[i], rhs);
     }
@@ -34,7 +43,7 @@ static mEdge groverIteration(const std::string &oracle, QubitCount n_qubits) {
 
     // prepare oracle
     Controls controls;
-    for (auto i = 0; i < n_qubits; i++) {
+    for (Qubit i = 0; i < Qubit(n_qubits); i++) {
         controls.emplace(Control{i, oracle.at(i) == '1' ? Control::Type::pos
                                                         : Control::Type::neg});
     }
@@ -50,11 +59,11 @@ static mEdge groverIteration(const std::string &oracle, QubitCount n_qubits) {
     mEdge d = makeIdent(n_qubits);
     g.push_back(d);
     // 1. H to data qubits
-    for (auto i = 0; i < n_qubits; i++) {
+    for (Qubit i = 0; i < Qubit(n_qubits); i++) {
         g.emplace_back(makeGate(total_qubits, Hmat, i));
     }
     // 2. X to data qubits
-    for (auto i = 0; i < n_qubits; i++) {
+    for (Qubit i = 0; i < Qubit(n_qubits); i++) {
         g.emplace_back(makeGate(total_qubits, Xmat, i));
     }
 
@@ -63,7 +72,7 @@ static mEdge groverIteration(const std::string &oracle, QubitCount n_qubits) {
 
     // 4. CX to the last data qubit
     Controls diff_controls;
-    for (auto i = 0; i < n_qubits - 1; i++) {
+    for (Qubit i = 0; i < Qubit(n_qubits) - 1; i++) {
         diff_controls.emplace(Control{i, Control::Type::pos});
     }
     g.emplace_back(makeGate(total_qubits, Xmat, n_qubits - 1, diff_controls));
@@ -72,13 +81,13 @@ static mEdge groverIteration(const std::string &oracle, QubitCount n_qubits) {
     g.emplace_back(makeGate(total_qubits, Hmat, n_qubits - 1));
 
     // 6. X to data qubits
-    for (auto i = 0; i < n_qubits; i++) {
+    for (Qubit i = 0; i < Qubit(n_qubits); i++) {
         g.emplace_back(makeGate(total_qubits, Xmat, i));
     }
 
     // 7. H to all qubits
 
-    for (auto i = 0; i < n_qubits; i++) {
+    for (Qubit i = 0; i < Qubit(n_qubits); i++) {
         g.emplace_back(makeGate(total_qubits, Hmat, i));
     }
 
@@ -86,7 +95,6 @@ static mEdge groverIteration(const std::string &oracle, QubitCount n_qubits) {
 }
 
 vEdge grover(QubitCount n_qubits) {
-    auto t1 = std::chrono::high_resolution_clock::now();
     std::size_t iterations = CalculateIterations(n_qubits);
     std::mt19937_64 mt;
     std::array<std::mt19937_64::result_type, std::mt19937_64::state_size>
@@ -99,7 +107,7 @@ vEdge grover(QubitCount n_qubits) {
     // Generate random oracle
     std::uniform_int_distribution<int> dist(0, 1); // range is inclusive
     std::string oracle = std::string(n_qubits, '0');
-    for (Qubit i = 0; i < n_qubits; i++) {
+    for (QubitCount i = 0; i < n_qubits; i++) {
         if (dist(mt) == 1) {
             oracle[i] = '1';
         }
@@ -113,12 +121,11 @@ vEdge grover(QubitCount n_qubits) {
     std::vector<mEdge> setup_gates;
     setup_gates.emplace_back(makeGate(total_qubits, Xmat, n_qubits));
     // apply H to all qubits
-    for (auto i = 0; i < n_qubits; i++) {
+    for (Qubit i = 0; i < Qubit(n_qubits); i++) {
         setup_gates.emplace_back(makeGate(total_qubits, Hmat, i));
     }
     mEdge setup = buildUnitary(setup_gates);
 
-    auto t3 = std::chrono::high_resolution_clock::now();
     vEdge state = makeZeroState(total_qubits);
     state = mv_multiply(setup, state);
 
@@ -128,7 +135,6 @@ vEdge grover(QubitCount n_qubits) {
         state = mv_multiply(full_iteration, state);
         j_pre++;
     }
-    int i = 0;
     for (unsigned long long j = j_pre; j < iterations; j += 8) {
         state = mv_multiply(full_iteration, state);
         state = mv_multiply(full_iteration, state);
@@ -159,4 +165,531 @@ TEST(QddTest, MV_PerformanceTest){
     std::chrono::duration<double, std::milli> ms = t2 - t1;
     std::cout << ms.count() << " milliseconds" << std::endl;
     ASSERT_TRUE(ms.count() < 5000); // less than 1 second
-}
\ No newline at end of file
+}
+
+// Grover with both compute tables starting out empty, so that the hit
+// ratios of the chained and the FLAT_CACHE layout can be compared.
+TEST(QddTest, ComputeTable_PerformanceTest){
+    _aCache.clearAll();
+    _mCache.clearAll();
+    auto t1 = std::chrono::high_resolution_clock::now();
+    grover(18);
+    auto t2 = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> ms = t2 - t1;
+    std::cout << ms.count() << " milliseconds" << std::endl;
+    std::cout << "add cache: " << _aCache.hitRatio() << std::endl;
+    std::cout << "mul cache: " << _mCache.hitRatio() << std::endl;
+    ASSERT_TRUE(ms.count() < 5000);
+}
+
+// Inserts n distinct nodes over 16 qubit levels in random order (every
+// lookup misses), then looks all of them up again in another random order
+// (every lookup hits). Returns the milliseconds spent in each round.
+template <typename Table>
+static std::pair<double, double> uniqueTableLookups(Table &table, std::size_t n) {
+    auto fill = [&table](std::size_t i) {
+        vNode *node = table.getNode();
+        node->v = i % 16;
+        node->children = {vEdge{{SQRT2, 0.0}, vNode::terminal},
+                          vEdge{{static_cast<double>(i), 0.0}, vNode::terminal}};
+        return table.lookup(node);
+    };
+
+    std::mt19937_64 mt(0);
+    std::vector<std::size_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::chrono::duration<double, std::milli> ms[2];
+
+    for (int round = 0; round < 2; round++) {
+        std::shuffle(order.begin(), order.end(), mt);
+        auto t1 = std::chrono::high_resolution_clock::now();
+        for (std::size_t i : order) {
+            fill(i);
+        }
+        auto t2 = std::chrono::high_resolution_clock::now();
+        ms[round] = t2 - t1;
+    }
+    return {ms[0].count(), ms[1].count()};
+}
+
+TEST(QddTest, UniqueTable_PerformanceTest){
+    const std::size_t n = 1 << 21;
+    CHashTable<vNode, std::hash<vNode>, std::equal_to<vNode>, ChainedBuckets> chained(16);
+    CHashTable<vNode> line(16);
+    auto [chained_miss, chained_hit] = uniqueTableLookups(chained, n);
+    auto [line_miss, line_hit] = uniqueTableLookups(line, n);
+    std::cout << "chained: " << chained_miss << " / " << chained_hit
+              << " milliseconds (insert / hit)" << std::endl;
+    std::cout << "cache-line: " << line_miss << " / " << line_hit
+              << " milliseconds (insert / hit)" << std::endl;
+    ASSERT_TRUE(line_miss + line_hit < 5000);
+}
+
+// Layers of rotations and CNOTs, every gate made and applied by
+// mv_multiply, and applied directly by applyGate.
+TEST(QddTest, ApplyGate_PerformanceTest){
+    const QubitCount n = 14;
+    for (bool direct : {false, true}) {
+        EngineConfig config;
+        config.qubits = n;
+        configure(config);
+
+        std::mt19937_64 mt(0);
+        std::uniform_real_distribution<double> angle(0.0, 2 * PI);
+        auto t1 = std::chrono::high_resolution_clock::now();
+        vEdge v = makeZeroState(n);
+        for (int layer = 0; layer < 4; layer++) {
+            for (QubitCount q = 0; q < n; q++) {
+                GateMatrix g = ry(angle(mt));
+                v = direct ? applyGate(v, g, q) : mv_multiply(makeGate(n, g, q), v);
+            }
+            for (Qubit q = 1; q < Qubit(n); q++) {
+                Controls c{Control{q - 1, Control::Type::pos}};
+                v = direct ? applyGate(v, Xmat, q, c) : mv_multiply(makeGate(n, Xmat, q, c), v);
+            }
+        }
+        auto t2 = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::milli> ms = t2 - t1;
+        std::cout << (direct ? "applyGate: " : "mv_multiply: ") << ms.count() << " milliseconds"
+                  << std::endl;
+
+        ASSERT_NEAR(squaredNorm(amplitudes(v)), 1.0, 1e-6);
+        ASSERT_TRUE(ms.count() < 20000);
+    }
+    configure(EngineConfig{});
+}
+
+// The controlled phases and CNOTs of a QFT-like circuit on an entangled
+// state, through mv_multiply and through the diagonal and antidiagonal
+// paths of applyGate.
+TEST(QddTest, PhaseGate_PerformanceTest){
+    const QubitCount n = 14;
+    for (bool direct : {false, true}) {
+        EngineConfig config;
+        config.qubits = n;
+        configure(config);
+
+        std::mt19937_64 mt(0);
+        std::uniform_real_distribution<double> angle(0.0, 2 * PI);
+        vEdge v = makeZeroState(n);
+        for (QubitCount q = 0; q < n; q++) {
+            v = applyGate(v, ry(angle(mt)), q);
+        }
+
+        auto t1 = std::chrono::high_resolution_clock::now();
+        for (int round = 0; round < 2; round++) {
+            for (Qubit t = n - 1; t >= 0; t--) {
+                for (Qubit c = t - 1; c >= 0; c--) {
+                    Controls controls{Control{c, Control::Type::pos}};
+                    GateMatrix g = p(PI / (1 << std::min(t - c, 30)));
+                    v = direct ? applyGate(v, g, t, controls)
+                               : mv_multiply(makeGate(n, g, t, controls), v);
+                }
+                if (t > 0) {
+                    Controls controls{Control{t - 1, Control::Type::pos}};
+                    v = direct ? applyGate(v, Xmat, t, controls)
+                               : mv_multiply(makeGate(n, Xmat, t, controls), v);
+                }
+            }
+        }
+        auto t2 = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::milli> ms = t2 - t1;
+        std::cout << (direct ? "applyGate: " : "mv_multiply: ") << ms.count() << " milliseconds"
+                  << std::endl;
+
+        ASSERT_NEAR(squaredNorm(amplitudes(v)), 1.0, 1e-6);
+        ASSERT_TRUE(ms.count() < 20000);
+    }
+    configure(EngineConfig{});
+}
+
+// Shots of an entangled state, one measureAll per shot and all of them at
+// once by sampleShots.
+TEST(QddTest, SampleShots_PerformanceTest){
+    const QubitCount n = 12;
+    const std::size_t shots = 10000;
+    std::mt19937_64 mt(0);
+    vEdge v = makeZeroState(n);
+    for (const mEdge &g : ryCxLayers(n, 2, 0)) {
+        v = mv_multiply(g, v);
+    }
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    std::map<std::string, std::size_t> measured;
+    for (std::size_t i = 0; i < shots; i++) {
+        measured[measureAll(v, false, mt)]++;
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+    std::map<std::string, std::size_t> sampled = sampleShots(v, shots, 0);
+    auto t3 = std::chrono::high_resolution_clock::now();
+
+    std::chrono::duration<double, std::milli> one = t2 - t1;
+    std::chrono::duration<double, std::milli> all = t3 - t2;
+    std::cout << "measureAll: " << one.count() << " milliseconds, sampleShots: " << all.count()
+              << " milliseconds, " << sampled.size() << " outcomes" << std::endl;
+    std::size_t total = 0;
+    for (const auto &[outcome, count] : sampled) {
+        total += count;
+    }
+    ASSERT_EQ(total, shots);
+    ASSERT_TRUE(one.count() + all.count() < 20000);
+}
+
+// Collapsing every qubit of a few random states in turn, by a projector gate
+// as measureOneCollapsing() used to and by collapse(), and all of their
+// even qubits at once.
+TEST(QddTest, Collapse_PerformanceTest){
+    const QubitCount n = 12;
+    std::mt19937_64 mt(0);
+    std::vector<vEdge> states;
+    for (int i = 0; i < 5; i++) {
+        vEdge v = makeZeroState(n);
+        for (const mEdge &g : ryCxLayers(n, 2, i)) {
+            v = mv_multiply(g, v);
+        }
+        states.push_back(v);
+    }
+    const GateMatrix projector{cf_one, cf_zero, cf_zero, cf_zero};
+    std::vector<Qubit> even;
+    for (QubitCount q = 0; q < n; q += 2) {
+        even.push_back(q);
+    }
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    std::size_t nodes = 0;
+    for (const vEdge &v : states) {
+        for (QubitCount q = 0; q < n; q++) {
+            nodes += get_nNodes(mv_multiply(makeGate(n, projector, q), v));
+        }
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+    for (const vEdge &v : states) {
+        for (Qubit q = 0; q < Qubit(n); q++) {
+            nodes -= get_nNodes(collapse(v, {q}, "0"));
+        }
+    }
+    auto t3 = std::chrono::high_resolution_clock::now();
+    for (vEdge v : states) {
+        measureCollapsing(v, even, mt);
+    }
+    auto t4 = std::chrono::high_resolution_clock::now();
+
+    std::chrono::duration<double, std::milli> gate = t2 - t1;
+    std::chrono::duration<double, std::milli> direct = t3 - t2;
+    std::chrono::duration<double, std::milli> together = t4 - t3;
+    std::cout << "projector: " << gate.count() << " milliseconds, collapse: " << direct.count()
+              << " milliseconds, " << even.size() << " qubits at once: " << together.count()
+              << " milliseconds" << std::endl;
+    ASSERT_EQ(nodes, 0);
+    ASSERT_TRUE(gate.count() + direct.count() + together.count() < 20000);
+}
+
+// <Z> of every qubit of a qcbm-like state from the dense vector and by
+// expectation(), and the distribution of four of its qubits.
+TEST(QddTest, Expectation_PerformanceTest){
+    const QubitCount n = 16;
+    std::mt19937_64 mt(0);
+    vEdge v = makeZeroState(n);
+    for (const mEdge &g : ryCxLayers(n, 2, 0)) {
+        v = mv_multiply(g, v);
+    }
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    std::vector<double> dense(n, 0.0);
+    std::size_t dim;
+    std_complex *amplitudes = v.getVector(&dim);
+    for (std::size_t i = 0; i < dim; i++) {
+        double p = amplitudes[i].r * amplitudes[i].r + amplitudes[i].i * amplitudes[i].i;
+        for (QubitCount q = 0; q < n; q++) {
+            dense[q] += (i >> q & 1) == 0 ? p : -p;
+        }
+    }
+    delete[] amplitudes;
+    auto t2 = std::chrono::high_resolution_clock::now();
+    std::vector<double> dd(n);
+    for (QubitCount q = 0; q < n; q++) {
+        std::string pauli(n, 'I');
+        pauli[n - 1 - q] = 'Z';
+        dd[q] = expectation(v, pauli);
+    }
+    auto t3 = std::chrono::high_resolution_clock::now();
+    std::vector<double> marginal = marginalProbabilities(v, {0, 5, 10, 15});
+    auto t4 = std::chrono::high_resolution_clock::now();
+
+    std::chrono::duration<double, std::milli> vector = t2 - t1;
+    std::chrono::duration<double, std::milli> traversal = t3 - t2;
+    std::chrono::duration<double, std::milli> four = t4 - t3;
+    std::cout << "getVector: " << vector.count() << " milliseconds, expectation: "
+              << traversal.count() << " milliseconds, marginal of 4 qubits: " << four.count()
+              << " milliseconds" << std::endl;
+    for (QubitCount q = 0; q < n; q++) {
+        ASSERT_NEAR(dd[q], dense[q], 1e-6);
+    }
+    ASSERT_NEAR(std::accumulate(marginal.begin(), marginal.end(), 0.0), 1.0, 1e-9);
+    ASSERT_TRUE(vector.count() + traversal.count() + four.count() < 20000);
+}
+
+// A circuit measuring one qubit after each of its layers, every shot from
+// the zero state as the backend used to, and all at once by
+// simulateBranching().
+TEST(QddTest, Branching_PerformanceTest){
+    const QubitCount n = 10;
+    const std::size_t shots = 1000;
+    const std::size_t layers = 3;
+    std::mt19937_64 mt(0);
+    std::uniform_real_distribution<double> angle(0.0, 2 * PI);
+    std::vector<CircuitOp> ops;
+    for (std::size_t layer = 0; layer < layers; layer++) {
+        for (QubitCount q = 0; q < n; q++) {
+            ops.push_back(CircuitOp::gate(ry(angle(mt)), q));
+        }
+        for (Qubit q = 1; q < Qubit(n); q++) {
+            ops.push_back(CircuitOp::gate(Xmat, q, Controls{Control{q - 1, Control::Type::pos}}));
+        }
+        ops.push_back(CircuitOp::measure(layer, layer));
+    }
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    std::map<std::string, std::size_t> perShot;
+    for (std::size_t i = 0; i < shots; i++) {
+        vEdge v = makeZeroState(n);
+        std::string cbits(layers, '0');
+        for (const CircuitOp &op : ops) {
+            if (op.kind == CircuitOp::Kind::Measure) {
+                cbits[op.cbit] = measureOneCollapsing(v, op.target, mt);
+            } else {
+                v = applyGate(v, op.g, op.target, op.controls);
+            }
+        }
+        perShot[std::string(cbits.rbegin(), cbits.rend())]++;
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+    std::map<std::string, std::size_t> branched = simulateBranching(n, layers, ops, shots, 0);
+    auto t3 = std::chrono::high_resolution_clock::now();
+
+    std::chrono::duration<double, std::milli> each = t2 - t1;
+    std::chrono::duration<double, std::milli> all = t3 - t2;
+    std::cout << "per shot: " << each.count() << " milliseconds, branching: " << all.count()
+              << " milliseconds, " << branched.size() << " outcomes" << std::endl;
+    std::size_t total = 0;
+    for (const auto &[outcome, count] : branched) {
+        total += count;
+    }
+    ASSERT_EQ(total, shots);
+    ASSERT_TRUE(each.count() + all.count() < 20000);
+}
+
+// The qcbm circuit (test/qcbm.cpp) gate by gate and with runs of its gates
+// fused into ones of a few qubits first, fusion included in the time.
+TEST(QddTest, Fusion_PerformanceTest){
+    const QubitCount n = 12;
+    for (QubitCount span : {0u, 2u, 3u, 4u}) {
+        EngineConfig config;
+        config.qubits = n;
+        config.fusionSpan = span;
+        configure(config);
+
+        std::mt19937_64 mt(0);
+        std::uniform_real_distribution<double> dist(0.0, 1.0);
+        std::vector<mEdge> gates;
+        auto rotate = [&](mEdge (*gate)(QubitCount, int, double)) {
+            double angle = dist(mt);
+            for (QubitCount q = 0; q < n; q++) {
+                gates.push_back(gate(n, q, angle));
+            }
+        };
+        auto entangle = [&] {
+            for (QubitCount q = 0; q < n; q++) {
+                gates.push_back(CX(n, (q + 1) % n, q));
+            }
+        };
+        rotate(RX);
+        rotate(RZ);
+        entangle();
+        for (int k = 0; k < 8; k++) {
+            rotate(RZ);
+            rotate(RX);
+            rotate(RZ);
+            entangle();
+        }
+        rotate(RZ);
+        rotate(RX);
+
+        auto t1 = std::chrono::high_resolution_clock::now();
+        std::vector<mEdge> fused = fuseGates(gates);
+        vEdge v = makeZeroState(n);
+        for (const mEdge &g : fused) {
+            v = mv_multiply(g, v);
+        }
+        auto t2 = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::milli> ms = t2 - t1;
+        std::cout << "span " << span << ": " << ms.count() << " milliseconds, "
+                  << fused.size() << " of " << gates.size() << " gates" << std::endl;
+
+        ASSERT_NEAR(squaredNorm(amplitudes(v)), 1.0, 1e-6);
+        ASSERT_TRUE(ms.count() < 20000);
+    }
+    configure(EngineConfig{});
+}
+
+#ifdef isMT
+// Several threads simulate the same circuit at once, for each choice of
+// compute cache tiers. Only the shared tier lets a thread reuse what the
+// others have computed.
+TEST(QddTest, CacheTiers_PerformanceTest){
+    const QubitCount n = 14;
+    const int threads = 4;
+    for (CacheTiers tiers : {CacheTiers::Local, CacheTiers::Shared, CacheTiers::Both}) {
+        EngineConfig config;
+        config.qubits = n;
+        config.cacheTiers = tiers;
+        configure(config);
+        std::vector<mEdge> gates = ryCxLayers(n, 4, 0);
+
+        std::vector<vEdge> results(threads);
+        auto t1 = std::chrono::high_resolution_clock::now();
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t] {
+                vEdge v = makeZeroState(n);
+                for (const mEdge &g : gates) {
+                    v = mv_multiply(g, v);
+                }
+                results[t] = v;
+            });
+        }
+        for (std::thread &w : workers) {
+            w.join();
+        }
+        auto t2 = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::milli> ms = t2 - t1;
+
+        const char *name = tiers == CacheTiers::Local    ? "local"
+                           : tiers == CacheTiers::Shared ? "shared"
+                                                         : "both";
+        std::cout << name << ": " << ms.count() << " milliseconds, ";
+        std::cout << "mul cache: " << _mCache.hitRatio() << std::endl;
+
+        std::vector<std_complex> expected = amplitudes(results[0]);
+        for (int t = 1; t < threads; t++) {
+            std::vector<std_complex> actual = amplitudes(results[t]);
+            for (std::size_t i = 0; i < actual.size(); i++) {
+                ASSERT_NEAR(actual[i].r, expected[i].r, 1e-9);
+                ASSERT_NEAR(actual[i].i, expected[i].i, 1e-9);
+            }
+        }
+        ASSERT_TRUE(ms.count() < 20000);
+    }
+    configure(EngineConfig{});
+}
+
+// One state goes through the circuit, with the top levels of every
+// mv_multiply forked onto the workers of a Scheduler and without. Forked,
+// the ready fibers of every thread are in boost's spinlocked queue or in
+// the Chase-Lev deque.
+TEST(QddTest, ForkJoin_PerformanceTest){
+    const QubitCount n = 14;
+    const std::pair<Qubit, ReadyQueue> runs[] = {{NO_FORK, ReadyQueue::ChaseLev},
+                                                 {n - 4, ReadyQueue::Spinlock},
+                                                 {n - 4, ReadyQueue::ChaseLev}};
+    for (auto [forkLevel, queue] : runs) {
+        Scheduler scheduler(3, INT32_MAX, queue);
+        EngineConfig config;
+        config.qubits = n;
+        config.forkLevel = forkLevel;
+        configure(config);
+        std::vector<mEdge> gates = ryCxLayers(n, 4, 0);
+
+        auto t1 = std::chrono::high_resolution_clock::now();
+        vEdge v = makeZeroState(n);
+        for (const mEdge &g : gates) {
+            v = mv_multiply(g, v);
+        }
+        auto t2 = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::milli> ms = t2 - t1;
+        StealStats stats = scheduler.stealStats();
+        std::cout << (forkLevel == NO_FORK              ? "sequential: "
+                      : queue == ReadyQueue::Spinlock ? "forked, spinlock: "
+                                                      : "forked, chase-lev: ")
+                  << ms.count() << " milliseconds, steals: " << stats.steals << " / "
+                  << stats.attempts << " in " << stats.time.count() / 1000 << " ms"
+                  << std::endl;
+
+        ASSERT_NEAR(squaredNorm(amplitudes(v)), 1.0, 1e-6);
+        ASSERT_LE(stats.steals, stats.attempts);
+        ASSERT_TRUE(ms.count() < 20000);
+    }
+    configure(EngineConfig{});
+}
+
+// Fuses a long gate sequence into one unitary, folding it in order and
+// through the tree of Scheduler::buildUnitary with forking sub-products.
+// Phases and permutations keep every partial product small; for dense
+// ones the products of the tree cost far more than folding in gates.
+TEST(QddTest, BuildUnitary_PerformanceTest){
+    Scheduler scheduler(3, INT32_MAX);
+    // RZ keeps the products small, RY makes them dense, where buildUnitary
+    // goes on folding
+    for (bool dense : {false, true}) {
+        const QubitCount n = dense ? 6 : 12;
+        for (bool tree : {false, true}) {
+            EngineConfig config;
+            config.qubits = n;
+            config.forkLevel = tree ? Qubit(n - 3) : NO_FORK;
+            configure(config);
+
+            std::mt19937_64 mt(0);
+            std::uniform_real_distribution<double> angle(0.0, 2 * PI);
+            std::vector<mEdge> gates;
+            for (int layer = 0; layer < 16; layer++) {
+                for (QubitCount q = 0; q < n; q++) {
+                    gates.push_back(dense ? RY(n, q, angle(mt)) : RZ(n, q, angle(mt)));
+                }
+                for (QubitCount q = 1; q < n; q++) {
+                    gates.push_back(CX(n, q, q - 1));
+                }
+            }
+
+            auto t1 = std::chrono::high_resolution_clock::now();
+            mEdge u;
+            if (tree) {
+                u = scheduler.buildUnitary(gates);
+            } else {
+                u = gates[0];
+                for (std::size_t i = 1; i < gates.size(); i++) {
+                    u = mm_multiply(gates[i], u);
+                }
+            }
+            auto t2 = std::chrono::high_resolution_clock::now();
+            std::chrono::duration<double, std::milli> ms = t2 - t1;
+            std::cout << (dense ? "RY " : "RZ ") << (tree ? "buildUnitary: " : "folded: ")
+                      << ms.count() << " milliseconds" << std::endl;
+
+            // the first column is the state the circuit makes from |0...0>
+            vEdge v = mv_multiply(u, makeZeroState(n));
+            ASSERT_NEAR(squaredNorm(amplitudes(v)), 1.0, 1e-6);
+            ASSERT_TRUE(ms.count() < 20000);
+        }
+    }
+    configure(EngineConfig{});
+}
+
+// Shor's circuit for 21 through Scheduler::buildCircuit, which fuses the
+// gates it is given first unless fusionSpan is 0. Unfused it takes minutes
+// in builds without optimization, so the times are only printed.
+TEST(QddTest, ShorFusion_PerformanceTest){
+    for (QubitCount span : {0u, 4u}) {
+        EngineConfig config;
+        config.fusionSpan = span;
+        configure(config);
+
+        Shor shor(21, 3, 1000);
+        auto t1 = std::chrono::high_resolution_clock::now();
+        shor.run();
+        auto t2 = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::milli> ms = t2 - t1;
+        std::cout << "span " << span << ": " << ms.count() << " milliseconds" << std::endl;
+    }
+    configure(EngineConfig{});
+}
+#endif